@@ -0,0 +1,66 @@
+#include "pch.h"
+#include "PidSet.h"
+
+void PidSet::Init() {
+	Clear();
+}
+
+ULONG PidSet::Slot(ULONG pid) {
+	// process IDs are handle values in the client ID table, so their low 2 bits are always clear
+	return ((pid >> 2) * 2654435761UL) & (PidTableSize - 1);
+}
+
+const ProtectedPid* PidSet::Find(ULONG pid) const {
+	// Add leaves half the slots free, so the loop always reaches an empty one
+	for (auto index = Slot(pid); _table[index].Pid; index = (index + 1) & (PidTableSize - 1))
+		if (_table[index].Pid == pid)
+			return &_table[index];
+	return nullptr;
+}
+
+bool PidSet::Add(ULONG pid, const ProtectAccess& access, ULONG statsSlot) {
+	auto index = Slot(pid);
+	for (; _table[index].Pid; index = (index + 1) & (PidTableSize - 1)) {
+		if (_table[index].Pid == pid) {
+			_table[index].Access.Process |= access.Process;
+			_table[index].Access.Thread |= access.Thread;
+			return true;
+		}
+	}
+
+	if (_count == MaxPids)
+		return false;
+
+	_table[index].Pid = pid;
+	_table[index].Access = access;
+	_table[index].StatsSlot = statsSlot;
+	_count++;
+	return true;
+}
+
+bool PidSet::Remove(ULONG pid) {
+	const ULONG mask = PidTableSize - 1;
+	auto hole = Slot(pid);
+	for (; _table[hole].Pid != pid; hole = (hole + 1) & mask)
+		if (_table[hole].Pid == 0)
+			return false;
+
+	// Find stops at the first free slot, so the PIDs after the removed one that probed past it
+	// are moved back over the gap rather than leaving it empty
+	for (auto next = (hole + 1) & mask; _table[next].Pid; next = (next + 1) & mask) {
+		// a PID whose own slot lies after the hole must not be moved in front of that slot
+		auto home = Slot(_table[next].Pid);
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			_table[hole] = _table[next];
+			hole = next;
+		}
+	}
+	_table[hole].Pid = 0;
+	_count--;
+	return true;
+}
+
+void PidSet::Clear() {
+	::memset(_table, 0, sizeof(_table));
+	_count = 0;
+}
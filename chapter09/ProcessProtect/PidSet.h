@@ -0,0 +1,58 @@
+#pragma once
+
+const ULONG MaxPids = 4096;
+const ULONG PidTableSize = 2 * MaxPids;		// must be a power of 2, at most half full
+
+// access rights removed from handles to a protected process and to its threads
+struct ProtectAccess {
+	ACCESS_MASK Process;
+	ACCESS_MASK Thread;
+};
+
+struct ProtectedPid {
+	ULONG Pid;				// zero for a free slot
+	ProtectAccess Access;
+	ULONG StatsSlot;		// where Telemetry counts its handle opens
+};
+
+//
+// the protected processes, looked up by the object callbacks on every handle open.
+// A fixed array of PidTableSize slots with linear probing; Add stops at MaxPids, so at least
+// half the slots stay free and a PID that is not protected is rejected after a few probes.
+// Not synchronized; the driver changes its set under its lock and the callbacks read copies published by Policy.
+//
+
+class PidSet {
+public:
+	void Init();
+
+	// returns nullptr if the PID is not in the set
+	const ProtectedPid* Find(ULONG pid) const;
+	bool Contains(ULONG pid) const {
+		return Find(pid) != nullptr;
+	}
+	// adds the PID with the stats slot, or the access to that of a PID already there;
+	// returns false if the set is full
+	bool Add(ULONG pid, const ProtectAccess& access, ULONG statsSlot);
+	// returns false if the PID was not in the set
+	bool Remove(ULONG pid);
+	void Clear();
+
+	ULONG Count() const {
+		return _count;
+	}
+
+	template<typename F>
+	void ForEach(F f) const {
+		for (auto& entry : _table)
+			if (entry.Pid)
+				f(entry);
+	}
+
+private:
+	static ULONG Slot(ULONG pid);
+
+private:
+	ProtectedPid _table[PidTableSize];
+	volatile ULONG _count;
+};
@@ -0,0 +1,68 @@
+#include "pch.h"
+#include "Policy.h"
+#include "ProcessProtect.h"
+
+NTSTATUS Policy::Init() {
+	for (auto& snapshot : _snapshots) {
+		snapshot = (PolicySnapshot*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(PolicySnapshot), DRIVER_TAG);
+		if (snapshot == nullptr) {
+			Term();
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		snapshot->Pids.Init();
+		snapshot->Rundown = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, DRIVER_TAG);
+		if (snapshot->Rundown == nullptr) {
+			Term();
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+	_current = _snapshots[0];
+	return STATUS_SUCCESS;
+}
+
+void Policy::Term() {
+	for (auto& snapshot : _snapshots) {
+		if (snapshot == nullptr)
+			continue;
+
+		if (snapshot->Rundown) {
+			ExWaitForRundownProtectionReleaseCacheAware(snapshot->Rundown);
+			ExFreeCacheAwareRundownProtection(snapshot->Rundown);
+		}
+		ExFreePool(snapshot);
+		snapshot = nullptr;
+	}
+	_current = nullptr;
+}
+
+bool Policy::Lookup(ULONG pid, ProtectedPid& entry) {
+	for (;;) {
+		auto snapshot = (PolicySnapshot*)ReadPointerAcquire((PVOID*)&_current);
+		if (ExAcquireRundownProtectionCacheAware(snapshot->Rundown)) {
+			// it may have been retired and refilled since we read the pointer
+			if (snapshot == ReadPointerAcquire((PVOID*)&_current)) {
+				auto found = snapshot->Pids.Count() ? snapshot->Pids.Find(pid) : nullptr;
+				if (found)
+					entry = *found;
+				ExReleaseRundownProtectionCacheAware(snapshot->Rundown);
+				return found != nullptr;
+			}
+			ExReleaseRundownProtectionCacheAware(snapshot->Rundown);
+		}
+		// a writer is swapping snapshots right now
+		YieldProcessor();
+	}
+}
+
+void Policy::Publish(const PidSet& pids) {
+	auto current = _current;
+	auto next = _snapshots[0] == current ? _snapshots[1] : _snapshots[0];
+
+	// wait out the lookups that started before the previous swap
+	ExWaitForRundownProtectionReleaseCacheAware(next->Rundown);
+	ExReInitializeRundownProtectionCacheAware(next->Rundown);
+
+	next->Pids = pids;
+	InterlockedExchangePointer((PVOID*)&_current, next);
+}
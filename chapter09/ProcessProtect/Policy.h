@@ -0,0 +1,37 @@
+#pragma once
+
+#include "PidSet.h"
+
+// one published version of the protection policy, not changed while it is current
+struct PolicySnapshot {
+	PEX_RUNDOWN_REF_CACHE_AWARE Rundown;
+	PidSet Pids;
+};
+
+//
+// the protection policy as the object callbacks see it, read without taking a lock.
+// Writers publish a new version into the spare snapshot and swap it in atomically.
+// Readers hold the snapshot's cache aware rundown protection while they look it up,
+// and the spare is refilled only after its readers are gone. Snapshots are freed
+// only by Term, so a reader can safely find that the one it picked has been retired.
+//
+
+class Policy {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	// returns false if the process is not protected
+	bool Lookup(ULONG pid, ProtectedPid& entry);
+	bool IsProtected(ULONG pid) {
+		ProtectedPid entry;
+		return Lookup(pid, entry);
+	}
+
+	// copies the set into a new snapshot and makes it current; callers serialize
+	void Publish(const PidSet& pids);
+
+private:
+	PolicySnapshot* _snapshots[2];
+	PolicySnapshot* volatile _current;
+};
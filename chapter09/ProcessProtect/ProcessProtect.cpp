@@ -10,10 +10,17 @@ DRIVER_UNLOAD ProcessProtectUnload;
 DRIVER_DISPATCH ProcessProtectCreateClose, ProcessProtectDeviceControl;
 
 OB_PREOP_CALLBACK_STATUS OnPreOpenProcess(PVOID RegistrationContext, POB_PRE_OPERATION_INFORMATION Info);
+OB_PREOP_CALLBACK_STATUS OnPreOpenThread(PVOID RegistrationContext, POB_PRE_OPERATION_INFORMATION Info);
+void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo);
 
-bool FindProcess(ULONG pid);
-bool AddProcess(ULONG pid);
-bool RemoveProcess(ULONG pid);
+// change g_Data.Pids with the lock held, keeping the stats slots in step
+bool AddProtected(ULONG pid, const ProtectAccess& access);
+bool RemoveProtected(ULONG pid);
+void ClearProtected();
+NTSTATUS GetStats(PVOID buffer, ULONG size, ULONG& len);
+
+// exported by the kernel, declared in ntifs.h; STATUS_PENDING until the process starts exiting
+extern "C" NTKERNELAPI NTSTATUS PsGetProcessExitStatus(PEPROCESS Process);
 
 // GLOBALS
 
@@ -25,27 +32,36 @@ extern "C"
 NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 	KdPrint((DRIVER_PREFIX "DriverEntry entered\n"));
 
-	g_Data.Init();
+	auto status = g_Data.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to initialize policy (status=%08X)\n", status));
+		return status;
+	}
 
 	OB_OPERATION_REGISTRATION operations[] = {
 		{ 
 			PsProcessType,		// object type
 			OB_OPERATION_HANDLE_CREATE | OB_OPERATION_HANDLE_DUPLICATE, 
 			OnPreOpenProcess, nullptr	// pre, post
+		},
+		{
+			PsThreadType,
+			OB_OPERATION_HANDLE_CREATE | OB_OPERATION_HANDLE_DUPLICATE,
+			OnPreOpenThread, nullptr
 		}
 	};
 	OB_CALLBACK_REGISTRATION reg = {
 		OB_FLT_REGISTRATION_VERSION, 
-		1,				// operation count
+		ARRAYSIZE(operations),	// operation count
 		RTL_CONSTANT_STRING(L"12345.6171"),		// altitude
 		nullptr,		// context
 		operations
 	};
 
-	auto status = STATUS_SUCCESS;
 	UNICODE_STRING deviceName = RTL_CONSTANT_STRING(L"\\Device\\" PROCESS_PROTECT_NAME);
 	UNICODE_STRING symName = RTL_CONSTANT_STRING(L"\\??\\" PROCESS_PROTECT_NAME);
 	PDEVICE_OBJECT DeviceObject = nullptr;
+	bool processCallbacks = false;
 
 	do {
 		status = ObRegisterCallbacks(&reg, &g_Data.RegHandle);
@@ -54,6 +70,14 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 			break;
 		}
 
+		// removes protected processes as they exit, before their PIDs can be reused
+		status = PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, FALSE);
+		if (!NT_SUCCESS(status)) {
+			KdPrint((DRIVER_PREFIX "failed to register process callback (status=%08X)\n", status));
+			break;
+		}
+		processCallbacks = true;
+
 		status = IoCreateDevice(DriverObject, 0, &deviceName, FILE_DEVICE_UNKNOWN, 0, FALSE, &DeviceObject);
 		if (!NT_SUCCESS(status)) {
 			KdPrint((DRIVER_PREFIX "failed to create device object (status=%08X)\n", status));
@@ -70,8 +94,11 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 	if (!NT_SUCCESS(status)) {
 		if (DeviceObject)
 			IoDeleteDevice(DeviceObject);
+		if (processCallbacks)
+			PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
 		if(g_Data.RegHandle)
 			ObUnRegisterCallbacks(g_Data.RegHandle);
+		g_Data.Term();
 		return status;
 	}
 
@@ -85,11 +112,14 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 }
 
 void ProcessProtectUnload(PDRIVER_OBJECT DriverObject) {
+	PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
 	ObUnRegisterCallbacks(g_Data.RegHandle);
 
 	UNICODE_STRING symName = RTL_CONSTANT_STRING(L"\\??\\" PROCESS_PROTECT_NAME);
 	IoDeleteSymbolicLink(&symName);
 	IoDeleteDevice(DriverObject->DeviceObject);
+
+	g_Data.Term();
 }
 
 NTSTATUS ProcessProtectCreateClose(PDEVICE_OBJECT, PIRP Irp) {
@@ -115,30 +145,45 @@ NTSTATUS ProcessProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 
 			auto data = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
 
-			AutoLock locker(g_Data.Lock);
-
-			for (int i = 0; i < size / sizeof(ULONG); i++) {
-				auto pid = data[i];
-				if (pid == 0) {
-					status = STATUS_INVALID_PARAMETER;
-					break;
-				}
-				if (FindProcess(pid))
-					continue;
-
-				if (g_Data.PidsCount == MaxPids) {
-					status = STATUS_TOO_MANY_CONTEXT_IDS;
-					break;
+			// a process that starts exiting before we publish sees this and waits for the lock (OnProcessNotify)
+			InterlockedIncrement(&g_Data.AddsInProgress);
+			{
+				AutoLock locker(g_Data.Lock);
+
+				for (int i = 0; i < size / sizeof(ULONG); i++) {
+					auto pid = data[i];
+					if (pid == 0) {
+						status = STATUS_INVALID_PARAMETER;
+						break;
+					}
+					auto entry = g_Data.Pids.Find(pid);
+					if (entry && (entry->Access.Process & PROCESS_TERMINATE))
+						continue;
+
+					// only running processes, as nothing would remove the PID of one that has already exited
+					PEPROCESS process;
+					status = PsLookupProcessByProcessId(ULongToHandle(pid), &process);
+					if (!NT_SUCCESS(status))
+						break;
+					auto exiting = PsGetProcessExitStatus(process) != STATUS_PENDING;
+					ObDereferenceObject(process);
+					if (exiting) {
+						status = STATUS_PROCESS_IS_TERMINATING;
+						break;
+					}
+
+					if (!AddProtected(pid, { PROCESS_TERMINATE, 0 })) {
+						status = STATUS_TOO_MANY_CONTEXT_IDS;
+						break;
+					}
+
+					len += sizeof(ULONG);
 				}
 
-				if (!AddProcess(pid)) {
-					status = STATUS_UNSUCCESSFUL;
-					break;
-				}
-
-				len += sizeof(ULONG);
+				if (len)
+					g_Data.Policy.Publish(g_Data.Pids);
 			}
-
+			InterlockedDecrement(&g_Data.AddsInProgress);
 			break;
 		}
 
@@ -160,23 +205,55 @@ NTSTATUS ProcessProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 					status = STATUS_INVALID_PARAMETER;
 					break;
 				}
-				if (!RemoveProcess(pid))
+				if (!RemoveProtected(pid))
 					continue;
 
 				len += sizeof(ULONG);
 
-				if (g_Data.PidsCount == 0)
+				if (g_Data.Pids.Count() == 0)
 					break;
 			}
 
+			if (len)
+				g_Data.Policy.Publish(g_Data.Pids);
 			break;
 		}
 
 		case IOCTL_PROCESS_PROTECT_CLEAR:
 		{
 			AutoLock locker(g_Data.Lock);
-			::memset(&g_Data.Pids, 0, sizeof(g_Data.Pids));
-			g_Data.PidsCount = 0;
+			ClearProtected();
+			g_Data.Policy.Publish(g_Data.Pids);
+			break;
+		}
+
+		case IOCTL_PROCESS_PROTECT_ADD_RULE:
+		{
+			auto rule = (ProtectRule*)Irp->AssociatedIrp.SystemBuffer;
+			if (rule == nullptr) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+
+			AutoLock locker(g_Data.Lock);
+			status = g_Data.Rules.Add(rule, stack->Parameters.DeviceIoControl.InputBufferLength);
+			break;
+		}
+
+		case IOCTL_PROCESS_PROTECT_CLEAR_RULES:
+		{
+			// processes already matched stay protected
+			AutoLock locker(g_Data.Lock);
+			g_Data.Rules.Clear();
+			break;
+		}
+
+		case IOCTL_PROCESS_PROTECT_GET_STATS:
+		{
+			ULONG bytes = 0;
+			AutoLock locker(g_Data.Lock);
+			status = GetStats(Irp->AssociatedIrp.SystemBuffer, stack->Parameters.DeviceIoControl.OutputBufferLength, bytes);
+			len = bytes;
 			break;
 		}
 
@@ -195,43 +272,121 @@ OB_PREOP_CALLBACK_STATUS OnPreOpenProcess(PVOID /* RegistrationContext */, POB_P
 	if(Info->KernelHandle)
 		return OB_PREOP_SUCCESS;
 
+	// a protected process still opens itself with full access, as it does its own threads
 	auto process = (PEPROCESS)Info->Object;
+	if (process == PsGetCurrentProcess())
+		return OB_PREOP_SUCCESS;
+
 	auto pid = HandleToULong(PsGetProcessId(process));
 
-	AutoLock locker(g_Data.Lock);
-	if (FindProcess(pid)) {
-		// found in list, remove terminate access
-		Info->Parameters->CreateHandleInformation.DesiredAccess &= ~PROCESS_TERMINATE;
+	ProtectedPid entry;
+	if (g_Data.Policy.Lookup(pid, entry)) {
+		// found in list, remove the access it protects against
+		auto& desiredAccess = Info->Parameters->CreateHandleInformation.DesiredAccess;
+		auto stripped = desiredAccess & entry.Access.Process;
+		desiredAccess &= ~entry.Access.Process;
+		g_Data.Telemetry.Record(entry.StatsSlot, HandleToULong(PsGetCurrentProcessId()), stripped);
+	}
+
+	return OB_PREOP_SUCCESS;
+}
+
+OB_PREOP_CALLBACK_STATUS OnPreOpenThread(PVOID /* RegistrationContext */, POB_PRE_OPERATION_INFORMATION Info) {
+	if (Info->KernelHandle)
+		return OB_PREOP_SUCCESS;
+
+	// a process may need to suspend or terminate its own threads (runtimes do)
+	auto pid = PsGetThreadProcessId((PETHREAD)Info->Object);
+	if (pid == PsGetCurrentProcessId())
+		return OB_PREOP_SUCCESS;
+
+	ProtectedPid entry;
+	if (g_Data.Policy.Lookup(HandleToULong(pid), entry)) {
+		auto& desiredAccess = Info->Parameters->CreateHandleInformation.DesiredAccess;
+		auto stripped = desiredAccess & entry.Access.Thread;
+		desiredAccess &= ~entry.Access.Thread;
+		g_Data.Telemetry.Record(entry.StatsSlot, HandleToULong(PsGetCurrentProcessId()), stripped);
 	}
 
 	return OB_PREOP_SUCCESS;
 }
 
-bool FindProcess(ULONG pid) {
-	for (int i = 0; i < MaxPids; i++)
-		if (g_Data.Pids[i] == pid)
-			return true;
-	return false;
+void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
+	auto pid = HandleToULong(ProcessId);
+	if (CreateInfo) {
+		// the rules are matched once, here; the object callbacks only look up the result
+		if (g_Data.Rules.Count() == 0 || CreateInfo->ImageFileName == nullptr)
+			return;
+
+		AutoLock locker(g_Data.Lock);
+		ProtectAccess access;
+		if (!g_Data.Rules.Match(CreateInfo->ImageFileName, access))
+			return;
+		if (!AddProtected(pid, access)) {
+			KdPrint((DRIVER_PREFIX "too many protected processes, %u not protected\n", pid));
+			return;
+		}
+		g_Data.Policy.Publish(g_Data.Pids);
+		return;
+	}
+
+	// most exiting processes are not protected. The count is read first: a protect request
+	// that is done with it has published its PIDs, and one still busy may be adding this one
+	if (ReadAcquire(&g_Data.AddsInProgress) == 0 && !g_Data.Policy.IsProtected(pid))
+		return;
+
+	AutoLock locker(g_Data.Lock);
+	if (RemoveProtected(pid))
+		g_Data.Policy.Publish(g_Data.Pids);
+}
+
+bool AddProtected(ULONG pid, const ProtectAccess& access) {
+	// a process has no stats slot only if they were all taken when it was added
+	auto slot = g_Data.Pids.Contains(pid) ? NoStatsSlot : g_Data.Telemetry.Allocate();
+	if (!g_Data.Pids.Add(pid, access, slot)) {
+		g_Data.Telemetry.Free(slot);
+		return false;
+	}
+	return true;
 }
 
-bool AddProcess(ULONG pid) {
-    for(int i = 0; i < MaxPids; i++)
-        if (g_Data.Pids[i] == 0) {
-            // empty slot
-            g_Data.Pids[i] = pid;
-            g_Data.PidsCount++;
-            return true;
-        }
-    return false;
+bool RemoveProtected(ULONG pid) {
+	auto entry = g_Data.Pids.Find(pid);
+	if (entry == nullptr)
+		return false;
+
+	g_Data.Telemetry.Free(entry->StatsSlot);
+	return g_Data.Pids.Remove(pid);
 }
 
-bool RemoveProcess(ULONG pid) {
-    for (int i = 0; i < MaxPids; i++)
-        if (g_Data.Pids[i] == pid) {
-            g_Data.Pids[i] = 0;
-            g_Data.PidsCount--;
-            return true;
-        }
-    return false;
+void ClearProtected() {
+	g_Data.Pids.ForEach([](auto& entry) {
+		g_Data.Telemetry.Free(entry.StatsSlot);
+	});
+	g_Data.Pids.Clear();
 }
 
+NTSTATUS GetStats(PVOID buffer, ULONG size, ULONG& len) {
+	if (buffer == nullptr || size < sizeof(ProtectStatsHeader))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	auto header = (ProtectStatsHeader*)buffer;
+	header->Count = g_Data.Pids.Count();
+	header->Returned = 0;
+	auto stats = (ProtectedProcessStats*)(header + 1);
+	auto max = (size - sizeof(ProtectStatsHeader)) / sizeof(ProtectedProcessStats);
+
+	g_Data.Pids.ForEach([&](auto& entry) {
+		if (header->Returned == max)
+			return;
+		auto& item = stats[header->Returned++];
+		item.Pid = entry.Pid;
+		item.ProcessAccess = entry.Access.Process;
+		item.ThreadAccess = entry.Access.Thread;
+		item.Flags = 0;
+		g_Data.Telemetry.Get(entry.StatsSlot, item);
+	});
+
+	len = sizeof(ProtectStatsHeader) + header->Returned * sizeof(ProtectedProcessStats);
+	return STATUS_SUCCESS;
+}
@@ -1,20 +1,41 @@
 #pragma once
 
 #define DRIVER_PREFIX "ProcessProtect: "
+#define DRIVER_TAG 'torp'
 
 #define PROCESS_TERMINATE 1
 
 #include "FastMutex.h"
-
-const int MaxPids = 256;
+#include "PidSet.h"
+#include "Policy.h"
+#include "RuleTable.h"
+#include "Telemetry.h"
 
 struct Globals {
-	int PidsCount;			// currently protected process count
-	ULONG Pids[MaxPids];	// protected PIDs
+	PidSet Pids;			// protected PIDs, changed under Lock and then published to Policy
+	RuleTable Rules;		// matched against new processes under Lock
 	FastMutex Lock;
+	Policy Policy;			// read by the object callbacks
+	Telemetry Telemetry;	// counted by the object callbacks
 	PVOID RegHandle;
+	volatile LONG AddsInProgress;	// protect requests between their process lookup and publishing
 
-	void Init() {
+	NTSTATUS Init() {
+		Pids.Init();
+		Rules.Init();
+		AddsInProgress = 0;
 		Lock.Init();
+		auto status = Telemetry.Init();
+		if (!NT_SUCCESS(status))
+			return status;
+		status = Policy.Init();
+		if (!NT_SUCCESS(status))
+			Telemetry.Term();
+		return status;
+	}
+
+	void Term() {
+		Policy.Term();
+		Telemetry.Term();
 	}
 };
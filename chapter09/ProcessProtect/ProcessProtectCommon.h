@@ -5,3 +5,46 @@
 #define IOCTL_PROCESS_PROTECT_BY_PID	CTL_CODE(0x8000, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_PROCESS_UNPROTECT_BY_PID	CTL_CODE(0x8000, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_PROCESS_PROTECT_CLEAR		CTL_CODE(0x8000, 0x802, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_PROCESS_PROTECT_ADD_RULE	CTL_CODE(0x8000, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PROCESS_PROTECT_CLEAR_RULES	CTL_CODE(0x8000, 0x804, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_PROCESS_PROTECT_GET_STATS	CTL_CODE(0x8000, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+const USHORT MaxRuleNameLength = 260;
+
+// protects processes created after it is added whose image matches Name (IOCTL_PROCESS_PROTECT_ADD_RULE)
+struct ProtectRule {
+	ULONG ProcessAccess;	// access rights removed from handles to matching processes
+	ULONG ThreadAccess;		// and from handles to their threads
+	USHORT NameLength;		// in characters, not NULL terminated
+	WCHAR Name[1];			// file name ("agent.exe") or path suffix ("\Agent\agent.exe"), case insensitive
+};
+
+const ULONG MaxRequesters = 4;
+
+struct RequesterStats {
+	ULONG Pid;				// zero for an unused entry
+	ULONG Opens;			// ones that had access removed
+};
+
+enum ProtectStatsFlags : ULONG {
+	ProtectStatsNotTracked = 1		// too many protected processes, no counters for this one
+};
+
+// one protected process in the IOCTL_PROCESS_PROTECT_GET_STATS output, counts since it was protected
+struct ProtectedProcessStats {
+	ULONG Pid;
+	ULONG ProcessAccess;		// removed from process handles
+	ULONG ThreadAccess;			// removed from thread handles
+	ULONG Flags;				// ProtectStatsFlags
+	ULONG64 Opens;				// process and thread handles opened
+	ULONG64 Stripped;			// of them, ones that had access removed
+	ULONG StrippedAccess;		// all the access bits removed
+	// the processes that had access removed most often; approximate when there were more
+	RequesterStats Requesters[MaxRequesters];
+};
+
+// followed by Returned ProtectedProcessStats
+struct ProtectStatsHeader {
+	ULONG Count;				// protected processes
+	ULONG Returned;				// fewer than Count if the output buffer is too small
+};
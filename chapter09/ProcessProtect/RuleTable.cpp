@@ -0,0 +1,62 @@
+#include "pch.h"
+#include "RuleTable.h"
+
+void RuleTable::Init() {
+	Clear();
+}
+
+NTSTATUS RuleTable::Add(const ProtectRule* rule, ULONG size) {
+	const ULONG header = FIELD_OFFSET(ProtectRule, Name);
+	if (size < header)
+		return STATUS_BUFFER_TOO_SMALL;
+	if (rule->NameLength == 0 || rule->NameLength > MaxRuleNameLength)
+		return STATUS_INVALID_PARAMETER;
+	if (size < header + rule->NameLength * sizeof(WCHAR))
+		return STATUS_BUFFER_TOO_SMALL;
+	if (rule->ProcessAccess == 0 && rule->ThreadAccess == 0)
+		return STATUS_INVALID_PARAMETER;
+	if (_count == MaxRules)
+		return STATUS_TOO_MANY_CONTEXT_IDS;
+
+	auto& entry = _rules[_count];
+	entry.Access.Process = rule->ProcessAccess;
+	entry.Access.Thread = rule->ThreadAccess;
+	entry.Length = rule->NameLength;
+	for (USHORT i = 0; i < rule->NameLength; i++)
+		entry.Name[i] = RtlUpcaseUnicodeChar(rule->Name[i]);
+	_count++;
+	return STATUS_SUCCESS;
+}
+
+void RuleTable::Clear() {
+	_count = 0;
+}
+
+bool RuleTable::Matches(const Rule& rule, PCUNICODE_STRING imagePath) {
+	auto length = imagePath->Length / sizeof(WCHAR);
+	if (rule.Length > length)
+		return false;
+
+	// the name is a suffix of the path that starts at a path component
+	auto start = length - rule.Length;
+	if (rule.Name[0] != L'\\' && start > 0 && imagePath->Buffer[start - 1] != L'\\')
+		return false;
+
+	for (USHORT i = 0; i < rule.Length; i++)
+		if (RtlUpcaseUnicodeChar(imagePath->Buffer[start + i]) != rule.Name[i])
+			return false;
+	return true;
+}
+
+bool RuleTable::Match(PCUNICODE_STRING imagePath, ProtectAccess& access) const {
+	access.Process = access.Thread = 0;
+	auto found = false;
+	for (ULONG i = 0; i < _count; i++) {
+		if (Matches(_rules[i], imagePath)) {
+			access.Process |= _rules[i].Access.Process;
+			access.Thread |= _rules[i].Access.Thread;
+			found = true;
+		}
+	}
+	return found;
+}
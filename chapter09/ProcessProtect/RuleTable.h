@@ -0,0 +1,41 @@
+#pragma once
+
+#include "ProcessProtectCommon.h"
+#include "PidSet.h"
+
+const ULONG MaxRules = 64;
+
+//
+// image name rules, compiled when they are added: names are kept upper case, so matching the
+// image of a new process needs no allocations or conversions of the rules themselves.
+// Not synchronized; callers hold the lock.
+//
+
+class RuleTable {
+public:
+	void Init();
+
+	// copies a rule from an IOCTL input buffer
+	NTSTATUS Add(const ProtectRule* rule, ULONG size);
+	void Clear();
+
+	// the access removed from a process with this image and from its threads, by all matching rules
+	bool Match(PCUNICODE_STRING imagePath, ProtectAccess& access) const;
+
+	ULONG Count() const {
+		return _count;
+	}
+
+private:
+	struct Rule {
+		ProtectAccess Access;
+		USHORT Length;
+		WCHAR Name[MaxRuleNameLength];		// upper case
+	};
+
+	static bool Matches(const Rule& rule, PCUNICODE_STRING imagePath);
+
+private:
+	Rule _rules[MaxRules];
+	volatile ULONG _count;
+};
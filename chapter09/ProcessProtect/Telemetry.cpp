@@ -0,0 +1,99 @@
+#include "pch.h"
+#include "Telemetry.h"
+#include "ProcessProtect.h"
+
+NTSTATUS Telemetry::Init() {
+	_cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto size = sizeof(CpuTelemetry) * _cpuCount;
+	_cpus = (CpuTelemetry*)ExAllocatePoolWithTag(NonPagedPoolNx, size, DRIVER_TAG);
+	if (_cpus == nullptr)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	::memset(_cpus, 0, size);
+	for (ULONG i = 0; i < MaxStatsSlots; i++)
+		_free[i] = i;
+	_freeHead = 0;
+	_freeCount = MaxStatsSlots;
+	return STATUS_SUCCESS;
+}
+
+void Telemetry::Term() {
+	if (_cpus) {
+		ExFreePool(_cpus);
+		_cpus = nullptr;
+	}
+}
+
+ULONG Telemetry::Allocate() {
+	if (_freeCount == 0)
+		return NoStatsSlot;
+
+	auto slot = _free[_freeHead];
+	_freeHead = (_freeHead + 1) % MaxStatsSlots;
+	_freeCount--;
+
+	for (ULONG i = 0; i < _cpuCount; i++)
+		::memset(&_cpus[i].Slots[slot], 0, sizeof(SlotStats));
+	return slot;
+}
+
+void Telemetry::Free(ULONG slot) {
+	if (slot == NoStatsSlot)
+		return;
+
+	_free[(_freeHead + _freeCount) % MaxStatsSlots] = slot;
+	_freeCount++;
+}
+
+// keeps the most frequent requesters: a new one replaces the least counted and inherits its count
+static void CountRequester(RequesterStats* requesters, ULONG pid, ULONG opens) {
+	auto least = &requesters[0];
+	for (ULONG i = 0; i < MaxRequesters; i++) {
+		auto& requester = requesters[i];
+		if (requester.Pid == pid) {
+			requester.Opens += opens;
+			return;
+		}
+		if (requester.Opens < least->Opens)
+			least = &requester;
+	}
+	least->Pid = pid;
+	least->Opens += opens;
+}
+
+void Telemetry::Record(ULONG slot, ULONG requester, ACCESS_MASK stripped) {
+	if (slot == NoStatsSlot)
+		return;
+
+	// stay on this CPU while updating its counters
+	auto irql = KeRaiseIrqlToDpcLevel();
+	auto& stats = _cpus[KeGetCurrentProcessorNumberEx(nullptr)].Slots[slot];
+	stats.Opens++;
+	if (stripped) {
+		stats.Stripped++;
+		stats.StrippedAccess |= stripped;
+		CountRequester(stats.Requesters, requester, 1);
+	}
+	KeLowerIrql(irql);
+}
+
+void Telemetry::Get(ULONG slot, ProtectedProcessStats& stats) const {
+	stats.Opens = stats.Stripped = 0;
+	stats.StrippedAccess = 0;
+	::memset(stats.Requesters, 0, sizeof(stats.Requesters));
+	if (slot == NoStatsSlot) {
+		stats.Flags |= ProtectStatsNotTracked;
+		return;
+	}
+
+	// other CPUs keep counting while we sum, the totals are a snapshot
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& cpu = _cpus[i].Slots[slot];
+		stats.Opens += cpu.Opens;
+		stats.Stripped += cpu.Stripped;
+		stats.StrippedAccess |= cpu.StrippedAccess;
+		for (auto& requester : cpu.Requesters)
+			if (requester.Pid)
+				CountRequester(stats.Requesters, requester.Pid, requester.Opens);
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "ProcessProtectCommon.h"
+
+const ULONG MaxStatsSlots = 256;
+const ULONG NoStatsSlot = MAXULONG;
+
+struct SlotStats {
+	ULONG64 Opens;
+	ULONG64 Stripped;
+	ULONG StrippedAccess;
+	RequesterStats Requesters[MaxRequesters];
+};
+
+struct DECLSPEC_CACHEALIGN CpuTelemetry {
+	SlotStats Slots[MaxStatsSlots];
+};
+
+//
+// per-CPU counters of handle opens to protected processes. A protected process gets a slot
+// when it is added and the slot is kept with its PID in the policy, so counting needs no
+// lookup of its own. Updates are done at DISPATCH_LEVEL on the current CPU's copy, so they
+// need no interlocks. Freed slots are reused last, so an update through a retired snapshot
+// is unlikely to land on another process.
+//
+class Telemetry {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	// callers hold the lock; returns NoStatsSlot if all slots are taken
+	ULONG Allocate();
+	void Free(ULONG slot);
+
+	void Record(ULONG slot, ULONG requester, ACCESS_MASK stripped);
+
+	// sums the slot's counters over all CPUs
+	void Get(ULONG slot, ProtectedProcessStats& stats) const;
+
+private:
+	CpuTelemetry* _cpus;
+	ULONG _cpuCount;
+	ULONG _free[MaxStatsSlots];		// ring of free slots
+	ULONG _freeHead;
+	ULONG _freeCount;
+};
@@ -12,9 +12,75 @@ int Error(const char* msg) {
 
 int PrintUsage() {
 	printf("Protect [add | remove | clear] [pid] ...\n");
+	printf("Protect rule <image name or path suffix> [process access] [thread access]\n");
+	printf("Protect clearrules\n");
+	printf("Protect stats (live table of the protected processes, Ctrl+C to stop)\n");
+	printf("Rules apply to processes created after they are added; access masks may be hex (0x...).\n");
 	return 0;
 }
 
+// the protected processes with their counters, all in one call
+bool GetStats(HANDLE hFile, std::vector<ProtectedProcessStats>& stats) {
+	std::vector<BYTE> buffer(sizeof(ProtectStatsHeader) + 64 * sizeof(ProtectedProcessStats));
+	for (;;) {
+		DWORD bytes;
+		if (!::DeviceIoControl(hFile, IOCTL_PROCESS_PROTECT_GET_STATS, nullptr, 0,
+			buffer.data(), static_cast<DWORD>(buffer.size()), &bytes, nullptr))
+			return false;
+
+		auto header = reinterpret_cast<ProtectStatsHeader*>(buffer.data());
+		if (header->Returned < header->Count) {
+			// more processes than room, with some to spare for ones added meanwhile
+			buffer.resize(sizeof(ProtectStatsHeader) + (header->Count + 16) * sizeof(ProtectedProcessStats));
+			continue;
+		}
+
+		auto first = reinterpret_cast<ProtectedProcessStats*>(header + 1);
+		stats.assign(first, first + header->Returned);
+		return true;
+	}
+}
+
+int DisplayStats(HANDLE hFile) {
+	std::vector<ProtectedProcessStats> prev, stats;
+	if (!GetStats(hFile, prev))
+		return Error("Failed to get statistics");
+
+	// rates are per interval, totals since the process was protected
+	for (;;) {
+		::Sleep(1000);
+		if (!GetStats(hFile, stats))
+			return Error("Failed to get statistics");
+
+		printf("\n%u protected processes\n", static_cast<ULONG>(stats.size()));
+		printf("    PID  Process   Thread  Opens/sec  Stripped/sec    Stripped  Stripped bits  Top requesters (PID:stripped)\n");
+		for (auto& item : stats) {
+			printf("%7u %08X %08X ", item.Pid, item.ProcessAccess, item.ThreadAccess);
+			if (item.Flags & ProtectStatsNotTracked) {
+				printf("  (not counted)\n");
+				continue;
+			}
+
+			// a PID protected again since the last sample starts counting from zero
+			auto before = std::find_if(prev.begin(), prev.end(), [&](auto& p) { return p.Pid == item.Pid; });
+			auto rates = before != prev.end() && before->Opens <= item.Opens;
+			printf("%10llu %13llu %11llu       %08X ",
+				rates ? item.Opens - before->Opens : item.Opens,
+				rates ? item.Stripped - before->Stripped : item.Stripped,
+				item.Stripped, item.StrippedAccess);
+
+			std::sort(std::begin(item.Requesters), std::end(item.Requesters), [](auto& a, auto& b) {
+				return a.Opens > b.Opens;
+			});
+			for (auto& requester : item.Requesters)
+				if (requester.Pid)
+					printf(" %u:%u", requester.Pid, requester.Opens);
+			printf("\n");
+		}
+		prev.swap(stats);
+	}
+}
+
 std::vector<DWORD> ParsePids(const wchar_t* buffer[], int count) {
 	std::vector<DWORD> pids;
 	for (int i = 0; i < count; i++)
@@ -28,7 +94,7 @@ int wmain(int argc, const wchar_t* argv[]) {
 
 	enum class Options {
 		Unknown,
-		Add, Remove, Clear
+		Add, Remove, Clear, Rule, ClearRules, Stats
 	};
 	Options option;
 	if (::_wcsicmp(argv[1], L"add") == 0)
@@ -37,6 +103,12 @@ int wmain(int argc, const wchar_t* argv[]) {
 		option = Options::Remove;
 	else if (::_wcsicmp(argv[1], L"clear") == 0)
 		option = Options::Clear;
+	else if (::_wcsicmp(argv[1], L"rule") == 0 && argc > 2)
+		option = Options::Rule;
+	else if (::_wcsicmp(argv[1], L"clearrules") == 0)
+		option = Options::ClearRules;
+	else if (::_wcsicmp(argv[1], L"stats") == 0)
+		option = Options::Stats;
 	else {
 		printf("Unknown option.\n");
 		return PrintUsage();
@@ -69,6 +141,34 @@ int wmain(int argc, const wchar_t* argv[]) {
 				nullptr, 0, nullptr, 0, &bytes, nullptr);
 			break;
 
+		case Options::Rule:
+		{
+			auto name = argv[2];
+			auto length = ::wcslen(name);
+			if (length == 0 || length > MaxRuleNameLength) {
+				printf("Rule name too long.\n");
+				return 1;
+			}
+			std::vector<BYTE> buffer(FIELD_OFFSET(ProtectRule, Name) + length * sizeof(WCHAR));
+			auto rule = reinterpret_cast<ProtectRule*>(buffer.data());
+			rule->ProcessAccess = argc > 3 ? ::wcstoul(argv[3], nullptr, 0) : PROCESS_TERMINATE;
+			rule->ThreadAccess = argc > 4 ? ::wcstoul(argv[4], nullptr, 0) : 0;
+			rule->NameLength = static_cast<USHORT>(length);
+			::memcpy(rule->Name, name, length * sizeof(WCHAR));
+			success = ::DeviceIoControl(hFile, IOCTL_PROCESS_PROTECT_ADD_RULE,
+				buffer.data(), static_cast<DWORD>(buffer.size()),
+				nullptr, 0, &bytes, nullptr);
+			break;
+		}
+
+		case Options::ClearRules:
+			success = ::DeviceIoControl(hFile, IOCTL_PROCESS_PROTECT_CLEAR_RULES,
+				nullptr, 0, nullptr, 0, &bytes, nullptr);
+			break;
+
+		case Options::Stats:
+			return DisplayStats(hFile);
+
 	}
 
 	if (!success)
@@ -12,5 +12,6 @@
 #include <Windows.h>
 #include <stdio.h>
 #include <vector>
+#include <algorithm>
 
 #endif //PCH_H
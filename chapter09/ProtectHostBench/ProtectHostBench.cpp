@@ -0,0 +1,156 @@
+// ProtectHostBench.cpp : compares ProcessProtect's protected PID lookup under its fast mutex with the
+// lock-free snapshot read path, on a Linux host, with many threads opening process handles at once.
+//
+// Every opener thread does what OnPreOpenProcess does for each handle open: it looks up the PID of the
+// process being opened. A writer thread protects and unprotects a process every millisecond, the way
+// the IOCTL handlers do, so readers of both paths also see writes.
+//
+// Build from this directory (one command line; the WDK stand-in comes from SysMonHostBench):
+//   g++ -std=c++17 -O2 -pthread -fms-extensions -Wno-multichar -I../SysMonHostBench ProtectHostBench.cpp
+//     ../ProcessProtect/Policy.cpp ../ProcessProtect/PidSet.cpp ../ProcessProtect/RuleTable.cpp ../ProcessProtect/FastMutex.cpp
+//     ../ProcessProtect/Telemetry.cpp -o protecthostbench
+//
+// Usage: protecthostbench [seconds per step] [max openers]
+//
+
+#include "ntddk.h"
+#include "../ProcessProtect/ProcessProtect.h"
+#include "../ProcessProtect/AutoLock.h"
+#include <pthread.h>
+#include <chrono>
+
+Globals g_Data;
+
+const ULONG ProtectedPids = 256;
+const ULONG PidRange = 8 * ProtectedPids;	// one open in 8 is of a protected process
+
+enum class ReadPath {
+	Locked,		// the fast mutex and the writers' set
+	Snapshot	// Policy::Lookup
+};
+
+struct alignas(64) Opener {
+	ULONG Cpu;
+	ULONG64 Opens = 0;
+	ULONG64 Protected = 0;
+};
+
+void PinThread(ULONG core) {
+	auto cores = std::thread::hardware_concurrency();
+	if (cores == 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % cores, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void OpenerThread(Opener& opener, ReadPath path, const std::atomic<bool>& stop) {
+	ShimSetCurrentProcessor(opener.Cpu);
+	PinThread(opener.Cpu + 1);
+
+	// xorshift, cheap next to the lookup
+	ULONG random = opener.Cpu * 2654435761UL + 1;
+	while (!stop.load(std::memory_order_relaxed)) {
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		auto pid = (1 + random % PidRange) * 4;
+		bool found;
+		if (path == ReadPath::Locked) {
+			AutoLock<FastMutex> locker(g_Data.Lock);
+			found = g_Data.Pids.Contains(pid);
+		}
+		else {
+			ProtectedPid entry;
+			found = g_Data.Policy.Lookup(pid, entry);
+		}
+		opener.Opens++;
+		opener.Protected += found;
+	}
+}
+
+// moves the window of protected PIDs along by one every millisecond
+void WriterThread(ULONG cpu, const std::atomic<bool>& stop) {
+	ShimSetCurrentProcessor(cpu);
+	PinThread(0);
+
+	// the window carries on from the previous step
+	static ULONG next = ProtectedPids + 1;
+	while (!stop.load()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		AutoLock<FastMutex> locker(g_Data.Lock);
+		auto oldest = (next + PidRange - ProtectedPids - 1) % PidRange + 1;
+		g_Data.Pids.Remove(oldest * 4);
+		g_Data.Pids.Add(next * 4, { PROCESS_TERMINATE, 0 }, NoStatsSlot);
+		g_Data.Policy.Publish(g_Data.Pids);
+		next = next % PidRange + 1;
+	}
+}
+
+double RunStep(int openers, ReadPath path, ULONG writerCpu, int seconds) {
+	std::atomic<bool> stop(false);
+	std::vector<Opener> state(openers);
+	std::vector<std::thread> threads;
+
+	std::thread writer(WriterThread, writerCpu, std::cref(stop));
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < openers; i++) {
+		state[i].Cpu = i;
+		threads.emplace_back(OpenerThread, std::ref(state[i]), path, std::cref(stop));
+	}
+
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	stop = true;
+	for (auto& t : threads)
+		t.join();
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	writer.join();
+
+	ULONG64 opens = 0, found = 0;
+	for (auto& o : state) {
+		opens += o.Opens;
+		found += o.Protected;
+	}
+	if (opens && (found * 16 < opens || found * 4 > opens))
+		printf("Unexpected share of protected processes: %llu of %llu\n", (unsigned long long)found, (unsigned long long)opens);
+	return opens / elapsed;
+}
+
+int main(int argc, const char* argv[]) {
+	int seconds = argc > 1 ? atoi(argv[1]) : 2;
+	if (seconds <= 0)
+		seconds = 2;
+	// one core is left for the writer
+	int maxOpeners = argc > 2 ? atoi(argv[2]) : max((int)std::thread::hardware_concurrency() - 1, 1);
+	if (maxOpeners <= 0)
+		maxOpeners = 1;
+
+	ShimSetProcessorCount(maxOpeners + 1);
+	ShimSetCurrentProcessor(maxOpeners);
+	if (!NT_SUCCESS(g_Data.Init())) {
+		printf("Failed to initialize\n");
+		return 1;
+	}
+
+	for (ULONG i = 1; i <= ProtectedPids; i++)
+		g_Data.Pids.Add(i * 4, { PROCESS_TERMINATE, 0 }, NoStatsSlot);
+	g_Data.Policy.Publish(g_Data.Pids);
+
+	printf("%d sec per step, %u of %u PIDs protected, one protection change per msec\n", seconds, ProtectedPids, PidRange);
+	printf("Openers  locked opens/sec  snapshot opens/sec   speedup  locked ns/open  snapshot ns/open\n");
+	for (int openers = 1; ; openers *= 2) {
+		if (openers > maxOpeners)
+			openers = maxOpeners;
+		auto locked = RunStep(openers, ReadPath::Locked, maxOpeners, seconds);
+		auto snapshot = RunStep(openers, ReadPath::Snapshot, maxOpeners, seconds);
+		// per opener, so that it is the cost of one open as seen by the thread doing it
+		printf("%7d %18.0f %19.0f %8.1fx %15.1f %17.1f\n", openers, locked, snapshot, snapshot / locked,
+			openers * 1e9 / locked, openers * 1e9 / snapshot);
+		if (openers == maxOpeners)
+			break;
+	}
+
+	g_Data.Term();
+	return 0;
+}
@@ -13,3 +13,17 @@ struct AutoLock {
 private:
 	TLock& _lock;
 };
+
+template<typename TLock>
+struct AutoSharedLock {
+	AutoSharedLock(TLock& lock) : _lock(lock) {
+		_lock.LockShared();
+	}
+
+	~AutoSharedLock() {
+		_lock.UnlockShared();
+	}
+
+private:
+	TLock& _lock;
+};
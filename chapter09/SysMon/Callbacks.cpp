@@ -0,0 +1,185 @@
+#include "pch.h"
+#include "SysMon.h"
+#include "AutoLock.h"
+
+void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
+	CallbackTimer timer(CallbackKind::Process);
+
+	if (CreateInfo) {
+		// process created; tracked whether or not its creation is reported
+		ULONG imageNameId = 0;
+		if (CreateInfo->ImageFileName)
+			imageNameId = g_Globals.Strings.Intern(CreateInfo->ImageFileName->Buffer, CreateInfo->ImageFileName->Length);
+		auto key = g_Globals.Processes.Add(HandleToULong(ProcessId), HandleToULong(CreateInfo->ParentProcessId), imageNameId);
+
+		if (!g_Globals.Filter.Matches(ItemType::ProcessCreate, HandleToULong(ProcessId),
+			HandleToULong(CreateInfo->ParentProcessId), CreateInfo->ImageFileName))
+			return;
+
+		USHORT commandLineSize = 0;
+		if (CreateInfo->CommandLine) {
+			// the record size must fit in a USHORT
+			commandLineSize = (USHORT)min(CreateInfo->CommandLine->Length, (MAXUSHORT - sizeof(ProcessCreateInfo)) & ~1);
+		}
+		auto info = g_Globals.Allocator.Allocate<ProcessCreateInfo>(commandLineSize);
+		if (info == nullptr) {
+			KdPrint((DRIVER_PREFIX "failed allocation\n"));
+			timer.AllocFailed();
+			return;
+		}
+
+		auto& item = info->Data;
+		item.Type = ItemType::ProcessCreate;
+		item.Size = sizeof(ProcessCreateInfo) + commandLineSize;
+		item.ProcessId = HandleToULong(ProcessId);
+		item.ParentProcessId = HandleToULong(CreateInfo->ParentProcessId);
+		item.ProcessKey = key;
+		item.ParentProcessKey = g_Globals.Processes.GetKey(item.ParentProcessId);
+		item.ImageFileNameId = imageNameId;
+
+		if (commandLineSize > 0) {
+			::memcpy((UCHAR*)&item + sizeof(item), CreateInfo->CommandLine->Buffer, commandLineSize);
+			item.CommandLineLength = commandLineSize / sizeof(WCHAR);	// length in WCHARs
+			item.CommandLineOffset = sizeof(item);
+		}
+		else {
+			item.CommandLineLength = 0;
+		}
+		PushItem(&info->Data);
+	}
+	else {
+		// process exited
+		if (SharedChannel::AnyMapped()) {
+			// we are still in its address space, so its views can be removed here
+			AutoLock locker(g_Globals.Mutex);
+			g_Globals.Queue.ForEachConsumer([&](Consumer* consumer) {
+				if (consumer->Channel.IsMappedInto(Process))
+					consumer->Channel.Unmap();
+			});
+		}
+		g_Globals.Aggregator.OnProcessExit(HandleToULong(ProcessId));
+		ProcessState state;
+		if (!g_Globals.Processes.Remove(HandleToULong(ProcessId), state))
+			state.ProcessKey = state.ImageFileNameId = 0;
+
+		if (!g_Globals.Filter.Matches(ItemType::ProcessExit, HandleToULong(ProcessId)))
+			return;
+
+		auto info = g_Globals.Allocator.Allocate<ProcessExitInfo>();
+		if (info == nullptr) {
+			KdPrint((DRIVER_PREFIX "failed allocation\n"));
+			timer.AllocFailed();
+			return;
+		}
+
+		auto& item = info->Data;
+		item.Type = ItemType::ProcessExit;
+		item.ProcessId = HandleToULong(ProcessId);
+		item.ProcessKey = state.ProcessKey;
+		item.ImageFileNameId = state.ImageFileNameId;
+		item.Size = sizeof(ProcessExitInfo);
+
+		PushItem(&info->Data);
+	}
+}
+
+void OnThreadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create) {
+	CallbackTimer timer(CallbackKind::Thread);
+	auto type = Create ? ItemType::ThreadCreate : ItemType::ThreadExit;
+	if (!g_Globals.Filter.Matches(type, HandleToULong(ProcessId)))
+		return;
+
+	if (g_Globals.Aggregator.Count(HandleToULong(ProcessId), Create))
+		return;
+
+	auto info = g_Globals.Allocator.Allocate<ThreadCreateExitInfo>();
+	if (info == nullptr) {
+		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
+		timer.AllocFailed();
+		return;
+	}
+	auto& item = info->Data;
+	item.Size = sizeof(item);
+	item.Type = type;
+	item.ProcessId = HandleToULong(ProcessId);
+	item.ThreadId = HandleToULong(ThreadId);
+	item.ProcessKey = g_Globals.Processes.GetKey(item.ProcessId);
+
+	PushItem(&info->Data);
+}
+
+void OnImageLoadNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo) {
+	CallbackTimer timer(CallbackKind::ImageLoad);
+	if (ProcessId == nullptr) {
+		// system image, ignore
+		return;
+	}
+
+	if (!g_Globals.Filter.Matches(ItemType::ImageLoad, HandleToULong(ProcessId), 0, FullImageName))
+		return;
+
+	static const UNICODE_STRING unknown = RTL_CONSTANT_STRING(L"(unknown)");
+	auto imageName = FullImageName ? FullImageName : &unknown;
+
+	// common DLLs are loaded over and over, send their path only once
+	auto nameId = g_Globals.Strings.Intern(imageName->Buffer, imageName->Length);
+	USHORT inlineSize = 0;
+	if (nameId == 0) {
+		// the record size must fit in a USHORT
+		inlineSize = (USHORT)min(imageName->Length, (MAXUSHORT - sizeof(ImageLoadInfo)) & ~1);
+	}
+
+	auto info = g_Globals.Allocator.Allocate<ImageLoadInfo>(inlineSize);
+	if (info == nullptr) {
+		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
+		timer.AllocFailed();
+		return;
+	}
+
+	auto& item = info->Data;
+	item.Size = sizeof(item);
+	item.Type = ItemType::ImageLoad;
+	item.ProcessId = HandleToULong(ProcessId);
+	item.ImageSize = ImageInfo->ImageSize;
+	item.LoadAddress = (ULONG_PTR)ImageInfo->ImageBase;
+	item.ImageFileNameId = nameId;
+	item.ImageFileNameLength = inlineSize / sizeof(WCHAR);
+	item.ImageFileNameOffset = AppendData(&item, imageName->Buffer, inlineSize);
+	item.ProcessKey = g_Globals.Processes.GetKey(item.ProcessId);
+
+	//if (ImageInfo->ExtendedInfoPresent) {
+	//	auto exinfo = CONTAINING_RECORD(ImageInfo, IMAGE_INFO_EX, ImageInfo);
+	//}
+
+	PushItem(&info->Data);
+}
+
+USHORT AppendData(ItemHeader* item, const void* data, USHORT size) {
+	auto offset = item->Size;
+	::memcpy((UCHAR*)item + offset, data, size);
+	item->Size += size;
+	return offset;
+}
+
+void PushItem(ItemHeader* item) {
+	// the queue stamps the item's time
+	switch (g_Globals.Queue.Push(item)) {
+		case PushResult::Dropped:
+			// the queue has counted it for the next EventsLost marker
+			FreeItem(item);
+			break;
+
+		case PushResult::QueuedOverCapacity:
+			// the delivery thread discards the oldest events
+			g_Globals.Reads.Wake();
+			break;
+
+		default:
+			g_Globals.Reads.NotifyPush();
+			break;
+	}
+}
+
+void FreeItem(ItemHeader* item) {
+	g_Globals.Allocator.Free(item);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+//
+// SysMon capture files: a file header followed by fixed size chunks of raw event records,
+// exactly as the driver delivered them. Chunk i starts at FileHeaderSize + i * ChunkSize,
+// so the chunk headers serve as the index - a reader can look at every chunk's time range,
+// type counts and PID bloom filter and skip the chunk without touching its records.
+// The last chunk may be shorter than ChunkSize.
+// Every interned string ID used by a record is defined by a StringDefinition record
+// earlier in the file; chunks that hold definitions have a nonzero count for that type.
+//
+
+#include "SysMonCommon.h"
+
+const ULONG CaptureFileMagic = 0x46434D53;	// "SMCF"
+const ULONG CaptureChunkMagic = 0x4B434D53;	// "SMCK"
+const USHORT CaptureFormatVersion = 1;
+
+const ULONG CaptureFileHeaderSize = 4096;
+const ULONG DefaultCaptureChunkSize = 1 << 20;
+const ULONG MinCaptureChunkSize = 1 << 16;	// a record is at most 64 KB
+
+const ULONG CaptureBloomBits = 2048;		// must be a power of 2
+
+struct CaptureFileHeader {
+	ULONG Magic;				// CaptureFileMagic
+	USHORT FormatVersion;		// CaptureFormatVersion
+	USHORT RecordVersion;		// ItemHeaderVersion of the records
+	ULONG ChunkSize;			// a multiple of the page size
+	ULONG ChunkCount;			// written when the capture is closed
+	LARGE_INTEGER StartTime;
+	LARGE_INTEGER EndTime;
+};
+
+struct CaptureChunkHeader {
+	ULONG Magic;				// CaptureChunkMagic
+	ULONG DataSize;				// bytes of records following this header
+	ULONG RecordCount;
+	ULONG Reserved;
+	LARGE_INTEGER FirstTime;	// of the records in the chunk
+	LARGE_INTEGER LastTime;
+	ULONG TypeCounts[MaxItemTypes];			// records by ItemType
+	ULONG64 PidBloom[CaptureBloomBits / 64];	// processes with records in the chunk
+};
+
+// the process a record belongs to, zero for records that have none
+inline ULONG GetRecordProcessId(const ItemHeader* header) {
+	// records of other versions have a different layout
+	if (header->Version != ItemHeaderVersion)
+		return 0;
+
+	switch (header->Type) {
+		case ItemType::ProcessCreate:	return ((const ProcessCreateInfo*)header)->ProcessId;
+		case ItemType::ProcessExit:		return ((const ProcessExitInfo*)header)->ProcessId;
+		case ItemType::ThreadCreate:
+		case ItemType::ThreadExit:		return ((const ThreadCreateExitInfo*)header)->ProcessId;
+		case ItemType::ImageLoad:		return ((const ImageLoadInfo*)header)->ProcessId;
+		case ItemType::RegistrySetValue:	return ((const RegistrySetValueInfo*)header)->ProcessId;
+		case ItemType::ThreadSummary:	return ((const ThreadSummaryInfo*)header)->ProcessId;
+		case ItemType::RegistryCreateKey:
+		case ItemType::RegistryDeleteKey:
+		case ItemType::RegistryDeleteValue:
+		case ItemType::RegistryRenameKey:	return ((const RegistryKeyInfo*)header)->ProcessId;
+		default:						return 0;
+	}
+}
+
+// the process key of a record, zero for records that have none
+inline ULONG GetRecordProcessKey(const ItemHeader* header) {
+	if (header->Version != ItemHeaderVersion)
+		return 0;
+
+	switch (header->Type) {
+		case ItemType::ProcessCreate:	return ((const ProcessCreateInfo*)header)->ProcessKey;
+		case ItemType::ProcessExit:		return ((const ProcessExitInfo*)header)->ProcessKey;
+		case ItemType::ThreadCreate:
+		case ItemType::ThreadExit:		return ((const ThreadCreateExitInfo*)header)->ProcessKey;
+		case ItemType::ImageLoad:		return ((const ImageLoadInfo*)header)->ProcessKey;
+		case ItemType::ThreadSummary:	return ((const ThreadSummaryInfo*)header)->ProcessKey;
+		default:						return 0;
+	}
+}
+
+// the interned string a record refers to, zero if none
+inline ULONG GetRecordStringId(const ItemHeader* header) {
+	// records of other versions have a different layout
+	if (header->Version != ItemHeaderVersion)
+		return 0;
+
+	switch (header->Type) {
+		case ItemType::ProcessCreate:	return ((const ProcessCreateInfo*)header)->ImageFileNameId;
+		case ItemType::ProcessExit:		return ((const ProcessExitInfo*)header)->ImageFileNameId;
+		case ItemType::ImageLoad:		return ((const ImageLoadInfo*)header)->ImageFileNameId;
+		case ItemType::RegistrySetValue:	return ((const RegistrySetValueInfo*)header)->KeyNameId;
+		case ItemType::RegistryCreateKey:
+		case ItemType::RegistryDeleteKey:
+		case ItemType::RegistryDeleteValue:
+		case ItemType::RegistryRenameKey:	return ((const RegistryKeyInfo*)header)->KeyNameId;
+		default:						return 0;
+	}
+}
+
+// two bit positions per PID out of one 64 bit multiplicative hash
+inline void CaptureBloomBitsOf(ULONG pid, ULONG& bit1, ULONG& bit2) {
+	auto hash = (pid >> 2) * 0x9E3779B97F4A7C15ULL;
+	bit1 = (ULONG)(hash >> 32) & (CaptureBloomBits - 1);
+	bit2 = (ULONG)(hash >> 48) & (CaptureBloomBits - 1);
+}
+
+inline void CaptureBloomAdd(ULONG64* bloom, ULONG pid) {
+	ULONG bit1, bit2;
+	CaptureBloomBitsOf(pid, bit1, bit2);
+	bloom[bit1 / 64] |= 1ULL << (bit1 % 64);
+	bloom[bit2 / 64] |= 1ULL << (bit2 % 64);
+}
+
+// false means the chunk has no records of the process
+inline bool CaptureBloomMayContain(const ULONG64* bloom, ULONG pid) {
+	ULONG bit1, bit2;
+	CaptureBloomBitsOf(pid, bit1, bit2);
+	return (bloom[bit1 / 64] & (1ULL << (bit1 % 64))) && (bloom[bit2 / 64] & (1ULL << (bit2 % 64)));
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "SharedChannel.h"
+
+// a consumer's position in one CPU ring
+struct CpuCursor {
+	LONG Position;
+	LONG Bytes;			// total bytes of the ring read by this consumer
+	LONG CachedTail;	// consumer's last view of the ring's Tail
+};
+
+//
+// per-handle read state, stored in the file object's FsContext.
+// Every consumer sees the full event stream; a ring slot is freed
+// once all consumers have read it. Guarded by g_Globals.Mutex.
+//
+struct Consumer {
+	LIST_ENTRY Link;
+	PFILE_OBJECT FileObject;
+	volatile LONG PendingReads;
+	SharedChannel Channel;
+	ULONG ReportedDrops;	// producer drops already reported with EventsLost markers
+	ULONG Skipped;			// events trimmed before this consumer got to them
+	CpuCursor Cursors[1];	// one per CPU
+};
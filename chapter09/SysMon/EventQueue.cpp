@@ -0,0 +1,291 @@
+#include "pch.h"
+#include "EventQueue.h"
+#include "SysMon.h"
+
+NTSTATUS EventQueue::Init() {
+	_cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto size = sizeof(CpuRing) * _cpuCount;
+	_rings = (CpuRing*)ExAllocatePoolWithTag(NonPagedPoolNx, size, DRIVER_TAG);
+	if (_rings == nullptr)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	::memset(_rings, 0, size);
+	::memset(_trimmed, 0, sizeof(_trimmed));
+	InitializeListHead(&_consumers);
+	SetPolicy(DefaultBufferCapacity, OverflowPolicy::DropNewest, 1);
+	return STATUS_SUCCESS;
+}
+
+void EventQueue::Term() {
+	if (_rings) {
+		ExFreePool(_rings);
+		_rings = nullptr;
+	}
+}
+
+void EventQueue::SetPolicy(ULONG capacity, OverflowPolicy policy, ULONG sampleRate) {
+	if (capacity) {
+		capacity = min(capacity, MaxBufferCapacity) / _cpuCount;
+		InterlockedExchange(&_ringCapacity, (LONG)max(capacity, MinRingCapacity));
+	}
+	_sampleRate = sampleRate ? sampleRate : 1;
+	_policy = policy;
+}
+
+bool EventQueue::CanPush(CpuRing& ring, LONG tail, ULONG size) {
+	if ((ULONG)(tail - ReadAcquire(&ring.Head)) >= RingSize)
+		return false;
+
+	auto used = (ULONG)(ring.TailBytes - ReadNoFence(&ring.HeadBytes)) + size;
+	auto capacity = (ULONG)ReadNoFence(&_ringCapacity);
+	switch (_policy) {
+		case OverflowPolicy::DropNewest:
+		default:
+			return used <= capacity;
+
+		case OverflowPolicy::DropOldest:
+			// the reader trims back to capacity, until then allow the same again as headroom
+			return used <= 2 * capacity;
+
+		case OverflowPolicy::Sample:
+			if (used > capacity)
+				return false;
+			return used <= capacity / 2 || ++ring.SampleCounter % _sampleRate == 0;
+	}
+}
+
+PushResult EventQueue::Push(ItemHeader* item) {
+	// at DISPATCH_LEVEL we cannot be preempted or migrated,
+	// so the current CPU's ring has exactly one producer
+	auto irql = KeRaiseIrqlToDpcLevel();
+
+	auto& ring = _rings[KeGetCurrentProcessorNumberEx(nullptr)];
+	auto tail = ring.Tail;
+	auto result = PushResult::Dropped;
+	if (CanPush(ring, tail, item->Size)) {
+		// stamping here keeps every ring sorted by time
+		KeQuerySystemTimePrecise(&item->Time);
+		item->Version = ItemHeaderVersion;
+		ring.Items[tail & (RingSize - 1)] = item;
+		ring.TailBytes += item->Size;
+		WriteRelease(&ring.Tail, tail + 1);
+
+		result = (ULONG)(ring.TailBytes - ReadNoFence(&ring.HeadBytes)) > (ULONG)_ringCapacity ?
+			PushResult::QueuedOverCapacity : PushResult::Queued;
+	}
+	else {
+		ring.Dropped[(ULONG)item->Type % MaxItemTypes]++;
+	}
+
+	KeLowerIrql(irql);
+	return result;
+}
+
+Consumer* EventQueue::AddConsumer(PFILE_OBJECT FileObject) {
+	auto size = FIELD_OFFSET(Consumer, Cursors) + _cpuCount * sizeof(CpuCursor);
+	auto consumer = (Consumer*)ExAllocatePoolWithTag(NonPagedPoolNx, size, DRIVER_TAG);
+	if (consumer == nullptr)
+		return nullptr;
+
+	::memset(consumer, 0, size);
+	consumer->FileObject = FileObject;
+	// a new consumer gets everything still buffered
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& cursor = consumer->Cursors[i];
+		cursor.Position = cursor.CachedTail = _rings[i].Head;
+		cursor.Bytes = _rings[i].HeadBytes;
+	}
+	consumer->ReportedDrops = GetProducerDrops();
+	InsertTailList(&_consumers, &consumer->Link);
+	return consumer;
+}
+
+void EventQueue::RemoveConsumer(Consumer* consumer) {
+	RemoveEntryList(&consumer->Link);
+	// it may have been the one holding everybody back
+	Reclaim();
+}
+
+ItemHeader* EventQueue::PeekOldest(Consumer* consumer, ULONG& cpu) {
+	ItemHeader* oldest = nullptr;
+
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& ring = _rings[i];
+		auto& cursor = consumer->Cursors[i];
+		auto position = cursor.Position;
+		if (position == cursor.CachedTail) {
+			// only touch the producer's cache line when we think the ring is empty
+			cursor.CachedTail = ReadAcquire(&ring.Tail);
+			if (position == cursor.CachedTail)
+				continue;
+		}
+
+		auto item = ring.Items[position & (RingSize - 1)];
+		if (oldest == nullptr || item->Time.QuadPart < oldest->Time.QuadPart) {
+			oldest = item;
+			cpu = i;
+		}
+	}
+
+	return oldest;
+}
+
+void EventQueue::Pop(Consumer* consumer, ULONG cpu) {
+	// the slot is freed by Reclaim once every consumer is past it
+	auto& cursor = consumer->Cursors[cpu];
+	NT_ASSERT(cursor.Position != cursor.CachedTail);
+	cursor.Bytes += _rings[cpu].Items[cursor.Position & (RingSize - 1)]->Size;
+	cursor.Position++;
+}
+
+ULONG EventQueue::GetPendingBytes(Consumer* consumer) const {
+	ULONG bytes = 0;
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& ring = _rings[i];
+		// TailBytes is published together with Tail
+		ReadAcquire(&ring.Tail);
+		bytes += (ULONG)(ring.TailBytes - consumer->Cursors[i].Bytes);
+	}
+	return bytes;
+}
+
+ULONG EventQueue::Read(Consumer* consumer, UCHAR* buffer, ULONG size) {
+	ULONG count = 0;
+
+	// let the client know if events were lost since the last read
+	EventsLostInfo marker;
+	if (GetLostMarker(consumer, marker) && size >= sizeof(marker)) {
+		::memcpy(buffer, &marker, sizeof(marker));
+		count += sizeof(marker);
+		MarkerDelivered(consumer, marker);
+	}
+
+	ULONG cpu;
+	while (true) {
+		auto item = PeekOldest(consumer, cpu);
+		if (item == nullptr)
+			break;
+
+		if (size - count < item->Size) {
+			// user's buffer full, item stays in its ring
+			break;
+		}
+		Pop(consumer, cpu);
+		::memcpy(buffer + count, item, item->Size);
+		count += item->Size;
+	}
+	return count;
+}
+
+void EventQueue::FreeUpTo(ULONG cpu, LONG position) {
+	auto& ring = _rings[cpu];
+	auto head = ring.Head;
+	if (head == position)
+		return;
+
+	auto bytes = ring.HeadBytes;
+	for (; head != position; head++) {
+		auto item = ring.Items[head & (RingSize - 1)];
+		bytes += item->Size;
+		FreeItem(item);
+	}
+	ring.HeadBytes = bytes;
+	WriteRelease(&ring.Head, head);
+}
+
+void EventQueue::Reclaim() {
+	// with no consumers, events stay buffered for the next one
+	if (IsListEmpty(&_consumers))
+		return;
+
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto head = _rings[i].Head;
+		ULONG slowest = MAXULONG;
+		ForEachConsumer([&](Consumer* consumer) {
+			slowest = min(slowest, (ULONG)(consumer->Cursors[i].Position - head));
+		});
+		FreeUpTo(i, head + (LONG)slowest);
+	}
+}
+
+void EventQueue::Trim() {
+	if (_policy != OverflowPolicy::DropOldest)
+		return;
+
+	auto capacity = (ULONG)_ringCapacity;
+	bool consumers = !IsListEmpty(&_consumers);
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& ring = _rings[i];
+		for (;;) {
+			auto head = ring.Head;
+			if (head == ReadAcquire(&ring.Tail))
+				break;
+			if ((ULONG)(ring.TailBytes - ring.HeadBytes) <= capacity)
+				break;
+
+			// consumers still at the head have not seen this event, move them past it
+			auto item = ring.Items[head & (RingSize - 1)];
+			bool unread = !consumers;
+			ForEachConsumer([&](Consumer* consumer) {
+				auto& cursor = consumer->Cursors[i];
+				if (cursor.Position != head)
+					return;
+				cursor.Position++;
+				cursor.Bytes += item->Size;
+				if ((LONG)(cursor.CachedTail - cursor.Position) < 0)
+					cursor.CachedTail = cursor.Position;
+				consumer->Skipped++;
+				unread = true;
+			});
+			if (unread)
+				_trimmed[(ULONG)item->Type % MaxItemTypes]++;
+			FreeUpTo(i, head + 1);
+		}
+	}
+}
+
+void EventQueue::Drain() {
+	for (ULONG i = 0; i < _cpuCount; i++)
+		FreeUpTo(i, ReadAcquire(&_rings[i].Tail));
+}
+
+ULONG EventQueue::GetProducerDrops() const {
+	ULONG count = 0;
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		for (ULONG type = 0; type < MaxItemTypes; type++)
+			count += _rings[i].Dropped[type];
+	}
+	return count;
+}
+
+bool EventQueue::GetLostMarker(Consumer* consumer, EventsLostInfo& marker) const {
+	auto lost = GetProducerDrops() - consumer->ReportedDrops + consumer->Skipped;
+	if (lost == 0)
+		return false;
+
+	marker.Type = ItemType::EventsLost;
+	marker.Size = sizeof(marker);
+	marker.Version = ItemHeaderVersion;
+	KeQuerySystemTimePrecise(&marker.Time);
+	marker.Count = lost;
+	return true;
+}
+
+void EventQueue::MarkerDelivered(Consumer* consumer, const EventsLostInfo& marker) {
+	consumer->ReportedDrops += marker.Count - consumer->Skipped;
+	consumer->Skipped = 0;
+}
+
+void EventQueue::GetDropCounts(DropCounts& counts) const {
+	// the producers' counters are read without synchronization, the result is a snapshot
+	::memcpy(counts.ByType, _trimmed, sizeof(counts.ByType));
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& ring = _rings[i];
+		for (ULONG type = 0; type < MaxItemTypes; type++)
+			counts.ByType[type] += ring.Dropped[type];
+	}
+
+	counts.Total = 0;
+	for (ULONG type = 0; type < MaxItemTypes; type++)
+		counts.Total += counts.ByType[type];
+}
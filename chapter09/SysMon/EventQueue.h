@@ -0,0 +1,95 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include "Consumer.h"
+
+const ULONG RingSize = 8192;	// slots per CPU, must be a power of 2
+const ULONG MinRingCapacity = 1 << 14;
+
+struct CpuRing {
+	// producer side, written only by the owning CPU
+	DECLSPEC_CACHEALIGN volatile LONG Tail;
+	volatile LONG TailBytes;	// total bytes ever pushed
+	ULONG SampleCounter;
+	ULONG Dropped[MaxItemTypes];
+
+	// reclaim side, written only under the reader lock
+	DECLSPEC_CACHEALIGN volatile LONG Head;		// oldest slot not yet freed
+	volatile LONG HeadBytes;	// total bytes ever freed
+
+	ItemHeader* Items[RingSize];
+};
+
+enum class PushResult {
+	Dropped,		// the caller still owns the item
+	Queued,
+	QueuedOverCapacity	// queued into the drop-oldest headroom, the reader should trim
+};
+
+//
+// per-CPU single-producer rings of event pointers, read by any number of consumers.
+// Push never takes a lock; each consumer merges the rings by timestamp with its own
+// cursors, and slots are freed once the slowest consumer has passed them.
+// The byte capacity is split evenly between the CPUs so that the
+// producer checks only its own ring.
+//
+
+class EventQueue {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	PushResult Push(ItemHeader* item);
+
+	void SetPolicy(ULONG capacity, OverflowPolicy policy, ULONG sampleRate);
+
+	// reader side - callers must hold g_Globals.Mutex
+
+	Consumer* AddConsumer(PFILE_OBJECT FileObject);
+	void RemoveConsumer(Consumer* consumer);
+
+	template<typename F>
+	void ForEachConsumer(F f) {
+		for (auto entry = _consumers.Flink; entry != &_consumers; ) {
+			auto consumer = CONTAINING_RECORD(entry, Consumer, Link);
+			entry = entry->Flink;
+			f(consumer);
+		}
+	}
+
+	ItemHeader* PeekOldest(Consumer* consumer, ULONG& cpu);
+	void Pop(Consumer* consumer, ULONG cpu);
+	ULONG GetPendingBytes(Consumer* consumer) const;
+	// copies the consumer's unread events that fit, oldest first, after an EventsLost
+	// marker if events were lost since its last read. Returns the number of bytes copied
+	ULONG Read(Consumer* consumer, UCHAR* buffer, ULONG size);
+
+	// frees the slots every consumer has read
+	void Reclaim();
+	// drop-oldest: discards the oldest events of rings above capacity
+	void Trim();
+	// frees everything, when there are no consumers left
+	void Drain();
+
+	// builds an EventsLost record if events were lost since the consumer's last marker
+	bool GetLostMarker(Consumer* consumer, EventsLostInfo& marker) const;
+	void MarkerDelivered(Consumer* consumer, const EventsLostInfo& marker);
+
+	void GetDropCounts(DropCounts& counts) const;
+
+private:
+	bool CanPush(CpuRing& ring, LONG tail, ULONG size);
+	ULONG GetProducerDrops() const;
+	void FreeUpTo(ULONG cpu, LONG position);
+
+private:
+	CpuRing* _rings;
+	ULONG _cpuCount;
+	volatile LONG _ringCapacity;
+	volatile OverflowPolicy _policy;
+	volatile ULONG _sampleRate;
+
+	// reader side
+	LIST_ENTRY _consumers;
+	ULONG _trimmed[MaxItemTypes];
+};
@@ -0,0 +1,87 @@
+#include "pch.h"
+#include "Filter.h"
+#include "AutoLock.h"
+#include "PidList.h"
+
+void EventFilter::Init() {
+	_lock.Init();
+	_typeMask = -1;
+	_rules = 0;
+	_includeCount = _excludeCount = 0;
+	_parentPid = 0;
+	_imagePrefix.Buffer = _imagePrefixBuffer;
+	_imagePrefix.Length = 0;
+	_imagePrefix.MaximumLength = sizeof(_imagePrefixBuffer);
+}
+
+NTSTATUS EventFilter::Set(const FilterRules* rules) {
+	if (rules->IncludeCount > MaxFilterPids || rules->ExcludeCount > MaxFilterPids)
+		return STATUS_INVALID_PARAMETER;
+
+	auto prefixLength = (ULONG)::wcsnlen(rules->ImagePrefix, MaxFilterPrefix);
+	if (prefixLength == MaxFilterPrefix)
+		return STATUS_INVALID_PARAMETER;
+
+	AutoLock locker(_lock);
+
+	::memcpy(_includePids, rules->IncludePids, rules->IncludeCount * sizeof(ULONG));
+	_includeCount = SortPids(_includePids, rules->IncludeCount);
+	::memcpy(_excludePids, rules->ExcludePids, rules->ExcludeCount * sizeof(ULONG));
+	_excludeCount = SortPids(_excludePids, rules->ExcludeCount);
+	_parentPid = rules->ParentProcessId;
+	::memcpy(_imagePrefixBuffer, rules->ImagePrefix, prefixLength * sizeof(WCHAR));
+	_imagePrefix.Length = (USHORT)(prefixLength * sizeof(WCHAR));
+
+	LONG flags = 0;
+	if (_includeCount)
+		flags |= IncludeRule;
+	if (_excludeCount)
+		flags |= ExcludeRule;
+	if (_parentPid)
+		flags |= ParentRule;
+	if (prefixLength)
+		flags |= ImageRule;
+
+	// callbacks that see the new flags take the lock before reading the rules
+	InterlockedExchange(&_rules, flags);
+	InterlockedExchange(&_typeMask, rules->EventTypes ? (LONG)rules->EventTypes : -1);
+
+	return STATUS_SUCCESS;
+}
+
+void EventFilter::Clear() {
+	AutoLock locker(_lock);
+	InterlockedExchange(&_rules, 0);
+	InterlockedExchange(&_typeMask, -1);
+}
+
+bool EventFilter::Matches(ItemType type, ULONG pid, ULONG parentPid, PCUNICODE_STRING image) {
+	if ((ReadNoFence(&_typeMask) & ItemTypeBit(type)) == 0)
+		return false;
+
+	if (ReadNoFence(&_rules) == 0)
+		return true;
+
+	return MatchesRules(type, pid, parentPid, image);
+}
+
+bool EventFilter::MatchesRules(ItemType type, ULONG pid, ULONG parentPid, PCUNICODE_STRING image) {
+	AutoSharedLock locker(_lock);
+
+	auto rules = _rules;
+	if ((rules & IncludeRule) && !ContainsPid(_includePids, _includeCount, pid))
+		return false;
+
+	if ((rules & ExcludeRule) && ContainsPid(_excludePids, _excludeCount, pid))
+		return false;
+
+	if ((rules & ParentRule) && type == ItemType::ProcessCreate && parentPid != _parentPid)
+		return false;
+
+	if ((rules & ImageRule) && (type == ItemType::ProcessCreate || type == ItemType::ImageLoad)) {
+		if (image == nullptr || !RtlPrefixUnicodeString(&_imagePrefix, image, TRUE))
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include "PushLock.h"
+
+//
+// event filter rules installed by IOCTL_SYSMON_SET_FILTER.
+// The type mask and the set of active rules are read without a lock,
+// so with no rules installed a check is a couple of memory reads.
+//
+
+class EventFilter {
+public:
+	void Init();
+
+	NTSTATUS Set(const FilterRules* rules);
+	void Clear();
+
+	// parentPid is only looked at for process create events,
+	// image only for process create and image load events
+	bool Matches(ItemType type, ULONG pid, ULONG parentPid = 0, PCUNICODE_STRING image = nullptr);
+
+private:
+	enum RuleFlags : LONG {
+		IncludeRule = 1,
+		ExcludeRule = 2,
+		ParentRule = 4,
+		ImageRule = 8
+	};
+
+	bool MatchesRules(ItemType type, ULONG pid, ULONG parentPid, PCUNICODE_STRING image);
+
+private:
+	volatile LONG _typeMask;
+	volatile LONG _rules;
+
+	PushLock _lock;
+	ULONG _parentPid;
+	ULONG _includeCount, _excludeCount;
+	ULONG _includePids[MaxFilterPids];	// sorted
+	ULONG _excludePids[MaxFilterPids];	// sorted
+	UNICODE_STRING _imagePrefix;
+	WCHAR _imagePrefixBuffer[MaxFilterPrefix];
+};
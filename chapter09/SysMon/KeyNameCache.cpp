@@ -0,0 +1,60 @@
+#include "pch.h"
+#include "KeyNameCache.h"
+#include "SysMon.h"
+#include "AutoLock.h"
+
+NTSTATUS KeyNameCache::Init() {
+	auto size = sizeof(KeyNameEntry) * KeyNameCacheSize;
+	_entries = (KeyNameEntry*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+	if (_entries == nullptr)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	::memset(_entries, 0, size);
+	_lock.Init();
+	return STATUS_SUCCESS;
+}
+
+void KeyNameCache::Term() {
+	if (_entries) {
+		ExFreePool(_entries);
+		_entries = nullptr;
+	}
+}
+
+ULONG KeyNameCache::Slot(PVOID object) {
+	// objects are at least 16 byte aligned, mix the rest of the address
+	auto value = (ULONG64)object >> 4;
+	return (ULONG)((value * 0x9E3779B97F4A7C15ULL) >> 32) & (KeyNameCacheSize - 1);
+}
+
+bool KeyNameCache::Lookup(PVOID object, ULONG generation, KeyNameEntry& entry) {
+	auto& slot = _entries[Slot(object)];
+	AutoSharedLock locker(_lock);
+	if (slot.Object != object || slot.Generation != generation)
+		return false;
+
+	entry = slot;
+	return true;
+}
+
+void KeyNameCache::Insert(PVOID object, ULONG generation, ULONG nameId, bool matches) {
+	auto& slot = _entries[Slot(object)];
+	AutoLock locker(_lock);
+	slot.Object = object;
+	slot.Generation = generation;
+	slot.NameId = nameId;
+	slot.Matches = matches;
+}
+
+void KeyNameCache::Invalidate(PVOID object) {
+	auto& slot = _entries[Slot(object)];
+	// most closed keys were never written; the shared check keeps them from taking the lock exclusively
+	{
+		AutoSharedLock locker(_lock);
+		if (slot.Object != object)
+			return;
+	}
+	AutoLock locker(_lock);
+	if (slot.Object == object)
+		slot.Object = nullptr;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "PushLock.h"
+
+const ULONG KeyNameCacheSize = 4096;	// must be a power of 2
+
+struct KeyNameEntry {
+	PVOID Object;		// registry key object, null for a free slot
+	ULONG Generation;	// of the registry rules the verdict was made with
+	ULONG NameId;		// interned key name, zero if the string table was full
+	bool Matches;		// the key matches the registry key rules
+};
+
+//
+// resolved names of recently written registry keys, keyed by the key object.
+// The cache is direct mapped - an insert replaces whatever key used the slot before.
+// Entries are removed when a handle to the key is closed or the key is deleted or renamed,
+// so a key object address that gets reused never finds a stale name. Entries made
+// under older registry rules are ignored.
+//
+
+class KeyNameCache {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	bool Lookup(PVOID object, ULONG generation, KeyNameEntry& entry);
+	void Insert(PVOID object, ULONG generation, ULONG nameId, bool matches);
+	void Invalidate(PVOID object);
+
+private:
+	static ULONG Slot(PVOID object);
+
+private:
+	KeyNameEntry* _entries;
+	PushLock _lock;
+};
@@ -0,0 +1,104 @@
+#include "pch.h"
+#include "Memory.h"
+#include "SysMon.h"
+
+// the marker for blocks that came directly from the pool
+const ULONG OversizeClass = MAXULONG;
+
+NTSTATUS ItemAllocator::Init() {
+	// one class per fixed size record, plus a few for records that carry
+	// strings of varying length (command lines, image paths, registry names)
+	const ULONG sizes[] = {
+		sizeof(FullItem<ProcessExitInfo>),
+		sizeof(FullItem<ThreadCreateExitInfo>),
+		sizeof(FullItem<ThreadSummaryInfo>),
+		sizeof(FullItem<RegistrySetValueInfo>) + 128,
+		sizeof(FullItem<RegistrySetValueInfo>) + 384,
+		sizeof(FullItem<RegistrySetValueInfo>) + 1024,
+		sizeof(FullItem<RegistrySetValueInfo>) + 4096,
+	};
+	static_assert(ARRAYSIZE(sizes) <= MaxPoolClasses, "too many pool classes");
+
+	_classCount = 0;
+	_oversize = 0;
+	for (auto size : sizes) {
+		// keep the classes sorted and unique so Allocate can pick the first fit
+		ULONG i = _classCount;
+		while (i > 0 && _sizes[i - 1] > size)
+			i--;
+		if (i > 0 && _sizes[i - 1] == size)
+			continue;
+		::memmove(_sizes + i + 1, _sizes + i, (_classCount - i) * sizeof(ULONG));
+		_sizes[i] = size;
+		_classCount++;
+	}
+
+	for (ULONG i = 0; i < _classCount; i++) {
+		auto status = ExInitializeLookasideListEx(&_lists[i], nullptr, nullptr, NonPagedPoolNx, 0, _sizes[i], DRIVER_TAG, 0);
+		if (!NT_SUCCESS(status)) {
+			while (i > 0)
+				ExDeleteLookasideListEx(&_lists[--i]);
+			_classCount = 0;
+			return status;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+void ItemAllocator::Term() {
+	for (ULONG i = 0; i < _classCount; i++)
+		ExDeleteLookasideListEx(&_lists[i]);
+	_classCount = 0;
+}
+
+FullItem<ItemHeader>* ItemAllocator::Allocate(ULONG size) {
+	FullItem<ItemHeader>* item;
+	ULONG i = 0;
+	while (i < _classCount && _sizes[i] < size)
+		i++;
+
+	if (i < _classCount) {
+		item = (FullItem<ItemHeader>*)ExAllocateFromLookasideListEx(&_lists[i]);
+	}
+	else {
+		InterlockedIncrement(&_oversize);
+		item = (FullItem<ItemHeader>*)ExAllocatePoolWithTag(NonPagedPoolNx, size, DRIVER_TAG);
+		i = OversizeClass;
+	}
+
+	if (item)
+		item->PoolClass = i;
+	return item;
+}
+
+void ItemAllocator::Free(ItemHeader* item) {
+	auto block = CONTAINING_RECORD(item, FullItem<ItemHeader>, Data);
+	if (block->PoolClass == OversizeClass) {
+		ExFreePool(block);
+	}
+	else {
+		NT_ASSERT(block->PoolClass < _classCount);
+		ExFreeToLookasideListEx(&_lists[block->PoolClass], block);
+	}
+}
+
+ULONG ItemAllocator::GetStats(PoolClassStats* stats, ULONG count) const {
+	ULONG i = 0;
+	for (; i < _classCount && i < count; i++) {
+		auto& list = _lists[i].L;
+		auto& s = stats[i];
+		s.BlockSize = _sizes[i];
+		s.Depth = list.Depth;
+		s.TotalAllocates = list.TotalAllocates;
+		s.AllocateMisses = list.AllocateMisses;
+		s.TotalFrees = list.TotalFrees;
+		s.FreeMisses = list.FreeMisses;
+	}
+	if (i < count) {
+		// last entry accounts for blocks that did not fit any class
+		auto& s = stats[i++];
+		::memset(&s, 0, sizeof(s));
+		s.TotalAllocates = s.AllocateMisses = _oversize;
+	}
+	return i;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "SysMonCommon.h"
+
+//
+// size-classed lookaside lists for event records.
+// Each block starts with the index of the class it came from,
+// so freeing does not need to know the record type.
+//
+
+template<typename T>
+struct FullItem {
+	ULONG PoolClass;	// lookaside class the block came from
+	T Data;
+};
+
+const ULONG MaxPoolClasses = 8;
+
+class ItemAllocator {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	// returns a block of at least sizeof(FullItem<T>) + extraSize bytes
+	template<typename T>
+	FullItem<T>* Allocate(ULONG extraSize = 0) {
+		return (FullItem<T>*)Allocate((ULONG)sizeof(FullItem<T>) + extraSize);
+	}
+
+	void Free(ItemHeader* item);
+
+	// fills up to count entries, returns the number of entries written
+	ULONG GetStats(PoolClassStats* stats, ULONG count) const;
+
+private:
+	FullItem<ItemHeader>* Allocate(ULONG size);
+
+private:
+	LOOKASIDE_LIST_EX _lists[MaxPoolClasses];
+	ULONG _sizes[MaxPoolClasses];
+	ULONG _classCount;
+	volatile LONG _oversize;	// allocations too big for any class
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+const ULONG PidNotFound = MAXULONG;
+
+//
+// per-process entries in an open addressing hash table keyed by PID, with linear probing.
+// Entry is a struct whose ProcessId is zero in a free slot; Size must be a power of 2.
+// A PID is looked for in at most MaxProbes slots, so an insert can fail before the table
+// is full. Not synchronized; the owner brings its own lock.
+//
+
+template<typename Entry, ULONG Size, ULONG MaxProbes>
+class PidHashTable {
+public:
+	NTSTATUS Init(ULONG tag) {
+		_table = (Entry*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Entry) * Size, tag);
+		if (_table == nullptr)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		::memset(_table, 0, sizeof(Entry) * Size);
+		return STATUS_SUCCESS;
+	}
+
+	void Term() {
+		if (_table) {
+			ExFreePool(_table);
+			_table = nullptr;
+		}
+	}
+
+	bool IsAllocated() const {
+		return _table != nullptr;
+	}
+
+	Entry& operator[](ULONG index) {
+		return _table[index];
+	}
+
+	const Entry& operator[](ULONG index) const {
+		return _table[index];
+	}
+
+	// returns the PID's slot or PidNotFound
+	ULONG Find(ULONG pid) const {
+		auto index = Slot(pid);
+		for (ULONG i = 0; i < MaxProbes; i++) {
+			auto entry = _table[index].ProcessId;
+			if (entry == pid)
+				return index;
+			if (entry == 0)
+				break;
+			index = (index + 1) & (Size - 1);
+		}
+		return PidNotFound;
+	}
+
+	// returns the PID's slot, claiming and zeroing a free one if it is not there yet;
+	// PidNotFound if its probe sequence is full
+	ULONG Insert(ULONG pid) {
+		auto index = Slot(pid);
+		for (ULONG i = 0; i < MaxProbes; i++) {
+			auto& entry = _table[index];
+			if (entry.ProcessId == pid)
+				return index;
+			if (entry.ProcessId == 0) {
+				::memset(&entry, 0, sizeof(entry));
+				entry.ProcessId = pid;
+				return index;
+			}
+			index = (index + 1) & (Size - 1);
+		}
+		return PidNotFound;
+	}
+
+	// frees the slot; a later entry of the same probe sequence may move into it
+	void RemoveAt(ULONG index) {
+		// shift the rest of the sequence back instead of leaving a tombstone, which lookups would have to skip
+		const ULONG mask = Size - 1;
+		auto hole = index;
+		auto next = index;
+		for (;;) {
+			next = (next + 1) & mask;
+			if (_table[next].ProcessId == 0)
+				break;
+
+			// an entry may fill the hole only if that keeps it reachable from its home slot
+			auto home = Slot(_table[next].ProcessId);
+			if (((next - home) & mask) >= ((next - hole) & mask)) {
+				_table[hole] = _table[next];
+				hole = next;
+			}
+		}
+		_table[hole].ProcessId = 0;
+	}
+
+private:
+	static ULONG Slot(ULONG pid) {
+		// PIDs are multiples of 4, the low bits carry nothing
+		return ((pid >> 2) * 2654435761UL) & (Size - 1);
+	}
+
+private:
+	Entry* _table;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+//
+// small sorted arrays of process IDs, for rule and watch lists
+//
+
+// sorts in place and removes duplicates, returns the new count
+inline ULONG SortPids(ULONG* pids, ULONG count) {
+	// insertion sort is fine for a few dozen entries
+	ULONG unique = 0;
+	for (ULONG i = 0; i < count; i++) {
+		auto pid = pids[i];
+		ULONG j = unique;
+		while (j > 0 && pids[j - 1] > pid) {
+			pids[j] = pids[j - 1];
+			j--;
+		}
+		if (j > 0 && pids[j - 1] == pid) {
+			// already present, undo the shift
+			::memmove(pids + j, pids + j + 1, (unique - j) * sizeof(ULONG));
+			continue;
+		}
+		pids[j] = pid;
+		unique++;
+	}
+	return unique;
+}
+
+inline bool ContainsPid(const ULONG* pids, ULONG count, ULONG pid) {
+	// binary search
+	ULONG low = 0, high = count;
+	while (low < high) {
+		auto mid = (low + high) / 2;
+		if (pids[mid] == pid)
+			return true;
+		if (pids[mid] < pid)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return false;
+}
@@ -0,0 +1,122 @@
+#include "pch.h"
+#include "ProcessTable.h"
+#include "SysMon.h"
+
+NTSTATUS ProcessTable::Init() {
+	auto status = _table.Init(DRIVER_TAG);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	_lock = 0;
+	_nextKey = 0;
+	return STATUS_SUCCESS;
+}
+
+void ProcessTable::Term() {
+	_table.Term();
+}
+
+ULONG ProcessTable::Add(ULONG pid, ULONG parentPid, ULONG imageFileNameId) {
+	LARGE_INTEGER createTime;
+	KeQuerySystemTimePrecise(&createTime);
+
+	// a PID is not reused before its process is gone, but a missed exit would leave it behind
+	return Insert(pid, parentPid, imageFileNameId, createTime, true);
+}
+
+ULONG ProcessTable::AddRunning(ULONG pid, ULONG parentPid, ULONG imageFileNameId, const LARGE_INTEGER& createTime) {
+	// the callback's entry is the newer one if the PID was reused since the process list was taken
+	return Insert(pid, parentPid, imageFileNameId, createTime, false);
+}
+
+ULONG ProcessTable::Insert(ULONG pid, ULONG parentPid, ULONG imageFileNameId, const LARGE_INTEGER& createTime, bool replace) {
+	auto irql = ExAcquireSpinLockExclusive(&_lock);
+
+	auto index = _table.Insert(pid);
+	if (index == PidNotFound) {
+		ExReleaseSpinLockExclusive(&_lock, irql);
+		return 0;
+	}
+
+	auto& state = _table[index];
+	if (!replace && state.ProcessKey) {
+		auto existing = state.ProcessKey;
+		ExReleaseSpinLockExclusive(&_lock, irql);
+		return existing;
+	}
+
+	state.ProcessId = pid;
+	state.ParentProcessId = parentPid;
+	state.ImageFileNameId = imageFileNameId;
+	state.CreateTime = createTime;
+	// zero means unknown
+	do {
+		state.ProcessKey = (ULONG)InterlockedIncrement(&_nextKey);
+	} while (state.ProcessKey == 0);
+	auto key = state.ProcessKey;
+
+	ExReleaseSpinLockExclusive(&_lock, irql);
+	return key;
+}
+
+bool ProcessTable::Remove(ULONG pid, ProcessState& state) {
+	auto irql = ExAcquireSpinLockExclusive(&_lock);
+	auto index = _table.Find(pid);
+	if (index != PidNotFound) {
+		state = _table[index];
+		_table.RemoveAt(index);
+	}
+	ExReleaseSpinLockExclusive(&_lock, irql);
+	return index != PidNotFound;
+}
+
+ULONG ProcessTable::GetKey(ULONG pid) {
+	auto irql = ExAcquireSpinLockShared(&_lock);
+	auto index = _table.Find(pid);
+	auto key = index == PidNotFound ? 0 : _table[index].ProcessKey;
+	ExReleaseSpinLockShared(&_lock, irql);
+	return key;
+}
+
+ULONG ProcessTable::GetSnapshot(PVOID buffer, ULONG size) {
+	auto snapshot = (ProcessSnapshot*)buffer;
+	auto entries = (ProcessEntry*)(snapshot + 1);
+	auto maxCount = (size - sizeof(ProcessSnapshot)) / sizeof(ProcessEntry);
+
+	ULONG count = 0, total = 0;
+	auto irql = ExAcquireSpinLockShared(&_lock);
+	for (ULONG i = 0; i < ProcessTableSize; i++) {
+		auto& state = _table[i];
+		if (state.ProcessId == 0)
+			continue;
+
+		total++;
+		if (count == maxCount)
+			continue;
+
+		auto& entry = entries[count++];
+		entry.ProcessId = state.ProcessId;
+		entry.ProcessKey = state.ProcessKey;
+		entry.ParentProcessId = state.ParentProcessId;
+		entry.ImageFileNameId = state.ImageFileNameId;
+		entry.CreateTime = state.CreateTime;
+	}
+	ExReleaseSpinLockShared(&_lock, irql);
+
+	snapshot->Count = count;
+	snapshot->Total = total;
+
+	// the names go after the entries, as many as fit
+	auto offset = (ULONG)(sizeof(ProcessSnapshot) + count * sizeof(ProcessEntry));
+	for (ULONG i = 0; i < count; i++) {
+		auto& entry = entries[i];
+		ULONG length = 0;
+		entry.ImageFileNameOffset = offset;
+		if (entry.ImageFileNameId == 0 ||
+			!NT_SUCCESS(g_Globals.Strings.Lookup(entry.ImageFileNameId, (PWSTR)((PUCHAR)buffer + offset), size - offset, length)))
+			length = 0;
+		entry.ImageFileNameLength = length / sizeof(WCHAR);
+		offset += length;
+	}
+	return offset;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include "PidHashTable.h"
+
+const ULONG ProcessTableSize = 4096;	// must be a power of 2
+const ULONG MaxProcessProbes = 64;
+
+struct ProcessState {
+	ULONG ProcessId;		// zero for a free slot
+	ULONG ProcessKey;
+	ULONG ParentProcessId;
+	ULONG ImageFileNameId;
+	LARGE_INTEGER CreateTime;
+};
+
+//
+// live processes by PID, filled from the process notify callback and seeded at load
+// with the processes already running. Other callbacks look up the process key
+// under the shared side of a reader/writer spin lock.
+//
+
+class ProcessTable {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	// returns the new process's key, zero if the table is full
+	ULONG Add(ULONG pid, ULONG parentPid, ULONG imageFileNameId);
+	// adds a process that was running before the driver was loaded, unless the notify callback added it first
+	ULONG AddRunning(ULONG pid, ULONG parentPid, ULONG imageFileNameId, const LARGE_INTEGER& createTime);
+	// fills in the state of the process and removes it, returns false if it was not known
+	bool Remove(ULONG pid, ProcessState& state);
+	ULONG GetKey(ULONG pid);
+
+	// fills a ProcessSnapshot, returns the number of bytes written
+	ULONG GetSnapshot(PVOID buffer, ULONG size);
+
+private:
+	ULONG Insert(ULONG pid, ULONG parentPid, ULONG imageFileNameId, const LARGE_INTEGER& createTime, bool replace);
+
+private:
+	PidHashTable<ProcessState, ProcessTableSize, MaxProcessProbes> _table;
+	EX_SPIN_LOCK _lock;
+	volatile LONG _nextKey;
+};
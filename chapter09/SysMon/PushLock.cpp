@@ -0,0 +1,27 @@
+#include "pch.h"
+#include "PushLock.h"
+
+
+void PushLock::Init() {
+	ExInitializePushLock(&_lock);
+}
+
+void PushLock::Lock() {
+	KeEnterCriticalRegion();
+	ExAcquirePushLockExclusive(&_lock);
+}
+
+void PushLock::Unlock() {
+	ExReleasePushLockExclusive(&_lock);
+	KeLeaveCriticalRegion();
+}
+
+void PushLock::LockShared() {
+	KeEnterCriticalRegion();
+	ExAcquirePushLockShared(&_lock);
+}
+
+void PushLock::UnlockShared() {
+	ExReleasePushLockShared(&_lock);
+	KeLeaveCriticalRegion();
+}
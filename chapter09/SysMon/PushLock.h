@@ -0,0 +1,17 @@
+#pragma once
+
+// reader/writer lock for data read on hot paths and rarely changed
+class PushLock {
+public:
+	void Init();
+
+	void Lock();
+	void Unlock();
+
+	void LockShared();
+	void UnlockShared();
+
+private:
+	EX_PUSH_LOCK _lock;
+};
+
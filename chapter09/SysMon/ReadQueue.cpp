@@ -0,0 +1,229 @@
+#include "pch.h"
+#include "ReadQueue.h"
+#include "SysMon.h"
+#include "AutoLock.h"
+
+// insert context for putting an IRP back at the front of the queue
+#define INSERT_AT_HEAD ((PVOID)1)
+
+NTSTATUS ReadQueue::Init() {
+	InitializeListHead(&_irps);
+	KeInitializeSpinLock(&_lock);
+	KeInitializeEvent(&_dataEvent, SynchronizationEvent, FALSE);
+	_pendingCount = 0;
+	_stop = false;
+	SetBatching(DefaultReadMinBytes, DefaultReadMaxDelay);
+
+	auto status = IoCsqInitializeEx(&_csq, CsqInsertIrp, CsqRemoveIrp, CsqPeekNextIrp,
+		CsqAcquireLock, CsqReleaseLock, CsqCompleteCanceledIrp);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	HANDLE hThread;
+	status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, DeliveryThread, this);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = ObReferenceObjectByHandle(hThread, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&_thread, nullptr);
+	if (!NT_SUCCESS(status)) {
+		// the driver is about to fail loading, the thread must be gone by then
+		_stop = true;
+		KeSetEvent(&_dataEvent, IO_NO_INCREMENT, FALSE);
+		ZwWaitForSingleObject(hThread, FALSE, nullptr);
+	}
+	ZwClose(hThread);
+	return status;
+}
+
+void ReadQueue::Term() {
+	_stop = true;
+	KeSetEvent(&_dataEvent, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(_thread, Executive, KernelMode, FALSE, nullptr);
+	ObDereferenceObject(_thread);
+
+	Cleanup(nullptr);
+}
+
+void ReadQueue::SetBatching(ULONG minBytes, ULONG maxDelayMs) {
+	_minBytes = minBytes;
+	_maxDelay = maxDelayMs * 10000LL;
+	KeSetEvent(&_dataEvent, IO_NO_INCREMENT, FALSE);
+}
+
+NTSTATUS ReadQueue::Read(PIRP Irp) {
+	NT_ASSERT(Irp->MdlAddress);		// we're using Direct I/O
+
+	auto consumer = GetConsumer(Irp);
+	{
+		// complete right away if there is nothing ahead of us and the batch is ready
+		AutoLock locker(g_Globals.Mutex);
+		LONGLONG waitTime;
+		if (consumer->PendingReads == 0 && BatchReady(consumer, ReadLength(Irp), waitTime)) {
+			auto status = CompleteRead(consumer, Irp);
+			g_Globals.Queue.Reclaim();
+			return status;
+		}
+	}
+
+	IoCsqInsertIrpEx(&_csq, Irp, nullptr, nullptr);
+	KeSetEvent(&_dataEvent, IO_NO_INCREMENT, FALSE);
+	return STATUS_PENDING;
+}
+
+void ReadQueue::Cleanup(PFILE_OBJECT FileObject) {
+	// a null file object matches every IRP
+	PIRP irp;
+	while ((irp = IoCsqRemoveNextIrp(&_csq, FileObject)) != nullptr) {
+		irp->IoStatus.Status = STATUS_CANCELLED;
+		irp->IoStatus.Information = 0;
+		IoCompleteRequest(irp, IO_NO_INCREMENT);
+	}
+}
+
+void ReadQueue::NotifyPush() {
+	if ((ReadNoFence(&_pendingCount) || SharedChannel::AnyMapped()) && !KeReadStateEvent(&_dataEvent))
+		KeSetEvent(&_dataEvent, IO_NO_INCREMENT, FALSE);
+}
+
+void ReadQueue::Wake() {
+	KeSetEvent(&_dataEvent, IO_NO_INCREMENT, FALSE);
+}
+
+ULONG ReadQueue::ReadLength(PIRP Irp) {
+	return IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.Length;
+}
+
+Consumer* ReadQueue::GetConsumer(PIRP Irp) {
+	return (Consumer*)IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext;
+}
+
+bool ReadQueue::BatchReady(Consumer* consumer, ULONG capacity, LONGLONG& waitTime) const {
+	// caller holds g_Globals.Mutex
+	waitTime = 0;
+	ULONG cpu;
+	auto oldest = g_Globals.Queue.PeekOldest(consumer, cpu);
+	if (oldest == nullptr)
+		return false;
+
+	if (g_Globals.Queue.GetPendingBytes(consumer) >= min(_minBytes, capacity))
+		return true;
+
+	LARGE_INTEGER now;
+	KeQuerySystemTimePrecise(&now);
+	auto age = now.QuadPart - oldest->Time.QuadPart;
+	if (age >= _maxDelay)
+		return true;
+
+	waitTime = _maxDelay - age;
+	return false;
+}
+
+static void MergeWaitTime(LONGLONG& waitTime, LONGLONG other) {
+	// zero means wait for the next push
+	if (other && (waitTime == 0 || other < waitTime))
+		waitTime = other;
+}
+
+void ReadQueue::Deliver(LONGLONG& waitTime) {
+	AutoLock locker(g_Globals.Mutex);
+
+	g_Globals.Queue.Trim();
+	g_Globals.Queue.ForEachConsumer([&](Consumer* consumer) {
+		LONGLONG consumerWait;
+		Deliver(consumer, consumerWait);
+		MergeWaitTime(waitTime, consumerWait);
+	});
+	g_Globals.Queue.Reclaim();
+}
+
+void ReadQueue::Deliver(Consumer* consumer, LONGLONG& waitTime) {
+	waitTime = 0;
+	if (consumer->PendingReads) {
+		for (;;) {
+			auto irp = IoCsqRemoveNextIrp(&_csq, consumer->FileObject);
+			if (irp == nullptr)
+				break;
+
+			if (!BatchReady(consumer, ReadLength(irp), waitTime)) {
+				// not ready yet - put it back at the front and wait for more data or the deadline
+				IoCsqInsertIrpEx(&_csq, irp, nullptr, INSERT_AT_HEAD);
+				break;
+			}
+			CompleteRead(consumer, irp);
+		}
+	}
+
+	auto& channel = consumer->Channel;
+	if (channel.IsMapped()) {
+		LONGLONG channelWait;
+		if (BatchReady(consumer, channel.GetFreeBytes(), channelWait)) {
+			// if the client is not keeping up, retry after a full delay period
+			if (!channel.Fill(consumer))
+				channelWait = _maxDelay;
+		}
+		MergeWaitTime(waitTime, channelWait);
+	}
+}
+
+void ReadQueue::DeliveryThread(PVOID context) {
+	auto queue = (ReadQueue*)context;
+
+	while (!queue->_stop) {
+		LONGLONG waitTime = 0;
+		queue->Deliver(waitTime);
+
+		LARGE_INTEGER timeout;
+		timeout.QuadPart = -waitTime;	// relative
+		KeWaitForSingleObject(&queue->_dataEvent, Executive, KernelMode, FALSE, waitTime ? &timeout : nullptr);
+	}
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+//
+// cancel-safe queue callbacks
+//
+
+NTSTATUS ReadQueue::CsqInsertIrp(PIO_CSQ csq, PIRP Irp, PVOID context) {
+	auto queue = CONTAINING_RECORD(csq, ReadQueue, _csq);
+	if (context == INSERT_AT_HEAD)
+		InsertHeadList(&queue->_irps, &Irp->Tail.Overlay.ListEntry);
+	else
+		InsertTailList(&queue->_irps, &Irp->Tail.Overlay.ListEntry);
+	InterlockedIncrement(&queue->_pendingCount);
+	InterlockedIncrement(&GetConsumer(Irp)->PendingReads);
+	return STATUS_SUCCESS;
+}
+
+void ReadQueue::CsqRemoveIrp(PIO_CSQ csq, PIRP Irp) {
+	auto queue = CONTAINING_RECORD(csq, ReadQueue, _csq);
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+	InterlockedDecrement(&queue->_pendingCount);
+	InterlockedDecrement(&GetConsumer(Irp)->PendingReads);
+}
+
+PIRP ReadQueue::CsqPeekNextIrp(PIO_CSQ csq, PIRP Irp, PVOID PeekContext) {
+	auto queue = CONTAINING_RECORD(csq, ReadQueue, _csq);
+	auto next = Irp ? Irp->Tail.Overlay.ListEntry.Flink : queue->_irps.Flink;
+	for (; next != &queue->_irps; next = next->Flink) {
+		auto irp = CONTAINING_RECORD(next, IRP, Tail.Overlay.ListEntry);
+		if (PeekContext == nullptr || IoGetCurrentIrpStackLocation(irp)->FileObject == PeekContext)
+			return irp;
+	}
+	return nullptr;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+void ReadQueue::CsqAcquireLock(PIO_CSQ csq, PKIRQL Irql) {
+	KeAcquireSpinLock(&CONTAINING_RECORD(csq, ReadQueue, _csq)->_lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+void ReadQueue::CsqReleaseLock(PIO_CSQ csq, KIRQL Irql) {
+	KeReleaseSpinLock(&CONTAINING_RECORD(csq, ReadQueue, _csq)->_lock, Irql);
+}
+
+void ReadQueue::CsqCompleteCanceledIrp(PIO_CSQ, PIRP Irp) {
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+const ULONG DefaultReadMinBytes = 16 * 1024;
+const ULONG DefaultReadMaxDelay = 20;		// msec
+
+struct Consumer;
+
+//
+// cancel-safe queue of pending read IRPs, completed by a delivery thread
+// once enough data is queued for the IRP's consumer or the oldest event
+// has waited long enough. The same thread feeds the shared channels
+// consumers have mapped.
+//
+class ReadQueue {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	NTSTATUS Read(PIRP Irp);
+	void Cleanup(PFILE_OBJECT FileObject);
+
+	// called by producers after every push, cheap when no read is pending
+	void NotifyPush();
+	// forces the delivery thread to look at the queue
+	void Wake();
+
+	void SetBatching(ULONG minBytes, ULONG maxDelayMs);
+
+private:
+	static IO_CSQ_INSERT_IRP_EX CsqInsertIrp;
+	static IO_CSQ_REMOVE_IRP CsqRemoveIrp;
+	static IO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp;
+	static IO_CSQ_ACQUIRE_LOCK CsqAcquireLock;
+	static IO_CSQ_RELEASE_LOCK CsqReleaseLock;
+	static IO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp;
+	static KSTART_ROUTINE DeliveryThread;
+
+	static ULONG ReadLength(PIRP Irp);
+	static Consumer* GetConsumer(PIRP Irp);
+	bool BatchReady(Consumer* consumer, ULONG capacity, LONGLONG& waitTime) const;
+	void Deliver(Consumer* consumer, LONGLONG& waitTime);
+	void Deliver(LONGLONG& waitTime);
+
+private:
+	IO_CSQ _csq;
+	KSPIN_LOCK _lock;
+	LIST_ENTRY _irps;
+	volatile LONG _pendingCount;	// for all consumers
+	KEVENT _dataEvent;
+	PKTHREAD _thread;
+	volatile bool _stop;
+	ULONG _minBytes;
+	LONGLONG _maxDelay;		// in 100nsec units
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+//
+// validated, zero copy access to buffers of event records, for the client and the offline tools.
+// RecordReader checks each record once, when it reaches it: the size must fit the rest of the
+// buffer and cover the fixed part of the record's type. Strings and data inside a record are
+// checked against its size when they are accessed. Nothing is copied; views point into the buffer.
+//
+
+#include "SysMonCommon.h"
+
+// the fields every record starts with. An ItemType::None padding record may be no longer than this,
+// so its time must not be read
+const ULONG RecordPrefixSize = sizeof(ItemType) + 2 * sizeof(USHORT);
+
+// the fixed part of records of the current version
+inline ULONG RecordFixedSize(ItemType type) {
+	switch (type) {
+		case ItemType::None:				return RecordPrefixSize;
+		case ItemType::ProcessCreate:		return sizeof(ProcessCreateInfo);
+		case ItemType::ProcessExit:			return sizeof(ProcessExitInfo);
+		case ItemType::ThreadCreate:
+		case ItemType::ThreadExit:			return sizeof(ThreadCreateExitInfo);
+		case ItemType::ImageLoad:			return sizeof(ImageLoadInfo);
+		case ItemType::RegistrySetValue:	return sizeof(RegistrySetValueInfo);
+		case ItemType::EventsLost:			return sizeof(EventsLostInfo);
+		case ItemType::ThreadSummary:		return sizeof(ThreadSummaryInfo);
+		case ItemType::StringDefinition:	return sizeof(StringDefinitionInfo);
+		case ItemType::RegistryCreateKey:
+		case ItemType::RegistryDeleteKey:
+		case ItemType::RegistryDeleteValue:
+		case ItemType::RegistryRenameKey:	return sizeof(RegistryKeyInfo);
+	}
+	// a type added by a newer driver
+	return sizeof(ItemHeader);
+}
+
+// the smallest size a record can have and still be read safely
+inline ULONG RecordMinSize(const ItemHeader* header) {
+	if (header->Type == ItemType::None)
+		return RecordPrefixSize;
+	// the layout of other versions is not known, but the header is the same
+	return header->Version == ItemHeaderVersion ? RecordFixedSize(header->Type) : sizeof(ItemHeader);
+}
+
+// a string inside a record, not NULL terminated; Data is null if it does not fit the record
+struct RecordText {
+	const WCHAR* Data;
+	size_t Length;		// in WCHARs
+};
+
+// a record that passed validation
+class RecordView {
+public:
+	RecordView() = default;
+	explicit RecordView(const ItemHeader* header) : _header(header) {}
+
+	const ItemHeader* Header() const {
+		return _header;
+	}
+
+	ItemType Type() const {
+		return _header->Type;
+	}
+
+	ULONG Size() const {
+		return _header->Size;
+	}
+
+	// the record as its type's structure, null if the record is too short for it
+	template<typename T>
+	const T* As() const {
+		return sizeof(T) <= _header->Size ? static_cast<const T*>(_header) : nullptr;
+	}
+
+	// offsets are from the start of the record, the length is in WCHARs
+	RecordText Text(USHORT offset, USHORT length) const {
+		if ((ULONG)offset + length * sizeof(WCHAR) > _header->Size)
+			return RecordText{ nullptr, 0 };
+		return RecordText{ (const WCHAR*)((const UCHAR*)_header + offset), length };
+	}
+
+	// null if the bytes do not fit the record
+	const UCHAR* Data(USHORT offset, USHORT length) const {
+		if ((ULONG)offset + length > _header->Size)
+			return nullptr;
+		return (const UCHAR*)_header + offset;
+	}
+
+private:
+	const ItemHeader* _header = nullptr;
+};
+
+//
+// walks a buffer of records, stopping at the end of the buffer or at the first malformed record.
+// Alignment is that of the records in the buffer (SharedRecordAlignment for the shared channel),
+// a power of 2.
+//
+//	RecordReader reader(buffer, size);
+//	RecordView record;
+//	while (reader.Next(record)) {
+//		if (auto info = record.As<ProcessExitInfo>())
+//			...
+//	}
+//
+
+class RecordReader {
+public:
+	RecordReader(const void* buffer, size_t size, ULONG alignment = 1)
+		: _data((const UCHAR*)buffer), _size(size), _alignMask(alignment - 1) {}
+
+	bool Next(RecordView& record) {
+		auto left = _size - _offset;
+		if (left == 0)
+			return false;
+
+		auto header = (const ItemHeader*)(_data + _offset);
+		// the size, type and version are the first fields, so only they are read before the size is checked
+		if (left < RecordPrefixSize || header->Size > left || header->Size < RecordMinSize(header)) {
+			_malformed = true;
+			return false;
+		}
+
+		auto size = ((size_t)header->Size + _alignMask) & ~(size_t)_alignMask;
+		_offset += size < left ? size : left;
+		record = RecordView(header);
+		return true;
+	}
+
+	// bytes consumed by the records returned so far
+	size_t Offset() const {
+		return _offset;
+	}
+
+	// true if Next stopped before the end of the buffer
+	bool Malformed() const {
+		return _malformed;
+	}
+
+private:
+	const UCHAR* _data;
+	size_t _size;
+	size_t _offset = 0;
+	size_t _alignMask;
+	bool _malformed = false;
+};
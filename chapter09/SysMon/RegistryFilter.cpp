@@ -0,0 +1,131 @@
+#include "pch.h"
+#include "RegistryFilter.h"
+#include "AutoLock.h"
+
+static const WCHAR MachinePrefix[] = L"\\REGISTRY\\MACHINE\\";
+
+void RegistryFilter::Init() {
+	_lock.Init();
+	_types = DefaultRegistryEventTypes;
+	_generation = 0;
+	_valueNameCount = 0;
+
+	// HKLM only, as before there were rules
+	Compile(MachinePrefix, _keyPrefixes[0], _keyPrefixBuffers[0]);
+	_keyPrefixCount = 1;
+}
+
+bool RegistryFilter::IsValidName(PCWSTR name) {
+	auto length = ::wcsnlen(name, MaxRegistryRuleName);
+	return length > 0 && length < MaxRegistryRuleName;
+}
+
+void RegistryFilter::Compile(PCWSTR name, UNICODE_STRING& target, PWSTR buffer) {
+	// upcased once here, so matching upcases only the name it is given
+	auto length = ::wcslen(name);
+	for (size_t i = 0; i < length; i++)
+		buffer[i] = RtlUpcaseUnicodeChar(name[i]);
+	target.Buffer = buffer;
+	target.Length = target.MaximumLength = (USHORT)(length * sizeof(WCHAR));
+}
+
+void RegistryFilter::Upcase(PCUNICODE_STRING name, UNICODE_STRING& target, PWSTR buffer) {
+	// rules are shorter than MaxRegistryRuleName, so the rest of a longer name cannot change a match
+	USHORT length = (USHORT)min(name->Length / sizeof(WCHAR), MaxRegistryRuleName);
+	for (USHORT i = 0; i < length; i++)
+		buffer[i] = RtlUpcaseUnicodeChar(name->Buffer[i]);
+	target.Buffer = buffer;
+	target.Length = target.MaximumLength = (USHORT)(length * sizeof(WCHAR));
+}
+
+void RegistryFilter::MoveKeyPrefix(ULONG to, ULONG from) {
+	::memcpy(_keyPrefixBuffers[to], _keyPrefixBuffers[from], _keyPrefixes[from].Length);
+	_keyPrefixes[to].Buffer = _keyPrefixBuffers[to];
+	_keyPrefixes[to].Length = _keyPrefixes[to].MaximumLength = _keyPrefixes[from].Length;
+}
+
+NTSTATUS RegistryFilter::Set(const RegistryRules* rules) {
+	if ((rules->EventTypes & ~RegistryEventTypes) != 0)
+		return STATUS_INVALID_PARAMETER;
+	if (rules->KeyPrefixCount > MaxRegistryKeyPrefixes || rules->ValueNameCount > MaxRegistryValueNames)
+		return STATUS_INVALID_PARAMETER;
+
+	for (ULONG i = 0; i < rules->KeyPrefixCount; i++)
+		if (!IsValidName(rules->KeyPrefixes[i]))
+			return STATUS_INVALID_PARAMETER;
+	for (ULONG i = 0; i < rules->ValueNameCount; i++)
+		if (!IsValidName(rules->ValueNames[i]))
+			return STATUS_INVALID_PARAMETER;
+
+	AutoLock locker(_lock);
+
+	ULONG count = 0;
+	if (rules->KeyPrefixCount == 0) {
+		Compile(MachinePrefix, _keyPrefixes[0], _keyPrefixBuffers[0]);
+		count = 1;
+	}
+	for (ULONG i = 0; i < rules->KeyPrefixCount; i++) {
+		auto& prefix = _keyPrefixes[count];
+		Compile(rules->KeyPrefixes[i], prefix, _keyPrefixBuffers[count]);
+
+		// a prefix that starts with another prefix adds nothing, keep the shorter one
+		bool covered = false;
+		for (ULONG j = 0; j < count && !covered; j++)
+			covered = RtlPrefixUnicodeString(&_keyPrefixes[j], &prefix, FALSE);
+		if (covered)
+			continue;
+
+		// drop every prefix the new one covers, then put it after the ones left
+		ULONG kept = 0;
+		for (ULONG j = 0; j < count; j++) {
+			if (RtlPrefixUnicodeString(&prefix, &_keyPrefixes[j], FALSE))
+				continue;
+			if (kept != j)
+				MoveKeyPrefix(kept, j);
+			kept++;
+		}
+		if (kept != count)
+			MoveKeyPrefix(kept, count);
+		count = kept + 1;
+	}
+	_keyPrefixCount = count;
+
+	for (ULONG i = 0; i < rules->ValueNameCount; i++)
+		Compile(rules->ValueNames[i], _valueNames[i], _valueNameBuffers[i]);
+	_valueNameCount = rules->ValueNameCount;
+
+	InterlockedExchange(&_types, rules->EventTypes);
+	InterlockedIncrement(&_generation);
+	return STATUS_SUCCESS;
+}
+
+bool RegistryFilter::MatchesKey(PCUNICODE_STRING name) {
+	WCHAR buffer[MaxRegistryRuleName];
+	UNICODE_STRING upcased;
+	Upcase(name, upcased, buffer);
+
+	AutoSharedLock locker(_lock);
+
+	for (ULONG i = 0; i < _keyPrefixCount; i++) {
+		if (RtlPrefixUnicodeString(&_keyPrefixes[i], &upcased, FALSE))
+			return true;
+	}
+	return false;
+}
+
+bool RegistryFilter::MatchesValue(PCUNICODE_STRING name) {
+	AutoSharedLock locker(_lock);
+
+	if (_valueNameCount == 0)
+		return true;
+
+	WCHAR buffer[MaxRegistryRuleName];
+	UNICODE_STRING upcased;
+	Upcase(name, upcased, buffer);
+
+	for (ULONG i = 0; i < _valueNameCount; i++) {
+		if (RtlEqualUnicodeString(&_valueNames[i], &upcased, FALSE))
+			return true;
+	}
+	return false;
+}
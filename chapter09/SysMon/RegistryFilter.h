@@ -0,0 +1,49 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include "PushLock.h"
+
+//
+// registry event classes and key/value rules installed by IOCTL_SYSMON_SET_REGISTRY_RULES.
+// The class mask is read without a lock, so a disabled class costs one memory read.
+// Rules are compiled when set: names are upcased and key prefixes covered by
+// a shorter prefix are dropped. Names being matched are upcased once and
+// compared case sensitively with every rule.
+//
+
+class RegistryFilter {
+public:
+	void Init();
+
+	NTSTATUS Set(const RegistryRules* rules);
+
+	bool IsEnabled(ItemType type) const {
+		return (ReadNoFence(&_types) & ItemTypeBit(type)) != 0;
+	}
+
+	bool MatchesKey(PCUNICODE_STRING name);
+	bool MatchesValue(PCUNICODE_STRING name);
+
+	// changes with the rules, key verdicts cached under an older generation are stale
+	ULONG Generation() const {
+		return (ULONG)ReadNoFence(&_generation);
+	}
+
+private:
+	static bool IsValidName(PCWSTR name);
+	static void Compile(PCWSTR name, UNICODE_STRING& target, PWSTR buffer);
+	static void Upcase(PCUNICODE_STRING name, UNICODE_STRING& target, PWSTR buffer);
+	void MoveKeyPrefix(ULONG to, ULONG from);
+
+private:
+	volatile LONG _types;
+	volatile LONG _generation;
+
+	PushLock _lock;
+	ULONG _keyPrefixCount;
+	ULONG _valueNameCount;
+	UNICODE_STRING _keyPrefixes[MaxRegistryKeyPrefixes];
+	UNICODE_STRING _valueNames[MaxRegistryValueNames];
+	WCHAR _keyPrefixBuffers[MaxRegistryKeyPrefixes][MaxRegistryRuleName];
+	WCHAR _valueNameBuffers[MaxRegistryValueNames][MaxRegistryRuleName];
+};
@@ -0,0 +1,177 @@
+#include "pch.h"
+#include "SharedChannel.h"
+#include "SysMon.h"
+
+volatile LONG SharedChannel::_mappedCount;
+
+NTSTATUS SharedChannel::Map(ULONG size, HANDLE hEvent, PVOID* userAddress) {
+	if (_header)
+		return STATUS_ALREADY_REGISTERED;
+
+	ULONG dataSize = MinChannelSize;
+	while (dataSize < size && dataSize < MaxChannelSize)
+		dataSize <<= 1;
+
+	PKEVENT event = nullptr;
+	if (hEvent) {
+		auto status = ObReferenceObjectByHandle(hEvent, EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, (PVOID*)&event, nullptr);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	auto status = STATUS_INSUFFICIENT_RESOURCES;
+	PMDL mdl = nullptr;
+	SharedChannelHeader* header = nullptr;
+	PVOID user = nullptr;
+
+	do {
+		PHYSICAL_ADDRESS low, high, skip;
+		low.QuadPart = skip.QuadPart = 0;
+		high.QuadPart = -1;
+		mdl = MmAllocatePagesForMdlEx(low, high, skip, sizeof(SharedChannelHeader) + dataSize, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+		if (mdl == nullptr)
+			break;
+
+		header = (SharedChannelHeader*)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+		if (header == nullptr)
+			break;
+
+		__try {
+			// maps into the current process - the client calling us
+			user = MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached, nullptr, FALSE, NormalPagePriority | MdlMappingNoExecute);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			user = nullptr;
+		}
+		if (user == nullptr)
+			break;
+
+		status = STATUS_SUCCESS;
+	} while (false);
+
+	if (!NT_SUCCESS(status)) {
+		if (header)
+			MmUnmapLockedPages(header, mdl);
+		if (mdl) {
+			MmFreePagesFromMdl(mdl);
+			ExFreePool(mdl);
+		}
+		if (event)
+			ObDereferenceObject(event);
+		return status;
+	}
+
+	::memset(header, 0, sizeof(*header));
+	header->DataSize = dataSize;
+
+	_data = (UCHAR*)(header + 1);
+	_dataSize = dataSize;
+	_producer = 0;
+	_mdl = mdl;
+	_userAddress = user;
+	_event = event;
+	_process = PsGetCurrentProcess();
+	ObReferenceObject(_process);
+	_header = header;
+	InterlockedIncrement(&_mappedCount);
+
+	*userAddress = user;
+	return STATUS_SUCCESS;
+}
+
+void SharedChannel::Unmap() {
+	if (_header == nullptr)
+		return;
+
+	auto header = _header;
+	_header = nullptr;
+	InterlockedDecrement(&_mappedCount);
+
+	// the user mapping must be removed in the process it belongs to
+	KAPC_STATE apcState;
+	bool attach = PsGetCurrentProcess() != _process;
+	if (attach)
+		KeStackAttachProcess(_process, &apcState);
+	MmUnmapLockedPages(_userAddress, _mdl);
+	if (attach)
+		KeUnstackDetachProcess(&apcState);
+
+	MmUnmapLockedPages(header, _mdl);
+	MmFreePagesFromMdl(_mdl);
+	ExFreePool(_mdl);
+
+	if (_event)
+		ObDereferenceObject(_event);
+	ObDereferenceObject(_process);
+	_mdl = nullptr;
+	_event = nullptr;
+	_process = nullptr;
+}
+
+ULONG SharedChannel::GetUsedBytes() const {
+	auto used = _producer - (ULONG)ReadAcquire((volatile LONG*)&_header->ConsumerOffset);
+	// a consumer offset from the future means the client wrote garbage; treat as full
+	return used > _dataSize ? _dataSize : used;
+}
+
+ULONG SharedChannel::GetFreeBytes() const {
+	return _dataSize - GetUsedBytes();
+}
+
+bool SharedChannel::Write(const ItemHeader* item) {
+	ULONG size = ALIGN_UP_BY(item->Size, SharedRecordAlignment);
+	auto free = GetFreeBytes();
+	auto pos = _producer & (_dataSize - 1);
+	auto toEnd = _dataSize - pos;
+
+	if (size > toEnd) {
+		// not enough room before the end, pad and start over at the beginning
+		if (toEnd + size > free)
+			return false;
+
+		auto pad = (ItemHeader*)(_data + pos);
+		pad->Type = ItemType::None;
+		pad->Size = (USHORT)toEnd;
+		pad->Version = ItemHeaderVersion;
+		_producer += toEnd;
+		pos = 0;
+	}
+	else if (size > free) {
+		return false;
+	}
+
+	::memcpy(_data + pos, item, item->Size);
+	_producer += size;
+	return true;
+}
+
+bool SharedChannel::Fill(Consumer* consumer) {
+	ULONG cpu;
+	bool full = false;
+
+	EventsLostInfo marker;
+	if (g_Globals.Queue.GetLostMarker(consumer, marker)) {
+		if (Write(&marker))
+			g_Globals.Queue.MarkerDelivered(consumer, marker);
+		else
+			full = true;
+	}
+
+	while (!full) {
+		auto item = g_Globals.Queue.PeekOldest(consumer, cpu);
+		if (item == nullptr)
+			break;
+		if (!Write(item)) {
+			full = true;
+			break;
+		}
+		g_Globals.Queue.Pop(consumer, cpu);
+	}
+
+	// full barrier - pairs with the client setting WaitingForData before re-checking the producer offset
+	InterlockedExchange((volatile LONG*)&_header->ProducerOffset, _producer);
+	if (_event && _header->WaitingForData)
+		KeSetEvent(_event, IO_NO_INCREMENT, FALSE);
+
+	return !full;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "SysMonCommon.h"
+
+const ULONG MinChannelSize = 1 << 16;
+const ULONG MaxChannelSize = 1 << 26;
+
+struct Consumer;
+
+//
+// driver owned ring of event records, mapped into a client's address space.
+// Each consumer can map one. It is unmapped on cleanup of its handle, or when the
+// mapping process exits first (its handle may have been duplicated or inherited).
+// All members except IsMapped and AnyMapped must be called with g_Globals.Mutex held.
+//
+class SharedChannel {
+public:
+	NTSTATUS Map(ULONG size, HANDLE hEvent, PVOID* userAddress);
+	void Unmap();
+
+	bool IsMapped() const {
+		return _header != nullptr;
+	}
+
+	// the view must be gone before this process's address space is torn down
+	bool IsMappedInto(PEPROCESS process) const {
+		return _header != nullptr && _process == process;
+	}
+
+	// true if any consumer has a channel mapped
+	static bool AnyMapped() {
+		return ReadNoFence(&_mappedCount) != 0;
+	}
+
+	ULONG GetFreeBytes() const;
+
+	// moves the consumer's unread events into the ring, returns false if it filled up
+	bool Fill(Consumer* consumer);
+
+private:
+	bool Write(const ItemHeader* item);
+	ULONG GetUsedBytes() const;
+
+private:
+	SharedChannelHeader* volatile _header;
+	UCHAR* _data;
+	ULONG _dataSize;
+	ULONG _producer;		// our copy, the client can scribble over the shared one
+	PMDL _mdl;
+	PVOID _userAddress;
+	PEPROCESS _process;
+	PKEVENT _event;
+
+	static volatile LONG _mappedCount;
+};
@@ -0,0 +1,89 @@
+#include "pch.h"
+#include "Stats.h"
+#include "SysMon.h"
+
+NTSTATUS Stats::Init() {
+	_cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	auto size = sizeof(CpuStats) * _cpuCount;
+	_cpus = (CpuStats*)ExAllocatePoolWithTag(NonPagedPoolNx, size, DRIVER_TAG);
+	if (_cpus == nullptr)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	::memset(_cpus, 0, size);
+	return STATUS_SUCCESS;
+}
+
+void Stats::Term() {
+	if (_cpus) {
+		ExFreePool(_cpus);
+		_cpus = nullptr;
+	}
+}
+
+static ULONG LatencyBucket(ULONG64 cycles) {
+	ULONG index;
+	if (!_BitScanReverse64(&index, cycles >> LatencyBucketShift))
+		return 0;
+	return min(index + 1, LatencyBuckets - 1);
+}
+
+void Stats::RecordCall(CallbackKind kind, ULONG64 cycles, bool allocFailed) {
+	// stay on this CPU while updating its counters
+	auto irql = KeRaiseIrqlToDpcLevel();
+	auto& stats = _cpus[KeGetCurrentProcessorNumberEx(nullptr)].Callbacks[(ULONG)kind];
+	stats.Calls++;
+	stats.Cycles += cycles;
+	if (allocFailed)
+		stats.AllocFailures++;
+	stats.Histogram[LatencyBucket(cycles)]++;
+	KeLowerIrql(irql);
+}
+
+void Stats::RecordMutex(ULONG64 waitCycles, bool contended) {
+	auto irql = KeRaiseIrqlToDpcLevel();
+	auto& cpu = _cpus[KeGetCurrentProcessorNumberEx(nullptr)];
+	cpu.MutexAcquires++;
+	if (contended) {
+		cpu.MutexContentions++;
+		cpu.MutexWaitCycles += waitCycles;
+	}
+	KeLowerIrql(irql);
+}
+
+void Stats::Get(SysMonStats& stats) const {
+	::memset(&stats, 0, sizeof(stats));
+	stats.CollectTime = KeQueryInterruptTime();
+	stats.CollectCycles = __rdtsc();
+
+	// other CPUs keep counting while we sum, the totals are a snapshot
+	for (ULONG i = 0; i < _cpuCount; i++) {
+		auto& cpu = _cpus[i];
+		for (ULONG kind = 0; kind < (ULONG)CallbackKind::Count; kind++) {
+			auto& from = cpu.Callbacks[kind];
+			auto& to = stats.Callbacks[kind];
+			to.Calls += from.Calls;
+			to.Cycles += from.Cycles;
+			to.AllocFailures += from.AllocFailures;
+			for (ULONG b = 0; b < LatencyBuckets; b++)
+				to.Histogram[b] += from.Histogram[b];
+		}
+		stats.MutexAcquires += cpu.MutexAcquires;
+		stats.MutexContentions += cpu.MutexContentions;
+		stats.MutexWaitCycles += cpu.MutexWaitCycles;
+	}
+}
+
+CallbackTimer::~CallbackTimer() {
+	g_Globals.Stats.RecordCall(_kind, __rdtsc() - _start, _allocFailed);
+}
+
+void TimedMutex::Lock() {
+	if (_mutex.TryLock()) {
+		g_Globals.Stats.RecordMutex(0, false);
+		return;
+	}
+
+	auto start = __rdtsc();
+	_mutex.Lock();
+	g_Globals.Stats.RecordMutex(__rdtsc() - start, true);
+}
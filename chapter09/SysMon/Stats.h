@@ -0,0 +1,63 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include "FastMutex.h"
+
+struct DECLSPEC_CACHEALIGN CpuStats {
+	CallbackStats Callbacks[(ULONG)CallbackKind::Count];
+	ULONG64 MutexAcquires;
+	ULONG64 MutexContentions;
+	ULONG64 MutexWaitCycles;
+};
+
+//
+// per-CPU counters for callback cost and reader lock contention.
+// Updates are done at DISPATCH_LEVEL on the current CPU's slot, so they need no interlocks.
+//
+class Stats {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	void RecordCall(CallbackKind kind, ULONG64 cycles, bool allocFailed);
+	void RecordMutex(ULONG64 waitCycles, bool contended);
+
+	void Get(SysMonStats& stats) const;
+
+private:
+	CpuStats* _cpus;
+	ULONG _cpuCount;
+};
+
+// times a callback from construction to destruction
+class CallbackTimer {
+public:
+	CallbackTimer(CallbackKind kind) : _kind(kind), _allocFailed(false), _start(__rdtsc()) {}
+	~CallbackTimer();
+
+	void AllocFailed() {
+		_allocFailed = true;
+	}
+
+private:
+	CallbackKind _kind;
+	bool _allocFailed;
+	ULONG64 _start;
+};
+
+// fast mutex that records how long acquirers wait for it
+class TimedMutex {
+public:
+	void Init() {
+		_mutex.Init();
+	}
+
+	void Lock();
+
+	void Unlock() {
+		_mutex.Unlock();
+	}
+
+private:
+	FastMutex _mutex;
+};
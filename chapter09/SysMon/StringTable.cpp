@@ -0,0 +1,118 @@
+#include "pch.h"
+#include "StringTable.h"
+#include "SysMon.h"
+#include "AutoLock.h"
+
+NTSTATUS StringTable::Init() {
+	_byId = (InternedString**)ExAllocatePoolWithTag(PagedPool, MaxInternedStrings * sizeof(InternedString*), DRIVER_TAG);
+	if (_byId == nullptr)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	::memset(_buckets, 0, sizeof(_buckets));
+	_count = 0;
+	_bytes = 0;
+	_lock.Init();
+	return STATUS_SUCCESS;
+}
+
+void StringTable::Term() {
+	if (_byId == nullptr)
+		return;
+
+	for (ULONG i = 0; i < _count; i++)
+		ExFreePool(_byId[i]);
+	ExFreePool(_byId);
+	_byId = nullptr;
+}
+
+ULONG StringTable::Hash(PCWSTR buffer, USHORT length) {
+	// FNV-1a
+	ULONG hash = 2166136261;
+	for (ULONG i = 0; i < length / sizeof(WCHAR); i++) {
+		hash ^= buffer[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+InternedString* StringTable::Find(ULONG hash, PCWSTR buffer, USHORT length) const {
+	for (auto entry = _buckets[hash & (StringTableBuckets - 1)]; entry; entry = entry->Next) {
+		if (entry->Hash == hash && entry->Length == length && ::memcmp(entry->Buffer, buffer, length) == 0)
+			return entry;
+	}
+	return nullptr;
+}
+
+ULONG StringTable::Intern(PCWSTR buffer, USHORT length) {
+	auto hash = Hash(buffer, length);
+	{
+		AutoSharedLock locker(_lock);
+		auto entry = Find(hash, buffer, length);
+		if (entry)
+			return entry->Id;
+		if (_count == MaxInternedStrings)
+			return 0;
+	}
+
+	AutoLock locker(_lock);
+	// another thread may have added it while the lock was released
+	auto entry = Find(hash, buffer, length);
+	if (entry)
+		return entry->Id;
+
+	if (_count == MaxInternedStrings || _bytes + length > MaxInternedBytes)
+		return 0;
+
+	entry = (InternedString*)ExAllocatePoolWithTag(PagedPool, sizeof(InternedString) + length, DRIVER_TAG);
+	if (entry == nullptr)
+		return 0;
+
+	entry->Hash = hash;
+	entry->Length = length;
+	::memcpy(entry->Buffer, buffer, length);
+
+	// the definition must be queued before any record that uses the ID
+	entry->Id = _count + 1;
+	if (!Define(entry)) {
+		ExFreePool(entry);
+		return 0;
+	}
+
+	auto& bucket = _buckets[hash & (StringTableBuckets - 1)];
+	entry->Next = bucket;
+	bucket = entry;
+	_byId[_count++] = entry;
+	_bytes += length;
+	return entry->Id;
+}
+
+bool StringTable::Define(const InternedString* entry) {
+	auto info = g_Globals.Allocator.Allocate<StringDefinitionInfo>(entry->Length);
+	if (info == nullptr)
+		return false;
+
+	auto& item = info->Data;
+	item.Type = ItemType::StringDefinition;
+	item.Size = sizeof(item);
+	item.Id = entry->Id;
+	item.Length = entry->Length / sizeof(WCHAR);
+	item.Offset = AppendData(&item, entry->Buffer, entry->Length);
+
+	// if the queue drops it, clients fetch the string with IOCTL_SYSMON_GET_STRING
+	PushItem(&item);
+	return true;
+}
+
+NTSTATUS StringTable::Lookup(ULONG id, PWSTR buffer, ULONG size, ULONG& length) {
+	AutoSharedLock locker(_lock);
+	if (id == 0 || id > _count)
+		return STATUS_NOT_FOUND;
+
+	auto entry = _byId[id - 1];
+	if (size < entry->Length)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	::memcpy(buffer, entry->Buffer, entry->Length);
+	length = entry->Length;
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "PushLock.h"
+
+struct InternedString {
+	InternedString* Next;	// hash chain
+	ULONG Hash;
+	ULONG Id;
+	USHORT Length;			// in bytes
+	WCHAR Buffer[1];
+};
+
+const ULONG StringTableBuckets = 1024;		// must be a power of 2
+const ULONG MaxInternedStrings = 16384;
+const ULONG MaxInternedBytes = 1 << 22;
+
+//
+// intern table for image paths and registry key names.
+// IDs are stable for the lifetime of the driver; once the table is full
+// new strings are simply sent inline.
+//
+
+class StringTable {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	// returns the string's ID, sending a StringDefinition record the first time
+	// the string is seen. Zero means the caller should send the string inline
+	ULONG Intern(PCWSTR buffer, USHORT length);
+
+	NTSTATUS Lookup(ULONG id, PWSTR buffer, ULONG size, ULONG& length);
+
+private:
+	static ULONG Hash(PCWSTR buffer, USHORT length);
+	InternedString* Find(ULONG hash, PCWSTR buffer, USHORT length) const;
+	static bool Define(const InternedString* entry);
+
+private:
+	InternedString* _buckets[StringTableBuckets];
+	InternedString** _byId;		// index is ID - 1
+	ULONG _count;
+	ULONG _bytes;
+	PushLock _lock;
+};
@@ -5,21 +5,110 @@
 #include "AutoLock.h"
 
 DRIVER_UNLOAD SysMonUnload;
-DRIVER_DISPATCH SysMonCreateClose, SysMonRead;
+DRIVER_DISPATCH SysMonCreate, SysMonClose, SysMonRead, SysMonCleanup, SysMonDeviceControl;
 void OnProcessNotify(_Inout_ PEPROCESS Process, _In_ HANDLE ProcessId, _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo);
 void OnThreadNotify(_In_ HANDLE ProcessId, _In_ HANDLE ThreadId, _In_ BOOLEAN Create);
 void OnImageLoadNotify(_In_opt_ PUNICODE_STRING FullImageName, _In_ HANDLE ProcessId, _In_ PIMAGE_INFO ImageInfo);
-void PushItem(LIST_ENTRY* entry);
 NTSTATUS OnRegistryNotify(PVOID context, PVOID arg1, PVOID arg2);
+void SeedProcessTable();
+
+// not in the WDK headers
+const ULONG SystemProcessInformation = 5;
+
+struct SYSTEM_PROCESS_INFORMATION {
+	ULONG NextEntryOffset;
+	ULONG NumberOfThreads;
+	LARGE_INTEGER WorkingSetPrivateSize;
+	ULONG HardFaultCount;
+	ULONG NumberOfThreadsHighWatermark;
+	ULONGLONG CycleTime;
+	LARGE_INTEGER CreateTime;
+	LARGE_INTEGER UserTime;
+	LARGE_INTEGER KernelTime;
+	UNICODE_STRING ImageName;
+	LONG BasePriority;
+	HANDLE UniqueProcessId;
+	HANDLE InheritedFromUniqueProcessId;
+};
+
+extern "C" NTSYSAPI NTSTATUS NTAPI ZwQuerySystemInformation(ULONG SystemInformationClass, PVOID SystemInformation, ULONG SystemInformationLength, PULONG ReturnLength);
+extern "C" NTKERNELAPI NTSTATUS PsGetProcessExitStatus(PEPROCESS Process);
 
 Globals g_Globals;
 
 extern "C" NTSTATUS
 DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
-	auto status = STATUS_SUCCESS;
-
-	InitializeListHead(&g_Globals.ItemsHead);
+	auto status = g_Globals.Stats.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate statistics (0x%08X)\n", status));
+		return status;
+	}
+	status = g_Globals.Queue.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate event queue (0x%08X)\n", status));
+		g_Globals.Stats.Term();
+		return status;
+	}
+	status = g_Globals.Allocator.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to create lookaside lists (0x%08X)\n", status));
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
+		return status;
+	}
 	g_Globals.Mutex.Init();
+	g_Globals.Filter.Init();
+	g_Globals.RegistryFilter.Init();
+	status = g_Globals.Aggregator.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate thread aggregation table (0x%08X)\n", status));
+		g_Globals.Allocator.Term();
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
+		return status;
+	}
+	status = g_Globals.Strings.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate string table (0x%08X)\n", status));
+		g_Globals.Aggregator.Term();
+		g_Globals.Allocator.Term();
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
+		return status;
+	}
+	status = g_Globals.Processes.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate process table (0x%08X)\n", status));
+		g_Globals.Strings.Term();
+		g_Globals.Aggregator.Term();
+		g_Globals.Allocator.Term();
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
+		return status;
+	}
+	status = g_Globals.KeyNames.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to allocate key name cache (0x%08X)\n", status));
+		g_Globals.Processes.Term();
+		g_Globals.Strings.Term();
+		g_Globals.Aggregator.Term();
+		g_Globals.Allocator.Term();
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
+		return status;
+	}
+	status = g_Globals.Reads.Init();
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to start delivery thread (0x%08X)\n", status));
+		g_Globals.KeyNames.Term();
+		g_Globals.Processes.Term();
+		g_Globals.Strings.Term();
+		g_Globals.Aggregator.Term();
+		g_Globals.Allocator.Term();
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
+		return status;
+	}
 
 	PDEVICE_OBJECT DeviceObject = nullptr;
 	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\sysmon");
@@ -28,7 +117,8 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 
 	do {
 		UNICODE_STRING devName = RTL_CONSTANT_STRING(L"\\Device\\sysmon");
-		status = IoCreateDevice(DriverObject, 0, &devName, FILE_DEVICE_UNKNOWN, 0, TRUE, &DeviceObject);
+		// not exclusive - every handle is a consumer of its own
+		status = IoCreateDevice(DriverObject, 0, &devName, FILE_DEVICE_UNKNOWN, 0, FALSE, &DeviceObject);
 		if (!NT_SUCCESS(status)) {
 			KdPrint((DRIVER_PREFIX "failed to create device (0x%08X)\n", status));
 			break;
@@ -49,6 +139,9 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 		}
 		processCallbacks = true;
 
+		// processes created from here on are added by the callback
+		SeedProcessTable();
+
 		status = PsSetCreateThreadNotifyRoutine(OnThreadNotify);
 		if (!NT_SUCCESS(status)) {
 			KdPrint((DRIVER_PREFIX "failed to set thread callback (status=%08X)\n", status));
@@ -82,16 +175,68 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING) {
 			IoDeleteSymbolicLink(&symLink);
 		if (DeviceObject)
 			IoDeleteDevice(DeviceObject);
+		g_Globals.Reads.Term();
+		g_Globals.KeyNames.Term();
+		g_Globals.Processes.Term();
+		g_Globals.Strings.Term();
+		g_Globals.Aggregator.Term();
+		g_Globals.Allocator.Term();
+		g_Globals.Queue.Term();
+		g_Globals.Stats.Term();
 	}
 
 	DriverObject->DriverUnload = SysMonUnload;
-	DriverObject->MajorFunction[IRP_MJ_CREATE] = DriverObject->MajorFunction[IRP_MJ_CLOSE] = SysMonCreateClose;
+	DriverObject->MajorFunction[IRP_MJ_CREATE] = SysMonCreate;
+	DriverObject->MajorFunction[IRP_MJ_CLOSE] = SysMonClose;
 	DriverObject->MajorFunction[IRP_MJ_READ] = SysMonRead;
+	DriverObject->MajorFunction[IRP_MJ_CLEANUP] = SysMonCleanup;
+	DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = SysMonDeviceControl;
 
 	return status;
 }
 
-NTSTATUS SysMonCreateClose(PDEVICE_OBJECT, PIRP Irp) {
+NTSTATUS SysMonCreate(PDEVICE_OBJECT, PIRP Irp) {
+	auto fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+	auto status = STATUS_SUCCESS;
+	{
+		AutoLock locker(g_Globals.Mutex);
+		auto consumer = g_Globals.Queue.AddConsumer(fileObject);
+		if (consumer)
+			fileObject->FsContext = consumer;
+		else
+			status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Irp->IoStatus.Status = status;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, 0);
+	return status;
+}
+
+NTSTATUS SysMonClose(PDEVICE_OBJECT, PIRP Irp) {
+	// cleanup has already taken the consumer off the list
+	auto fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+	if (fileObject->FsContext)
+		ExFreePool(fileObject->FsContext);
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, 0);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS SysMonCleanup(PDEVICE_OBJECT, PIRP Irp) {
+	// the handle is going away, fail its reads that are still pending
+	auto fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+	g_Globals.Reads.Cleanup(fileObject);
+	{
+		// stop holding back memory for this consumer
+		AutoLock locker(g_Globals.Mutex);
+		auto consumer = (Consumer*)fileObject->FsContext;
+		consumer->Channel.Unmap();
+		g_Globals.Queue.RemoveConsumer(consumer);
+	}
+
 	Irp->IoStatus.Status = STATUS_SUCCESS;
 	Irp->IoStatus.Information = 0;
 	IoCompleteRequest(Irp, 0);
@@ -99,41 +244,192 @@ NTSTATUS SysMonCreateClose(PDEVICE_OBJECT, PIRP Irp) {
 }
 
 NTSTATUS SysMonRead(PDEVICE_OBJECT, PIRP Irp) {
+	return g_Globals.Reads.Read(Irp);
+}
+
+NTSTATUS CompleteRead(Consumer* consumer, PIRP Irp) {
 	auto stack = IoGetCurrentIrpStackLocation(Irp);
 	auto len = stack->Parameters.Read.Length;
 	auto status = STATUS_SUCCESS;
-	auto count = 0;
-	NT_ASSERT(Irp->MdlAddress);		// we're using Direct I/O
-
+	ULONG count = 0;
 	auto buffer = (UCHAR*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 	if (!buffer) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
 	}
 	else {
-		AutoLock locker(g_Globals.Mutex);
-		while (true) {
-			if (IsListEmpty(&g_Globals.ItemsHead))	// can also check g_Globals.ItemCount
+		count = g_Globals.Queue.Read(consumer, buffer, len);
+	}
+
+	Irp->IoStatus.Status = status;
+	Irp->IoStatus.Information = count;
+	IoCompleteRequest(Irp, 0);
+	return status;
+}
+
+NTSTATUS SysMonDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
+	auto stack = IoGetCurrentIrpStackLocation(Irp);
+	auto& dic = stack->Parameters.DeviceIoControl;
+	auto consumer = (Consumer*)stack->FileObject->FsContext;
+	auto status = STATUS_SUCCESS;
+	ULONG_PTR len = 0;
+
+	switch (dic.IoControlCode) {
+		case IOCTL_SYSMON_SET_READ_BATCHING:
+		{
+			if (dic.InputBufferLength < sizeof(ReadBatching)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			auto batching = (ReadBatching*)Irp->AssociatedIrp.SystemBuffer;
+			g_Globals.Reads.SetBatching(batching->MinBytes, batching->MaxDelayMs);
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_FILTER:
+		{
+			if (dic.InputBufferLength == 0) {
+				g_Globals.Filter.Clear();
+				break;
+			}
+			if (dic.InputBufferLength < sizeof(FilterRules)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			status = g_Globals.Filter.Set((FilterRules*)Irp->AssociatedIrp.SystemBuffer);
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_REGISTRY_RULES:
+		{
+			if (dic.InputBufferLength < sizeof(RegistryRules)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			status = g_Globals.RegistryFilter.Set((RegistryRules*)Irp->AssociatedIrp.SystemBuffer);
+			break;
+		}
+
+		case IOCTL_SYSMON_SET_BUFFER_POLICY:
+		{
+			if (dic.InputBufferLength < sizeof(BufferPolicy)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			auto policy = (BufferPolicy*)Irp->AssociatedIrp.SystemBuffer;
+			if ((ULONG)policy->Policy > (ULONG)OverflowPolicy::Sample) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+			g_Globals.Queue.SetPolicy(policy->CapacityBytes, policy->Policy, policy->SampleRate);
+			// trim right away if the buffer shrank under drop-oldest
+			g_Globals.Reads.Wake();
+			break;
+		}
+
+		case IOCTL_SYSMON_GET_DROP_COUNTS:
+		{
+			if (dic.OutputBufferLength < sizeof(DropCounts)) {
+				status = STATUS_BUFFER_TOO_SMALL;
 				break;
+			}
+			AutoLock locker(g_Globals.Mutex);
+			g_Globals.Queue.GetDropCounts(*(DropCounts*)Irp->AssociatedIrp.SystemBuffer);
+			len = sizeof(DropCounts);
+			break;
+		}
 
-			auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-			auto info = CONTAINING_RECORD(entry, FullItem<ItemHeader>, Entry);
-			auto size = info->Data.Size;
-			if (len < size) {
-				// user's buffer full, insert item back
-				InsertHeadList(&g_Globals.ItemsHead, entry);
+		case IOCTL_SYSMON_SET_THREAD_AGGREGATION:
+		{
+			if (dic.InputBufferLength < sizeof(ThreadAggregation)) {
+				status = STATUS_BUFFER_TOO_SMALL;
 				break;
 			}
-			g_Globals.ItemCount--;
-			::memcpy(buffer, &info->Data, size);
-			len -= size;
-			buffer += size;
-			count += size;
-			ExFreePool(info);
+			status = g_Globals.Aggregator.Configure((ThreadAggregation*)Irp->AssociatedIrp.SystemBuffer);
+			break;
 		}
+
+		case IOCTL_SYSMON_GET_STRING:
+		{
+			if (dic.InputBufferLength < sizeof(ULONG)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			auto buffer = Irp->AssociatedIrp.SystemBuffer;
+			ULONG length;
+			status = g_Globals.Strings.Lookup(*(ULONG*)buffer, (PWSTR)buffer, dic.OutputBufferLength, length);
+			if (NT_SUCCESS(status))
+				len = length;
+			break;
+		}
+
+		case IOCTL_SYSMON_MAP_CHANNEL:
+		{
+			if (dic.InputBufferLength < sizeof(MapChannelRequest) || dic.OutputBufferLength < sizeof(PVOID)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			auto request = (MapChannelRequest*)Irp->AssociatedIrp.SystemBuffer;
+			PVOID address;
+			{
+				AutoLock locker(g_Globals.Mutex);
+				status = consumer->Channel.Map(request->Size, request->Event, &address);
+			}
+			if (NT_SUCCESS(status)) {
+				*(PVOID*)Irp->AssociatedIrp.SystemBuffer = address;
+				len = sizeof(PVOID);
+				// move whatever is already queued
+				g_Globals.Reads.Wake();
+			}
+			break;
+		}
+
+		case IOCTL_SYSMON_UNMAP_CHANNEL:
+		{
+			AutoLock locker(g_Globals.Mutex);
+			consumer->Channel.Unmap();
+			break;
+		}
+
+		case IOCTL_SYSMON_GET_STATS:
+		{
+			if (dic.OutputBufferLength < sizeof(SysMonStats)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			g_Globals.Stats.Get(*(SysMonStats*)Irp->AssociatedIrp.SystemBuffer);
+			len = sizeof(SysMonStats);
+			break;
+		}
+
+		case IOCTL_SYSMON_GET_PROCESSES:
+		{
+			if (dic.OutputBufferLength < sizeof(ProcessSnapshot)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			len = g_Globals.Processes.GetSnapshot(Irp->AssociatedIrp.SystemBuffer, dic.OutputBufferLength);
+			break;
+		}
+
+		case IOCTL_SYSMON_GET_POOL_STATS:
+		{
+			auto count = dic.OutputBufferLength / (ULONG)sizeof(PoolClassStats);
+			if (count == 0) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			auto stats = (PoolClassStats*)Irp->AssociatedIrp.SystemBuffer;
+			len = g_Globals.Allocator.GetStats(stats, count) * sizeof(PoolClassStats);
+			break;
+		}
+
+		default:
+			status = STATUS_INVALID_DEVICE_REQUEST;
+			break;
 	}
 
 	Irp->IoStatus.Status = status;
-	Irp->IoStatus.Information = count;
+	Irp->IoStatus.Information = len;
 	IoCompleteRequest(Irp, 0);
 	return status;
 }
@@ -148,175 +444,281 @@ void SysMonUnload(PDRIVER_OBJECT DriverObject) {
 	IoDeleteSymbolicLink(&symLink);
 	IoDeleteDevice(DriverObject->DeviceObject);
 
-	while (!IsListEmpty(&g_Globals.ItemsHead)) {
-		auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-		ExFreePool(CONTAINING_RECORD(entry, FullItem<ItemHeader>, Entry));
-	}
+	// no more summaries after this
+	g_Globals.Aggregator.Term();
+	g_Globals.Reads.Term();
+
+	// all handles are closed by now, so there are no consumers left
+	g_Globals.Queue.Drain();
+#if DBG
+	DropCounts drops;
+	g_Globals.Queue.GetDropCounts(drops);
+	KdPrint((DRIVER_PREFIX "%u events dropped\n", drops.Total));
+#endif
+	g_Globals.KeyNames.Term();
+	g_Globals.Processes.Term();
+	g_Globals.Strings.Term();
+	g_Globals.Queue.Term();
+	g_Globals.Allocator.Term();
+	g_Globals.Stats.Term();
 }
 
-void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
-	UNREFERENCED_PARAMETER(Process);
+// registry names longer than the limit are truncated
+USHORT CaptureSize(PCUNICODE_STRING name) {
+	return (USHORT)min(name->Length, MaxRegistryNameLength * sizeof(WCHAR));
+}
 
-	if (CreateInfo) {
-		// process created
-		USHORT allocSize = sizeof(FullItem<ProcessCreateInfo>);
-		USHORT commandLineSize = 0;
-		if (CreateInfo->CommandLine) {
-			commandLineSize = CreateInfo->CommandLine->Length;
-			allocSize += commandLineSize;
-		}
-		auto info = (FullItem<ProcessCreateInfo>*)ExAllocatePoolWithTag(PagedPool, allocSize, DRIVER_TAG);
-		if (info == nullptr) {
-			KdPrint((DRIVER_PREFIX "failed allocation\n"));
-			return;
-		}
+// returns false if events of the key are not captured. Otherwise, if the key name is not interned,
+// name is set to it; name is set whenever it had to be looked up and must then be released by the caller
+bool ResolveKey(PVOID object, KeyNameEntry& key, PCUNICODE_STRING& name) {
+	name = nullptr;
 
-		auto& item = info->Data;
-		KeQuerySystemTimePrecise(&item.Time);
-		item.Type = ItemType::ProcessCreate;
-		item.Size = sizeof(ProcessCreateInfo) + commandLineSize;
-		item.ProcessId = HandleToULong(ProcessId);
-		item.ParentProcessId = HandleToULong(CreateInfo->ParentProcessId);
-
-		if (commandLineSize > 0) {
-			::memcpy((UCHAR*)&item + sizeof(item), CreateInfo->CommandLine->Buffer, commandLineSize);
-			item.CommandLineLength = commandLineSize / sizeof(WCHAR);	// length in WCHARs
-			item.CommandLineOffset = sizeof(item);
-		}
-		else {
-			item.CommandLineLength = 0;
-		}
-		PushItem(&info->Entry);
-	}
-	else {
-		// process exited
-		auto info = (FullItem<ProcessExitInfo>*)ExAllocatePoolWithTag(PagedPool, sizeof(FullItem<ProcessExitInfo>), DRIVER_TAG);
-		if (info == nullptr) {
-			KdPrint((DRIVER_PREFIX "failed allocation\n"));
-			return;
-		}
+	// hot keys are written over and over, resolve their name once
+	auto generation = g_Globals.RegistryFilter.Generation();
+	if (!g_Globals.KeyNames.Lookup(object, generation, key)) {
+		if (!NT_SUCCESS(CmCallbackGetKeyObjectIDEx(&g_Globals.RegCookie, object, nullptr, &name, 0)))
+			return false;
 
-		auto& item = info->Data;
-		KeQuerySystemTimePrecise(&item.Time);
-		item.Type = ItemType::ProcessExit;
-		item.ProcessId = HandleToULong(ProcessId);
-		item.Size = sizeof(ProcessExitInfo);
+		key.Matches = g_Globals.RegistryFilter.MatchesKey(name);
+		key.NameId = key.Matches ? g_Globals.Strings.Intern(name->Buffer, CaptureSize(name)) : 0;
+		g_Globals.KeyNames.Insert(object, generation, key.NameId, key.Matches);
+	}
 
-		PushItem(&info->Entry);
+	if (!key.Matches) {
+		if (name)
+			CmCallbackReleaseKeyObjectIDEx(name);
+		name = nullptr;
+		return false;
 	}
-}
 
-void OnThreadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create) {
-	auto size = sizeof(FullItem<ThreadCreateExitInfo>);
-	auto info = (FullItem<ThreadCreateExitInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
-	if (info == nullptr) {
-		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
-		return;
+	if (key.NameId == 0 && name == nullptr) {
+		// the string table is full, the name goes inline
+		if (!NT_SUCCESS(CmCallbackGetKeyObjectIDEx(&g_Globals.RegCookie, object, nullptr, &name, 0)))
+			return false;
 	}
-	auto& item = info->Data;
-	KeQuerySystemTimePrecise(&item.Time);
-	item.Size = sizeof(item);
-	item.Type = Create ? ItemType::ThreadCreate : ItemType::ThreadExit;
-	item.ProcessId = HandleToULong(ProcessId);
-	item.ThreadId = HandleToULong(ThreadId);
-
-	PushItem(&info->Entry);
+	return true;
 }
 
-void OnImageLoadNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo) {
-	if (ProcessId == nullptr) {
-		// system image, ignore
-		return;
+// returns false if the record could not be allocated
+bool OnRegistrySetValue(REG_POST_OPERATION_INFORMATION* args) {
+	auto preInfo = (REG_SET_VALUE_KEY_INFORMATION*)args->PreInformation;
+	NT_ASSERT(preInfo);
+
+	// checked before the (expensive) key name lookup
+	if (!g_Globals.Filter.Matches(ItemType::RegistrySetValue, HandleToULong(PsGetCurrentProcessId())))
+		return true;
+	if (!g_Globals.RegistryFilter.MatchesValue(preInfo->ValueName))
+		return true;
+
+	KeyNameEntry key;
+	PCUNICODE_STRING name;
+	if (!ResolveKey(args->Object, key, name))
+		return true;
+
+	USHORT keyNameSize = key.NameId ? 0 : CaptureSize(name);
+	auto valueName = preInfo->ValueName;
+	auto valueNameSize = CaptureSize(valueName);
+	auto dataSize = (USHORT)min(preInfo->DataSize, MaxRegistryDataCapture);
+
+	auto info = g_Globals.Allocator.Allocate<RegistrySetValueInfo>(keyNameSize + valueNameSize + dataSize);
+	if (info) {
+		auto& item = info->Data;
+		item.Size = sizeof(item);
+		item.Type = ItemType::RegistrySetValue;
+		item.DataType = preInfo->Type;
+		item.DataSize = preInfo->DataSize;
+		item.ProcessId = HandleToULong(PsGetCurrentProcessId());
+		item.ThreadId = HandleToULong(PsGetCurrentThreadId());
+		item.KeyNameId = key.NameId;
+		item.KeyNameLength = keyNameSize / sizeof(WCHAR);
+		item.KeyNameOffset = AppendData(&item, name ? name->Buffer : nullptr, keyNameSize);
+		item.ValueNameLength = valueNameSize / sizeof(WCHAR);
+		item.ValueNameOffset = AppendData(&item, valueName->Buffer, valueNameSize);
+		item.DataLength = dataSize;
+		item.DataOffset = AppendData(&item, preInfo->Data, dataSize);
+
+		PushItem(&info->Data);
 	}
 
-	auto size = sizeof(FullItem<ImageLoadInfo>);
-	auto info = (FullItem<ImageLoadInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
-	if (info == nullptr) {
-		KdPrint((DRIVER_PREFIX "Failed to allocate memory\n"));
-		return;
-	}
+	if (name)
+		CmCallbackReleaseKeyObjectIDEx(name);
+	return info != nullptr;
+}
 
-	::memset(info, 0, size);
+// builds a create key, delete key, delete value or rename key record, or returns null
+// if the event is not captured. allocated is cleared if the record could not be allocated
+ItemHeader* BuildKeyRecord(ItemType type, PVOID object, PCUNICODE_STRING otherName, bool& allocated) {
+	if (!g_Globals.Filter.Matches(type, HandleToULong(PsGetCurrentProcessId())))
+		return nullptr;
 
-	auto& item = info->Data;
-	KeQuerySystemTimePrecise(&item.Time);
-	item.Size = sizeof(item);
-	item.Type = ItemType::ImageLoad;
-	item.ProcessId = HandleToULong(ProcessId);
-	item.ImageSize = ImageInfo->ImageSize;
-	item.LoadAddress = ImageInfo->ImageBase;
+	KeyNameEntry key;
+	PCUNICODE_STRING name;
+	if (!ResolveKey(object, key, name))
+		return nullptr;
 
-	if (FullImageName) {
-		::memcpy(item.ImageFileName, FullImageName->Buffer, min(FullImageName->Length, MaxImageFileSize * sizeof(WCHAR)));
+	USHORT keyNameSize = key.NameId ? 0 : CaptureSize(name);
+	USHORT otherNameSize = otherName ? CaptureSize(otherName) : 0;
+
+	auto info = g_Globals.Allocator.Allocate<RegistryKeyInfo>(keyNameSize + otherNameSize);
+	if (info) {
+		auto& item = info->Data;
+		item.Size = sizeof(item);
+		item.Type = type;
+		item.ProcessId = HandleToULong(PsGetCurrentProcessId());
+		item.ThreadId = HandleToULong(PsGetCurrentThreadId());
+		item.KeyNameId = key.NameId;
+		item.KeyNameLength = keyNameSize / sizeof(WCHAR);
+		item.KeyNameOffset = AppendData(&item, name ? name->Buffer : nullptr, keyNameSize);
+		item.NameLength = otherNameSize / sizeof(WCHAR);
+		item.NameOffset = AppendData(&item, otherName ? otherName->Buffer : nullptr, otherNameSize);
 	}
 	else {
-		::wcscpy_s(item.ImageFileName, L"(unknown)");
+		allocated = false;
 	}
 
-	//if (ImageInfo->ExtendedInfoPresent) {
-	//	auto exinfo = CONTAINING_RECORD(ImageInfo, IMAGE_INFO_EX, ImageInfo);
-	//}
-
-	PushItem(&info->Entry);
+	if (name)
+		CmCallbackReleaseKeyObjectIDEx(name);
+	return info ? &info->Data : nullptr;
 }
 
-void PushItem(LIST_ENTRY * entry) {
-	AutoLock<FastMutex> locker(g_Globals.Mutex);
-	if (g_Globals.ItemCount > 1024) {
-		// too many items, remove oldest one
-		auto head = RemoveHeadList(&g_Globals.ItemsHead);
-		g_Globals.ItemCount--;
-		auto item = CONTAINING_RECORD(head, FullItem<ItemHeader>, Entry);
-		ExFreePool(item);
-	}
-	InsertTailList(&g_Globals.ItemsHead, entry);
-	g_Globals.ItemCount++;
+// a record built by the pre notification goes out only if the operation succeeded
+void CompleteKeyRecord(REG_POST_OPERATION_INFORMATION* args) {
+	auto item = (ItemHeader*)args->CallContext;
+	if (item == nullptr)
+		return;
+
+	if (NT_SUCCESS(args->Status))
+		PushItem(item);
+	else
+		FreeItem(item);
 }
 
 NTSTATUS OnRegistryNotify(PVOID context, PVOID arg1, PVOID arg2) {
 	UNREFERENCED_PARAMETER(context);
+	CallbackTimer timer(CallbackKind::Registry);
 
-	static const WCHAR machine[] = L"\\REGISTRY\\MACHINE\\";
+	auto& filter = g_Globals.RegistryFilter;
+	bool allocated = true;
 
 	switch ((REG_NOTIFY_CLASS)(ULONG_PTR)arg1) {
 		case RegNtPostSetValueKey:
+		{
 			auto args = static_cast<REG_POST_OPERATION_INFORMATION*>(arg2);
-			if (!NT_SUCCESS(args->Status))
-				break;
+			if (filter.IsEnabled(ItemType::RegistrySetValue) && NT_SUCCESS(args->Status))
+				allocated = OnRegistrySetValue(args);
+			break;
+		}
 
-			PCUNICODE_STRING name;
-			if (NT_SUCCESS(CmCallbackGetKeyObjectIDEx(&g_Globals.RegCookie, args->Object, nullptr, &name, 0))) {
-				// filter out none-HKLM writes
-				if (::wcsncmp(name->Buffer, machine, ARRAYSIZE(machine) - 1) == 0) {
-					auto preInfo = (REG_SET_VALUE_KEY_INFORMATION*)args->PreInformation;
-					NT_ASSERT(preInfo);
-
-					auto size = sizeof(FullItem<RegistrySetValueInfo>);
-					auto info = (FullItem<RegistrySetValueInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
-					if (info == nullptr)
-						break;
-
-					RtlZeroMemory(info, size);
-					auto& item = info->Data;
-					KeQuerySystemTimePrecise(&item.Time);
-					item.Size = sizeof(item);
-					item.Type = ItemType::RegistrySetValue;
-					::wcsncpy_s(item.KeyName, name->Buffer, name->Length / sizeof(WCHAR) - 1);
-					::wcsncpy_s(item.ValueName, preInfo->ValueName->Buffer, preInfo->ValueName->Length / sizeof(WCHAR) - 1);
-					item.DataType = preInfo->Type;
-					item.DataSize = preInfo->DataSize;
-					item.ProcessId = HandleToULong(PsGetCurrentProcessId());
-					item.ThreadId = HandleToULong(PsGetCurrentThreadId());
-					::memcpy(item.Data, preInfo->Data, min(item.DataSize, sizeof(item.Data)));
-
-					PushItem(&info->Entry);
-				}
-
-				CmCallbackReleaseKeyObjectIDEx(name);
+		case RegNtPostCreateKeyEx:
+		{
+			// also reported when an existing key is opened with RegCreateKeyEx
+			auto args = static_cast<REG_POST_OPERATION_INFORMATION*>(arg2);
+			if (filter.IsEnabled(ItemType::RegistryCreateKey) && NT_SUCCESS(args->Status)) {
+				auto item = BuildKeyRecord(ItemType::RegistryCreateKey, args->Object, nullptr, allocated);
+				if (item)
+					PushItem(item);
 			}
 			break;
+		}
+
+		// the key's name is resolved before the operation changes it,
+		// the record is sent from the post notification
+		case RegNtPreDeleteKey:
+		{
+			auto args = static_cast<REG_DELETE_KEY_INFORMATION*>(arg2);
+			if (filter.IsEnabled(ItemType::RegistryDeleteKey))
+				args->CallContext = BuildKeyRecord(ItemType::RegistryDeleteKey, args->Object, nullptr, allocated);
+			break;
+		}
+
+		case RegNtPreDeleteValueKey:
+		{
+			auto args = static_cast<REG_DELETE_VALUE_KEY_INFORMATION*>(arg2);
+			if (filter.IsEnabled(ItemType::RegistryDeleteValue) && filter.MatchesValue(args->ValueName))
+				args->CallContext = BuildKeyRecord(ItemType::RegistryDeleteValue, args->Object, args->ValueName, allocated);
+			break;
+		}
+
+		case RegNtPreRenameKey:
+		{
+			auto args = static_cast<REG_RENAME_KEY_INFORMATION*>(arg2);
+			if (filter.IsEnabled(ItemType::RegistryRenameKey))
+				args->CallContext = BuildKeyRecord(ItemType::RegistryRenameKey, args->Object, args->NewName, allocated);
+			break;
+		}
+
+		case RegNtPostDeleteKey:
+		case RegNtPostRenameKey:
+			// the key's cached name is stale now
+			g_Globals.KeyNames.Invalidate(static_cast<REG_POST_OPERATION_INFORMATION*>(arg2)->Object);
+			CompleteKeyRecord(static_cast<REG_POST_OPERATION_INFORMATION*>(arg2));
+			break;
 
+		case RegNtPostDeleteValueKey:
+			CompleteKeyRecord(static_cast<REG_POST_OPERATION_INFORMATION*>(arg2));
+			break;
+
+		// the cached name of a key must not outlive it
+		case RegNtPreKeyHandleClose:
+			g_Globals.KeyNames.Invalidate(static_cast<REG_KEY_HANDLE_CLOSE_INFORMATION*>(arg2)->Object);
+			break;
 	}
 
+	if (!allocated)
+		timer.AllocFailed();
 	return STATUS_SUCCESS;
 }
+
+void SeedProcessTable() {
+	ULONG size = 1 << 16;
+	PVOID buffer;
+	NTSTATUS status;
+	for (;;) {
+		buffer = ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+		if (buffer == nullptr) {
+			KdPrint((DRIVER_PREFIX "failed to allocate process list\n"));
+			return;
+		}
+		ULONG needed = 0;
+		status = ZwQuerySystemInformation(SystemProcessInformation, buffer, size, &needed);
+		if (status != STATUS_INFO_LENGTH_MISMATCH)
+			break;
+
+		// processes may be created before the next try
+		ExFreePool(buffer);
+		size = max(size * 2, needed + (1 << 14));
+	}
+	if (!NT_SUCCESS(status)) {
+		KdPrint((DRIVER_PREFIX "failed to get the process list (0x%08X)\n", status));
+		ExFreePool(buffer);
+		return;
+	}
+
+	ULONG count = 0;
+	for (auto info = (SYSTEM_PROCESS_INFORMATION*)buffer; ; info = (SYSTEM_PROCESS_INFORMATION*)((PUCHAR)info + info->NextEntryOffset)) {
+		auto pid = HandleToULong(info->UniqueProcessId);
+		PEPROCESS process;
+		// the idle process has no object; a process that is gone already needs no entry
+		if (pid && NT_SUCCESS(PsLookupProcessByProcessId(info->UniqueProcessId, &process))) {
+			ULONG imageNameId = 0;
+			if (info->ImageName.Buffer)
+				imageNameId = g_Globals.Strings.Intern(info->ImageName.Buffer, info->ImageName.Length);
+			g_Globals.Processes.AddRunning(pid, HandleToULong(info->InheritedFromUniqueProcessId), imageNameId, info->CreateTime);
+
+			// if it exited after the list was taken its exit notification may have come before the entry;
+			// the reference keeps the PID from being reused, so the entry removed is this process's
+			if (PsGetProcessExitStatus(process) != STATUS_PENDING) {
+				ProcessState state;
+				g_Globals.Processes.Remove(pid, state);
+			}
+			else {
+				count++;
+			}
+			ObDereferenceObject(process);
+		}
+		if (info->NextEntryOffset == 0)
+			break;
+	}
+	ExFreePool(buffer);
+	KdPrint((DRIVER_PREFIX "%u running processes added to the process table\n", count));
+}
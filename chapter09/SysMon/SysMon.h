@@ -1,20 +1,41 @@
 #pragma once
 
 #include "FastMutex.h"
+#include "Stats.h"
+#include "EventQueue.h"
+#include "Memory.h"
+#include "ReadQueue.h"
+#include "Filter.h"
+#include "RegistryFilter.h"
+#include "ThreadAggregator.h"
+#include "StringTable.h"
+#include "KeyNameCache.h"
+#include "ProcessTable.h"
 
 #define DRIVER_PREFIX "SysMon: "
 #define DRIVER_TAG 'nmys'
 
 struct Globals {
-	LIST_ENTRY ItemsHead;
-	int ItemCount;
-	FastMutex Mutex;
+	EventQueue Queue;
+	ItemAllocator Allocator;
+	ReadQueue Reads;
+	EventFilter Filter;
+	RegistryFilter RegistryFilter;
+	ThreadAggregator Aggregator;
+	StringTable Strings;
+	KeyNameCache KeyNames;
+	ProcessTable Processes;
+	Stats Stats;
+	TimedMutex Mutex;	// serializes readers only
 	LARGE_INTEGER RegCookie;
 };
 
-template<typename T>
-struct FullItem {
-	LIST_ENTRY Entry;
-	T Data;
-};
+extern Globals g_Globals;
+
+// copies the variable length part of a record to its end, returns its offset
+USHORT AppendData(ItemHeader* item, const void* data, USHORT size);
+void PushItem(ItemHeader* item);
+void FreeItem(ItemHeader* item);
 
+// fills the IRP's buffer with the consumer's unread events and completes it; caller holds g_Globals.Mutex
+NTSTATUS CompleteRead(Consumer* consumer, PIRP Irp);
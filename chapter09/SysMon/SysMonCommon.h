@@ -7,22 +7,46 @@ enum class ItemType : short {
 	ThreadCreate,
 	ThreadExit,
 	ImageLoad,
-	RegistrySetValue
+	RegistrySetValue,
+	EventsLost,
+	ThreadSummary,
+	StringDefinition,
+	RegistryCreateKey,
+	RegistryDeleteKey,
+	RegistryDeleteValue,
+	RegistryRenameKey
 };
 
+const ULONG MaxItemTypes = 32;
+
+// version 1: strings and data follow the fixed part of a record, located by offset/length pairs
+// version 2: image and registry key names may be replaced by interned string IDs
+// version 3: process, thread and image load records carry the process key
+// version 4: thread summary records carry the process key
+const USHORT ItemHeaderVersion = 4;
+
 struct ItemHeader {
 	ItemType Type;
-	USHORT Size;
+	USHORT Size;		// including the variable length part
+	USHORT Version;		// ItemHeaderVersion
 	LARGE_INTEGER Time;
 };
 
+// a process key identifies a process for the lifetime of the driver, unlike its PID which is reused.
+// Zero if the process is not in the driver's process table (the table was full or it had exited while the table was seeded).
+
 struct ProcessExitInfo : ItemHeader {
 	ULONG ProcessId;
+	ULONG ProcessKey;
+	ULONG ImageFileNameId;		// interned, zero if not known
 };
 
 struct ProcessCreateInfo : ItemHeader {
 	ULONG ProcessId;
 	ULONG ParentProcessId;
+	ULONG ProcessKey;
+	ULONG ParentProcessKey;
+	ULONG ImageFileNameId;		// interned, zero if not known
 	USHORT CommandLineLength;
 	USHORT CommandLineOffset;
 };
@@ -30,23 +54,259 @@ struct ProcessCreateInfo : ItemHeader {
 struct ThreadCreateExitInfo : ItemHeader {
 	ULONG ThreadId;
 	ULONG ProcessId;
+	ULONG ProcessKey;
+};
+
+// emitted ahead of the next event when events were dropped
+struct EventsLostInfo : ItemHeader {
+	ULONG Count;	// events dropped since the previous marker
+};
+
+// thread aggregation mode: thread activity of a process during one interval
+struct ThreadSummaryInfo : ItemHeader {
+	ULONG ProcessId;
+	ULONG ProcessKey;
+	ULONG Created;
+	ULONG Exited;
+	ULONG IntervalMs;
 };
 
-const int MaxImageFileSize = 300;
+// offsets are from the start of the record, lengths of strings are in WCHARs
+
+// an interned string, sent once before the first record that refers to its ID
+struct StringDefinitionInfo : ItemHeader {
+	ULONG Id;
+	USHORT Length;
+	USHORT Offset;
+};
 
 struct ImageLoadInfo : ItemHeader {
 	ULONG ProcessId;
-	void* LoadAddress;
-	ULONG_PTR ImageSize;
-	WCHAR ImageFileName[MaxImageFileSize + 1];
+	ULONG ImageFileNameId;		// if nonzero, the name is not in the record
+	ULONG64 LoadAddress;
+	ULONG64 ImageSize;
+	USHORT ImageFileNameLength;
+	USHORT ImageFileNameOffset;
+	ULONG ProcessKey;
 };
 
+const USHORT MaxRegistryNameLength = 1024;		// longer key and value names are truncated
+const USHORT MaxRegistryDataCapture = 2048;		// bytes of value data kept
+
 struct RegistrySetValueInfo : ItemHeader {
-    ULONG ProcessId;
-    ULONG ThreadId;
-    WCHAR KeyName[256];		// full key name
-    WCHAR ValueName[64];	// value name
-    ULONG DataType;			// REG_xxx
-    UCHAR Data[128];		// data
-    ULONG DataSize;			// size of data
+	ULONG ProcessId;
+	ULONG ThreadId;
+	ULONG DataType;			// REG_xxx
+	ULONG DataSize;			// size of the data written
+	ULONG KeyNameId;		// if nonzero, the key name is not in the record
+	USHORT KeyNameLength;	// full key name
+	USHORT KeyNameOffset;
+	USHORT ValueNameLength;
+	USHORT ValueNameOffset;
+	USHORT DataLength;		// bytes captured, up to MaxRegistryDataCapture
+	USHORT DataOffset;
+};
+
+// create key, delete key, delete value and rename key
+struct RegistryKeyInfo : ItemHeader {
+	ULONG ProcessId;
+	ULONG ThreadId;
+	ULONG KeyNameId;		// if nonzero, the key name is not in the record
+	USHORT KeyNameLength;	// full key name, before the operation
+	USHORT KeyNameOffset;
+	USHORT NameLength;		// the value name for delete value, the new name for rename key
+	USHORT NameOffset;
+};
+
+// lookaside usage of one event record size class
+struct PoolClassStats {
+	ULONG BlockSize;		// zero for allocations that did not fit any class
+	ULONG Depth;
+	ULONG TotalAllocates;
+	ULONG AllocateMisses;
+	ULONG TotalFrees;
+	ULONG FreeMisses;
+};
+
+#define IOCTL_SYSMON_GET_POOL_STATS	CTL_CODE(0x8000, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+struct ReadBatching {
+	ULONG MinBytes;		// complete a pending read once this many bytes are queued...
+	ULONG MaxDelayMs;	// ...or once the oldest queued event is this old
+};
+
+#define IOCTL_SYSMON_SET_READ_BATCHING	CTL_CODE(0x8000, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// shared memory event channel
+//
+
+const ULONG SharedRecordAlignment = 8;
+
+// the record area follows the header. Offsets are free running byte counts;
+// a record never wraps - the driver fills the tail with an ItemType::None record instead
+struct SharedChannelHeader {
+	volatile ULONG ProducerOffset;	// written by the driver
+	ULONG DataSize;					// size of the record area, a power of 2
+	UCHAR Reserved1[56];
+	volatile ULONG ConsumerOffset;	// written by the client
+	volatile ULONG WaitingForData;	// set by the client before it waits on its event
+	UCHAR Reserved2[56];
+};
+
+struct MapChannelRequest {
+	ULONG Size;			// requested record area size, rounded up to a power of 2
+	HANDLE Event;		// optional auto-reset event, signaled when data arrives
+};
+
+#define IOCTL_SYSMON_MAP_CHANNEL	CTL_CODE(0x8000, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SYSMON_UNMAP_CHANNEL	CTL_CODE(0x8000, 0x803, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+//
+// filter rules, evaluated by the driver before an event is allocated
+//
+
+constexpr ULONG ItemTypeBit(ItemType type) {
+	return 1UL << (ULONG)type;
+}
+
+const ULONG MaxFilterPids = 64;
+const ULONG MaxFilterPrefix = 260;
+
+struct FilterRules {
+	ULONG EventTypes;			// ItemTypeBit mask of events to capture, zero captures all types
+	ULONG ParentProcessId;		// if nonzero, process create events are captured for this parent's children only
+	ULONG IncludeCount;			// if nonzero, only events of these processes are captured
+	ULONG ExcludeCount;
+	ULONG IncludePids[MaxFilterPids];
+	ULONG ExcludePids[MaxFilterPids];
+	WCHAR ImagePrefix[MaxFilterPrefix];	// NT path prefix for process create and image load events, empty for none
+};
+
+// an empty input buffer removes all rules
+#define IOCTL_SYSMON_SET_FILTER		CTL_CODE(0x8000, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// event buffer capacity and overflow handling
+//
+
+enum class OverflowPolicy : ULONG {
+	DropNewest,		// new events are discarded while the buffer is full
+	DropOldest,		// the oldest buffered events are discarded to make room
+	Sample			// once the buffer is half full, only one of every SampleRate events is kept
+};
+
+const ULONG DefaultBufferCapacity = 1 << 22;
+const ULONG MaxBufferCapacity = 1 << 28;
+
+struct BufferPolicy {
+	ULONG CapacityBytes;	// for all CPUs together, zero keeps the current capacity
+	OverflowPolicy Policy;
+	ULONG SampleRate;
+};
+
+#define IOCTL_SYSMON_SET_BUFFER_POLICY	CTL_CODE(0x8000, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+struct DropCounts {
+	ULONG Total;
+	ULONG ByType[MaxItemTypes];		// indexed by ItemType
+};
+
+#define IOCTL_SYSMON_GET_DROP_COUNTS	CTL_CODE(0x8000, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// thread event aggregation
+//
+
+const ULONG MaxWatchPids = 64;
+const ULONG MinAggregationInterval = 100;
+
+struct ThreadAggregation {
+	ULONG IntervalMs;	// summary period, zero reports every thread event
+	ULONG WatchCount;	// processes whose thread events are still reported one by one
+	ULONG WatchPids[MaxWatchPids];
+};
+
+#define IOCTL_SYSMON_SET_THREAD_AGGREGATION	CTL_CODE(0x8000, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// input: the string ID; output: the string, not NULL terminated
+#define IOCTL_SYSMON_GET_STRING		CTL_CODE(0x8000, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// callback instrumentation
+//
+
+enum class CallbackKind : ULONG {
+	Process,
+	Thread,
+	ImageLoad,
+	Registry,
+	Count
+};
+
+// bucket 0 counts calls under 2^8 cycles, bucket i calls of [2^(i+7), 2^(i+8)) cycles; the last one is open ended
+const ULONG LatencyBuckets = 16;
+const ULONG LatencyBucketShift = 8;
+
+struct CallbackStats {
+	ULONG64 Calls;
+	ULONG64 Cycles;
+	ULONG64 AllocFailures;
+	ULONG64 Histogram[LatencyBuckets];
+};
+
+struct SysMonStats {
+	// taken together when the stats were collected, so the client can work out the cycle rate
+	ULONG64 CollectTime;		// interrupt time, 100nsec units
+	ULONG64 CollectCycles;
+	CallbackStats Callbacks[(ULONG)CallbackKind::Count];
+	ULONG64 MutexAcquires;		// g_Globals.Mutex, taken by readers
+	ULONG64 MutexContentions;
+	ULONG64 MutexWaitCycles;
+};
+
+#define IOCTL_SYSMON_GET_STATS		CTL_CODE(0x8000, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// registry event classes and key/value rules
+//
+
+const ULONG RegistryEventTypes = ItemTypeBit(ItemType::RegistrySetValue) | ItemTypeBit(ItemType::RegistryCreateKey) |
+	ItemTypeBit(ItemType::RegistryDeleteKey) | ItemTypeBit(ItemType::RegistryDeleteValue) | ItemTypeBit(ItemType::RegistryRenameKey);
+const ULONG DefaultRegistryEventTypes = ItemTypeBit(ItemType::RegistrySetValue);
+
+const ULONG MaxRegistryKeyPrefixes = 16;
+const ULONG MaxRegistryValueNames = 16;
+const ULONG MaxRegistryRuleName = 260;
+
+struct RegistryRules {
+	ULONG EventTypes;		// ItemTypeBit mask of the registry events to capture, out of RegistryEventTypes
+	ULONG KeyPrefixCount;	// zero captures keys under \REGISTRY\MACHINE\ only
+	ULONG ValueNameCount;	// if nonzero, set value and delete value events are captured for these values only
+	WCHAR KeyPrefixes[MaxRegistryKeyPrefixes][MaxRegistryRuleName];	// full key paths, case insensitive
+	WCHAR ValueNames[MaxRegistryValueNames][MaxRegistryRuleName];
 };
+
+#define IOCTL_SYSMON_SET_REGISTRY_RULES	CTL_CODE(0x8000, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// live processes known to the driver
+//
+
+struct ProcessEntry {
+	ULONG ProcessId;
+	ULONG ProcessKey;
+	ULONG ParentProcessId;
+	ULONG ImageFileNameId;		// interned, zero if not known
+	LARGE_INTEGER CreateTime;
+	ULONG ImageFileNameOffset;	// from the start of the output buffer
+	ULONG ImageFileNameLength;	// in WCHARs, zero if the name is not known or did not fit
+};
+
+// output of IOCTL_SYSMON_GET_PROCESSES: this header, Count entries, then their image names
+struct ProcessSnapshot {
+	ULONG Count;
+	ULONG Total;		// more than Count if the buffer was too small for all the entries
+};
+
+#define IOCTL_SYSMON_GET_PROCESSES	CTL_CODE(0x8000, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -0,0 +1,158 @@
+#include "pch.h"
+#include "ThreadAggregator.h"
+#include "SysMon.h"
+#include "PidList.h"
+
+NTSTATUS ThreadAggregator::Init() {
+	auto status = _table.Init(DRIVER_TAG);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	_lock = 0;
+	_intervalMs = 0;
+	_watchCount = 0;
+	KeInitializeTimerEx(&_timer, NotificationTimer);
+	KeInitializeDpc(&_dpc, OnTimer, this);
+	return STATUS_SUCCESS;
+}
+
+void ThreadAggregator::Term() {
+	if (!_table.IsAllocated())
+		return;
+
+	KeCancelTimer(&_timer);
+	KeFlushQueuedDpcs();
+	_table.Term();
+}
+
+NTSTATUS ThreadAggregator::Configure(const ThreadAggregation* config) {
+	if (config->WatchCount > MaxWatchPids)
+		return STATUS_INVALID_PARAMETER;
+	if (config->IntervalMs && config->IntervalMs < MinAggregationInterval)
+		return STATUS_INVALID_PARAMETER;
+
+	// stop the timer first so no DPC is running while we reconfigure
+	KeCancelTimer(&_timer);
+	KeFlushQueuedDpcs();
+
+	auto irql = ExAcquireSpinLockExclusive(&_lock);
+	::memcpy(_watchPids, config->WatchPids, config->WatchCount * sizeof(ULONG));
+	_watchCount = SortPids(_watchPids, config->WatchCount);
+	InterlockedExchange(&_intervalMs, config->IntervalMs);
+	ExReleaseSpinLockExclusive(&_lock, irql);
+
+	if (config->IntervalMs) {
+		LARGE_INTEGER dueTime;
+		dueTime.QuadPart = -10000LL * config->IntervalMs;
+		KeSetTimerEx(&_timer, dueTime, config->IntervalMs, &_dpc);
+	}
+	else {
+		// report what was counted before aggregation was turned off and empty the table,
+		// exits are not tracked while it is off
+		irql = KeRaiseIrqlToDpcLevel();
+		Flush();
+		KeLowerIrql(irql);
+	}
+	return STATUS_SUCCESS;
+}
+
+bool ThreadAggregator::Count(ULONG pid, bool create) {
+	if (ReadNoFence(&_intervalMs) == 0)
+		return false;
+
+	auto irql = ExAcquireSpinLockShared(&_lock);
+	if (_intervalMs == 0 || ContainsPid(_watchPids, _watchCount, pid)) {
+		ExReleaseSpinLockShared(&_lock, irql);
+		return false;
+	}
+
+	auto index = _table.Find(pid);
+	if (index == PidNotFound) {
+		// first thread event of this process since the last summary; another thread may insert it meanwhile
+		ExReleaseSpinLockShared(&_lock, irql);
+		auto key = g_Globals.Processes.GetKey(pid);
+		irql = ExAcquireSpinLockExclusive(&_lock);
+		index = _table.Insert(pid);
+		if (index == PidNotFound) {
+			// table full, let the event through
+			ExReleaseSpinLockExclusive(&_lock, irql);
+			return false;
+		}
+		auto& counters = _table[index];
+		if (counters.ProcessGone) {
+			// the PID was reused before the old process's last summary
+			ExReleaseSpinLockExclusive(&_lock, irql);
+			return false;
+		}
+		counters.ProcessKey = key;
+		if (create)
+			counters.Created++;
+		else
+			counters.Exited++;
+		ExReleaseSpinLockExclusive(&_lock, irql);
+		return true;
+	}
+
+	auto& counters = _table[index];
+	if (counters.ProcessGone) {
+		ExReleaseSpinLockShared(&_lock, irql);
+		return false;
+	}
+	InterlockedIncrement(create ? &counters.Created : &counters.Exited);
+	ExReleaseSpinLockShared(&_lock, irql);
+	return true;
+}
+
+void ThreadAggregator::OnProcessExit(ULONG pid) {
+	if (ReadNoFence(&_intervalMs) == 0)
+		return;
+
+	auto irql = ExAcquireSpinLockShared(&_lock);
+	auto index = _table.Find(pid);
+	if (index != PidNotFound)
+		InterlockedExchange(&_table[index].ProcessGone, 1);
+	ExReleaseSpinLockShared(&_lock, irql);
+}
+
+void ThreadAggregator::OnTimer(PKDPC, PVOID context, PVOID, PVOID) {
+	((ThreadAggregator*)context)->Flush();
+}
+
+void ThreadAggregator::Flush() {
+	// runs at DISPATCH_LEVEL
+	ExAcquireSpinLockExclusiveAtDpcLevel(&_lock);
+
+	for (ULONG i = 0; i < AggregationTableSize; i++) {
+		auto& counters = _table[i];
+		while (counters.ProcessId) {
+			if (counters.Created || counters.Exited) {
+				Report(counters);
+				counters.Created = counters.Exited = 0;
+			}
+			if (!counters.ProcessGone && _intervalMs)
+				break;
+
+			// the slot may be refilled by a later entry of the same probe chain, look at it again
+			_table.RemoveAt(i);
+		}
+	}
+
+	ExReleaseSpinLockExclusiveFromDpcLevel(&_lock);
+}
+
+void ThreadAggregator::Report(const ThreadCounters& counters) {
+	auto info = g_Globals.Allocator.Allocate<ThreadSummaryInfo>();
+	if (info == nullptr)
+		return;
+
+	auto& item = info->Data;
+	item.Type = ItemType::ThreadSummary;
+	item.Size = sizeof(item);
+	item.ProcessId = counters.ProcessId;
+	// looked up when the entry was made, the process may be gone from the process table by now
+	item.ProcessKey = counters.ProcessKey;
+	item.Created = counters.Created;
+	item.Exited = counters.Exited;
+	item.IntervalMs = _intervalMs;
+	PushItem(&item);
+}
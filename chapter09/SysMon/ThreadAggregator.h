@@ -0,0 +1,47 @@
+#pragma once
+
+#include "SysMonCommon.h"
+#include "PidHashTable.h"
+
+const ULONG AggregationTableSize = 4096;	// must be a power of 2
+const ULONG MaxAggregationProbes = 64;
+
+struct ThreadCounters {
+	ULONG ProcessId;		// zero for a free slot
+	ULONG ProcessKey;
+	volatile LONG Created;
+	volatile LONG Exited;
+	volatile LONG ProcessGone;	// remove after the next summary
+};
+
+//
+// per-process thread create/exit counters for thread aggregation mode.
+// Callbacks bump counters under the shared side of a reader/writer spin lock;
+// a timer DPC turns the counters into ThreadSummary records every interval.
+//
+
+class ThreadAggregator {
+public:
+	NTSTATUS Init();
+	void Term();
+
+	NTSTATUS Configure(const ThreadAggregation* config);
+
+	// returns false if the event should be reported on its own
+	bool Count(ULONG pid, bool create);
+	void OnProcessExit(ULONG pid);
+
+private:
+	static KDEFERRED_ROUTINE OnTimer;
+	void Flush();
+	void Report(const ThreadCounters& counters);
+
+private:
+	PidHashTable<ThreadCounters, AggregationTableSize, MaxAggregationProbes> _table;
+	EX_SPIN_LOCK _lock;
+	KTIMER _timer;
+	KDPC _dpc;
+	volatile LONG _intervalMs;
+	ULONG _watchCount;
+	ULONG _watchPids[MaxWatchPids];	// sorted
+};
@@ -0,0 +1,120 @@
+// SysMonBench.cpp : measures how SysMon event throughput scales with the number of cores generating events.
+//
+
+#include "pch.h"
+#include "..\SysMon\SysMonCommon.h"
+
+struct BenchState {
+	HANDLE hDevice;
+	volatile bool Stop;
+	volatile LONG64 ThreadsCreated;
+	volatile LONG64 EventsReceived;
+};
+
+int Error(const char* text) {
+	printf("%s (%d)\n", text, ::GetLastError());
+	return 1;
+}
+
+DWORD WINAPI EmptyThread(PVOID) {
+	return 0;
+}
+
+// each worker creates and destroys threads as fast as it can,
+// producing a ThreadCreate and a ThreadExit event per iteration on its CPU
+DWORD WINAPI GeneratorThread(PVOID param) {
+	auto state = (BenchState*)param;
+	LONG64 count = 0;
+	while (!state->Stop) {
+		auto hThread = ::CreateThread(nullptr, 0, EmptyThread, nullptr, 0, nullptr);
+		if (!hThread)
+			break;
+		::WaitForSingleObject(hThread, INFINITE);
+		::CloseHandle(hThread);
+		count++;
+	}
+	::InterlockedAdd64(&state->ThreadsCreated, count);
+	return 0;
+}
+
+DWORD WINAPI ReaderThread(PVOID param) {
+	auto state = (BenchState*)param;
+	static BYTE buffer[1 << 16];
+	while (!state->Stop) {
+		DWORD bytes;
+		if (!::ReadFile(state->hDevice, buffer, sizeof(buffer), &bytes, nullptr))
+			break;
+
+		LONG64 count = 0;
+		for (DWORD offset = 0; offset < bytes; ) {
+			auto header = (ItemHeader*)(buffer + offset);
+			if (header->Size == 0)
+				break;
+			offset += header->Size;
+			if (header->Type != ItemType::EventsLost && header->Type != ItemType::StringDefinition)
+				count++;
+		}
+		::InterlockedAdd64(&state->EventsReceived, count);
+	}
+	return 0;
+}
+
+void RunStep(BenchState& state, int cpus, DWORD seconds) {
+	state.Stop = false;
+	state.ThreadsCreated = state.EventsReceived = 0;
+
+	auto hReader = ::CreateThread(nullptr, 0, ReaderThread, &state, 0, nullptr);
+	std::vector<HANDLE> threads;
+	for (int i = 0; i < cpus; i++) {
+		auto hThread = ::CreateThread(nullptr, 0, GeneratorThread, &state, CREATE_SUSPENDED, nullptr);
+		::SetThreadAffinityMask(hThread, DWORD_PTR(1) << i);
+		threads.push_back(hThread);
+	}
+	for (auto h : threads)
+		::ResumeThread(h);
+
+	::Sleep(seconds * 1000);
+	state.Stop = true;
+
+	::WaitForMultipleObjects(static_cast<DWORD>(threads.size()), threads.data(), TRUE, INFINITE);
+	// the reader may be blocked in a pending read
+	::CancelSynchronousIo(hReader);
+	::WaitForSingleObject(hReader, INFINITE);
+	for (auto h : threads)
+		::CloseHandle(h);
+	::CloseHandle(hReader);
+
+	auto generated = state.ThreadsCreated * 2;
+	printf("%4d %14.0f %14.0f %10.1f%%\n", cpus,
+		double(generated) / seconds, double(state.EventsReceived) / seconds,
+		generated ? 100.0 * state.EventsReceived / generated : 0.0);
+}
+
+int main(int argc, const char* argv[]) {
+	DWORD seconds = argc > 1 ? atoi(argv[1]) : 5;
+	if (seconds == 0)
+		seconds = 5;
+
+	auto hDevice = ::CreateFile(L"\\\\.\\SysMon", GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return Error("Failed to open file");
+
+	SYSTEM_INFO si;
+	::GetSystemInfo(&si);
+	int maxCpus = min(static_cast<int>(si.dwNumberOfProcessors), 64);
+
+	BenchState state{};
+	state.hDevice = hDevice;
+
+	printf("CPUs  generated/sec   received/sec   received\n");
+	for (int cpus = 1; ; cpus *= 2) {
+		if (cpus > maxCpus)
+			cpus = maxCpus;
+		RunStep(state, cpus, seconds);
+		if (cpus == maxCpus)
+			break;
+	}
+
+	::CloseHandle(hDevice);
+	return 0;
+}
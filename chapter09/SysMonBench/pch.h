@@ -0,0 +1,8 @@
+#ifndef PCH_H
+#define PCH_H
+
+#include <Windows.h>
+#include <stdio.h>
+#include <vector>
+
+#endif //PCH_H
@@ -0,0 +1,159 @@
+#include "pch.h"
+#include "CaptureWriter.h"
+
+CaptureWriter::~CaptureWriter() {
+	Close();
+}
+
+bool CaptureWriter::Open(const WCHAR* path, ULONG chunkSize) {
+	// chunks are mapped one at a time, keep them page aligned
+	SYSTEM_INFO si;
+	::GetSystemInfo(&si);
+	chunkSize = max(chunkSize, MinCaptureChunkSize);
+	chunkSize = (chunkSize + si.dwPageSize - 1) & ~(si.dwPageSize - 1);
+
+	_hFile = ::CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	_header.Magic = CaptureFileMagic;
+	_header.FormatVersion = CaptureFormatVersion;
+	_header.RecordVersion = ItemHeaderVersion;
+	_header.ChunkSize = chunkSize;
+	::GetSystemTimeAsFileTime((FILETIME*)&_header.StartTime);
+	_header.EndTime = _header.StartTime;
+	return StartChunk();
+}
+
+bool CaptureWriter::WriteFileHeader() {
+	BYTE page[CaptureFileHeaderSize] = { 0 };
+	::memcpy(page, &_header, sizeof(_header));
+
+	OVERLAPPED ov = { 0 };
+	DWORD bytes;
+	return ::WriteFile(_hFile, page, sizeof(page), &bytes, &ov) && bytes == sizeof(page);
+}
+
+bool CaptureWriter::StartChunk() {
+	_chunkOffset = CaptureFileHeaderSize + (ULONG64)_header.ChunkCount * _header.ChunkSize;
+
+	// grow the file by a chunk and map it. Views must start on the allocation granularity
+	LARGE_INTEGER end;
+	end.QuadPart = _chunkOffset + _header.ChunkSize;
+	HANDLE hMapping = ::CreateFileMapping(_hFile, nullptr, PAGE_READWRITE, end.HighPart, end.LowPart, nullptr);
+	if (!hMapping)
+		return false;
+
+	SYSTEM_INFO si;
+	::GetSystemInfo(&si);
+	auto viewOffset = _chunkOffset & ~(ULONG64)(si.dwAllocationGranularity - 1);
+	_view = (BYTE*)::MapViewOfFile(hMapping, FILE_MAP_WRITE, (DWORD)(viewOffset >> 32), (DWORD)viewOffset,
+		(SIZE_T)(end.QuadPart - viewOffset));
+	// the view keeps the mapping alive
+	::CloseHandle(hMapping);
+	if (!_view)
+		return false;
+
+	_chunk = (CaptureChunkHeader*)(_view + (_chunkOffset - viewOffset));
+	// new pages of the file are zero, which is an empty chunk apart from the magic
+	_chunk->Magic = CaptureChunkMagic;
+	_header.ChunkCount++;
+	return WriteFileHeader();
+}
+
+void CaptureWriter::FinishChunk() {
+	if (_view == nullptr)
+		return;
+
+	if (_chunk->RecordCount && _chunk->LastTime.QuadPart > _header.EndTime.QuadPart)
+		_header.EndTime = _chunk->LastTime;
+	::UnmapViewOfFile(_view);
+	_view = nullptr;
+	_chunk = nullptr;
+}
+
+bool CaptureWriter::DefineString(ULONG id, const LARGE_INTEGER& time) {
+	auto str = _lookup(id);
+	auto length = (USHORT)min(str.size(), (MAXUSHORT - sizeof(StringDefinitionInfo)) / sizeof(WCHAR));
+
+	BYTE buffer[1 << 16];
+	auto info = (StringDefinitionInfo*)buffer;
+	info->Type = ItemType::StringDefinition;
+	info->Version = ItemHeaderVersion;
+	info->Time = time;
+	info->Id = id;
+	info->Length = length;
+	info->Offset = sizeof(StringDefinitionInfo);
+	info->Size = (USHORT)(sizeof(StringDefinitionInfo) + length * sizeof(WCHAR));
+	::memcpy(buffer + info->Offset, str.c_str(), length * sizeof(WCHAR));
+	return Append(info);
+}
+
+bool CaptureWriter::Write(const BYTE* buffer, DWORD size) {
+	RecordReader reader(buffer, size);
+	RecordView record;
+	while (reader.Next(record)) {
+		auto header = record.Header();
+		if (header->Type == ItemType::None)
+			continue;
+
+		if (header->Type == ItemType::StringDefinition) {
+			_definedStrings.insert(record.As<StringDefinitionInfo>()->Id);
+		}
+		else {
+			// make sure the file defines every string it uses, even if the driver's definition was missed
+			auto id = GetRecordStringId(header);
+			if (id && _definedStrings.find(id) == _definedStrings.end()) {
+				if (!DefineString(id, header->Time))
+					return false;
+				_definedStrings.insert(id);
+			}
+		}
+
+		if (!Append(header))
+			return false;
+	}
+	return true;
+}
+
+bool CaptureWriter::Append(const ItemHeader* record) {
+	if (_chunk->DataSize + record->Size > _header.ChunkSize - sizeof(CaptureChunkHeader)) {
+		FinishChunk();
+		if (!StartChunk())
+			return false;
+	}
+
+	auto& chunk = *_chunk;
+	::memcpy((BYTE*)(&chunk + 1) + chunk.DataSize, record, record->Size);
+	chunk.DataSize += record->Size;
+
+	if (chunk.RecordCount == 0 || record->Time.QuadPart < chunk.FirstTime.QuadPart)
+		chunk.FirstTime = record->Time;
+	if (record->Time.QuadPart > chunk.LastTime.QuadPart)
+		chunk.LastTime = record->Time;
+	chunk.RecordCount++;
+	chunk.TypeCounts[(ULONG)record->Type % MaxItemTypes]++;
+
+	auto pid = GetRecordProcessId(record);
+	if (pid)
+		CaptureBloomAdd(chunk.PidBloom, pid);
+
+	_records++;
+	return true;
+}
+
+bool CaptureWriter::Close() {
+	if (_hFile == INVALID_HANDLE_VALUE)
+		return true;
+
+	// the last chunk ends with its data
+	ULONG64 end = _chunkOffset + (_chunk ? sizeof(CaptureChunkHeader) + _chunk->DataSize : 0);
+	FinishChunk();
+
+	LARGE_INTEGER size;
+	size.QuadPart = end;
+	auto ok = ::SetFilePointerEx(_hFile, size, nullptr, FILE_BEGIN) && ::SetEndOfFile(_hFile) && WriteFileHeader();
+	::CloseHandle(_hFile);
+	_hFile = INVALID_HANDLE_VALUE;
+	return ok ? true : false;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "..\SysMon\CaptureFormat.h"
+#include "..\SysMon\RecordView.h"
+#include <functional>
+#include <string>
+#include <unordered_set>
+
+//
+// writes event records into a capture file through a mapped view of the current chunk
+//
+
+class CaptureWriter {
+public:
+	// resolves string IDs whose definition was not seen in the stream
+	using StringLookup = std::function<std::wstring(ULONG)>;
+
+	CaptureWriter(StringLookup lookup) : _lookup(lookup) {}
+	~CaptureWriter();
+
+	bool Open(const WCHAR* path, ULONG chunkSize);
+	// a buffer of records as returned by the driver; a malformed record and the rest of the buffer are dropped
+	bool Write(const BYTE* buffer, DWORD size);
+	bool Close();
+
+	ULONG64 GetRecordCount() const {
+		return _records;
+	}
+
+private:
+	bool Append(const ItemHeader* record);
+	bool DefineString(ULONG id, const LARGE_INTEGER& time);
+	bool StartChunk();
+	void FinishChunk();
+	bool WriteFileHeader();
+
+private:
+	StringLookup _lookup;
+	HANDLE _hFile = INVALID_HANDLE_VALUE;
+	CaptureFileHeader _header = { 0 };
+
+	// the current chunk
+	BYTE* _view = nullptr;		// start of the mapped view, at or before the chunk
+	CaptureChunkHeader* _chunk = nullptr;
+	ULONG64 _chunkOffset = 0;
+
+	std::unordered_set<ULONG> _definedStrings;
+	ULONG64 _records = 0;
+};
@@ -0,0 +1,274 @@
+#include "pch.h"
+#include "EventFormatter.h"
+
+const size_t OutputBufferSize = 1 << 18;
+// the most a single append step writes without checking for room
+const size_t MaxAppendStep = 64;
+
+static const char* FieldNames[] = {
+	"pid", "tid", "process", "ppid", "parentprocess", "image", "commandline", "key", "name",
+	"datatype", "datasize", "data", "address", "created", "exited", "interval", "count"
+};
+static_assert(_countof(FieldNames) == (int)Field::Max, "field names");
+
+EventFormatter::EventFormatter(OutputFormat format, HANDLE hOutput)
+	: _format(format), _hOutput(hOutput), _buffer(new char[OutputBufferSize]) {
+	// text is written as UTF-8, which the console shows only with its code page set to match
+	if (::GetFileType(hOutput) == FILE_TYPE_CHAR) {
+		_consoleCodePage = ::GetConsoleOutputCP();
+		::SetConsoleOutputCP(CP_UTF8);
+	}
+
+	if (format == OutputFormat::Csv) {
+		Append("time,type", 9);
+		for (auto name : FieldNames) {
+			Append(',');
+			Append(name, ::strlen(name));
+		}
+		Append("\r\n", 2);
+	}
+}
+
+EventFormatter::~EventFormatter() {
+	Flush();
+	if (_consoleCodePage)
+		::SetConsoleOutputCP(_consoleCodePage);
+}
+
+bool EventFormatter::Flush() {
+	DWORD bytes;
+	auto ok = _used == 0 || ::WriteFile(_hOutput, _buffer.get(), (DWORD)_used, &bytes, nullptr);
+	_used = 0;
+	return ok ? true : false;
+}
+
+void EventFormatter::Reserve(size_t size) {
+	if (_used + size > OutputBufferSize)
+		Flush();
+}
+
+void EventFormatter::Append(const char* text, size_t length) {
+	while (length) {
+		Reserve(MaxAppendStep);
+		auto count = min(length, OutputBufferSize - _used);
+		::memcpy(_buffer.get() + _used, text, count);
+		_used += count;
+		text += count;
+		length -= count;
+	}
+}
+
+void EventFormatter::AppendDecimal(ULONG64 value) {
+	char digits[20];
+	int count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	while (count)
+		Append(digits[--count]);
+}
+
+void EventFormatter::AppendDigits(ULONG value, int count) {
+	for (int i = count - 1; i >= 0; i--) {
+		_buffer[_used + i] = '0' + value % 10;
+		value /= 10;
+	}
+	_used += count;
+}
+
+void EventFormatter::AppendHex(ULONG64 value) {
+	static const char hex[] = "0123456789ABCDEF";
+	Append("0x", 2);
+	int shift = 60;
+	while (shift > 0 && (value >> shift) == 0)
+		shift -= 4;
+	for (; shift >= 0; shift -= 4)
+		Append(hex[(value >> shift) & 0xF]);
+}
+
+void EventFormatter::AppendText(const WCHAR* text, size_t length) {
+	static const char hex[] = "0123456789ABCDEF";
+	for (size_t i = 0; i < length; i++) {
+		Reserve(MaxAppendStep);
+		ULONG c = text[i];
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < length && text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000)
+			c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+
+		if (c < 0x80) {
+			switch (_format) {
+				case OutputFormat::Json:
+					if (c == '"' || c == '\\') {
+						Append('\\');
+					}
+					else if (c < 0x20) {
+						Append("\\u00", 4);
+						Append(hex[c >> 4]);
+						c = hex[c & 0xF];
+					}
+					break;
+
+				case OutputFormat::Csv:
+					if (c == '"')
+						Append('"');
+					break;
+
+				default:
+					// keep one event per line
+					if (c < 0x20)
+						c = ' ';
+					break;
+			}
+			Append((char)c);
+		}
+		else if (c < 0x800) {
+			Append((char)(0xC0 | (c >> 6)));
+			Append((char)(0x80 | (c & 0x3F)));
+		}
+		else if (c < 0x10000) {
+			Append((char)(0xE0 | (c >> 12)));
+			Append((char)(0x80 | ((c >> 6) & 0x3F)));
+			Append((char)(0x80 | (c & 0x3F)));
+		}
+		else {
+			Append((char)(0xF0 | (c >> 18)));
+			Append((char)(0x80 | ((c >> 12) & 0x3F)));
+			Append((char)(0x80 | ((c >> 6) & 0x3F)));
+			Append((char)(0x80 | (c & 0x3F)));
+		}
+	}
+}
+
+void EventFormatter::AppendTime(LONG64 time) {
+	auto second = time / 10000000;
+	if (second != _second) {
+		// once a second at most
+		_second = second;
+		LARGE_INTEGER start;
+		start.QuadPart = second * 10000000;
+		SYSTEMTIME st;
+		::FileTimeToSystemTime((FILETIME*)&start, &st);
+		if (_format == OutputFormat::Text)
+			_secondLength = sprintf_s(_secondText, "%02d:%02d:%02d", st.wHour, st.wMinute, st.wSecond);
+		else
+			_secondLength = sprintf_s(_secondText, "%04d-%02d-%02dT%02d:%02d:%02d",
+				st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+	}
+
+	Reserve(MaxAppendStep);
+	Append(_secondText, _secondLength);
+	Append('.');
+	auto fraction = (ULONG)(time % 10000000);
+	if (_format == OutputFormat::Text) {
+		AppendDigits(fraction / 10000, 3);
+	}
+	else {
+		AppendDigits(fraction, 7);
+		Append('Z');
+	}
+}
+
+void EventFormatter::BeginRecord(const ItemHeader* header, const char* type) {
+	Reserve(MaxAppendStep);
+	switch (_format) {
+		case OutputFormat::Json:
+			Append("{\"time\":\"", 9);
+			AppendTime(header->Time.QuadPart);
+			Append("\",\"type\":\"", 10);
+			Append(type, ::strlen(type));
+			Append('"');
+			break;
+
+		case OutputFormat::Csv:
+			AppendTime(header->Time.QuadPart);
+			Append(',');
+			Append(type, ::strlen(type));
+			_column = 0;
+			break;
+
+		default:
+			AppendTime(header->Time.QuadPart);
+			Append(": ", 2);
+			Append(type, ::strlen(type));
+			break;
+	}
+}
+
+void EventFormatter::StartField(Field field) {
+	Reserve(MaxAppendStep);
+	auto name = FieldNames[(int)field];
+	switch (_format) {
+		case OutputFormat::Json:
+			Append(",\"", 2);
+			Append(name, ::strlen(name));
+			Append("\":", 2);
+			break;
+
+		case OutputFormat::Csv:
+			// empty columns for the fields this record does not have
+			for (; _column <= (int)field; _column++)
+				Append(',');
+			break;
+
+		default:
+			Append(' ');
+			Append(name, ::strlen(name));
+			Append('=');
+			break;
+	}
+}
+
+void EventFormatter::Add(Field field, ULONG64 value) {
+	StartField(field);
+	AppendDecimal(value);
+}
+
+void EventFormatter::AddHex(Field field, ULONG64 value) {
+	StartField(field);
+	// JSON numbers are decimal, keep hex as a string
+	if (_format == OutputFormat::Json)
+		Append('"');
+	AppendHex(value);
+	if (_format == OutputFormat::Json)
+		Append('"');
+}
+
+void EventFormatter::Add(Field field, const WCHAR* text, size_t length) {
+	StartField(field);
+	if (_format != OutputFormat::Text)
+		Append('"');
+	AppendText(text, length);
+	if (_format != OutputFormat::Text)
+		Append('"');
+}
+
+void EventFormatter::AddBinary(Field field, const UCHAR* data, size_t size) {
+	static const char hex[] = "0123456789ABCDEF";
+	StartField(field);
+	if (_format != OutputFormat::Text)
+		Append('"');
+	for (size_t i = 0; i < size; i++) {
+		Reserve(MaxAppendStep);
+		if (i)
+			Append(' ');
+		Append(hex[data[i] >> 4]);
+		Append(hex[data[i] & 0xF]);
+	}
+	if (_format != OutputFormat::Text)
+		Append('"');
+}
+
+void EventFormatter::EndRecord() {
+	Reserve(MaxAppendStep);
+	switch (_format) {
+		case OutputFormat::Json:
+			Append("}\n", 2);
+			return;
+
+		case OutputFormat::Csv:
+			for (; _column < (int)Field::Max; _column++)
+				Append(',');
+			break;
+	}
+	Append("\r\n", 2);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "..\SysMon\SysMonCommon.h"
+#include <memory>
+
+enum class OutputFormat {
+	Text,		// one line per event, name=value fields
+	Json,		// JSON lines, one object per event
+	Csv			// a header line, then one row per event with a fixed set of columns
+};
+
+// event fields; for CSV they must be added to a record in this order
+enum class Field {
+	ProcessId,
+	ThreadId,
+	Process,			// file name of the process image
+	ParentProcessId,
+	ParentProcess,
+	Image,
+	CommandLine,
+	Key,
+	Name,
+	DataType,
+	DataSize,
+	Data,
+	Address,
+	Created,
+	Exited,
+	Interval,
+	Count,
+	Max
+};
+
+//
+// formats event records into a large output buffer, written out by Flush.
+// Nothing is allocated per event: strings are converted to UTF-8 in place,
+// and the date/time part of the timestamp is formatted once per second
+//
+
+class EventFormatter {
+public:
+	EventFormatter(OutputFormat format, HANDLE hOutput);
+	~EventFormatter();
+
+	void BeginRecord(const ItemHeader* header, const char* type);
+	void Add(Field field, ULONG64 value);
+	void AddHex(Field field, ULONG64 value);
+	void Add(Field field, const WCHAR* text, size_t length);
+	void Add(Field field, const WCHAR* text) {
+		Add(field, text, ::wcslen(text));
+	}
+	void AddBinary(Field field, const UCHAR* data, size_t size);
+	void EndRecord();
+
+	bool Flush();
+
+private:
+	void StartField(Field field);
+	void Reserve(size_t size);
+	void Append(char c) {
+		_buffer[_used++] = c;
+	}
+	void Append(const char* text, size_t length);
+	void AppendDecimal(ULONG64 value);
+	void AppendDigits(ULONG value, int count);
+	void AppendHex(ULONG64 value);
+	void AppendText(const WCHAR* text, size_t length);
+	void AppendTime(LONG64 time);
+
+private:
+	OutputFormat _format;
+	HANDLE _hOutput;
+	UINT _consoleCodePage = 0;	// to restore, if we switched the console to UTF-8
+	std::unique_ptr<char[]> _buffer;
+	size_t _used = 0;
+	int _column = 0;			// CSV: next column to write
+
+	// the start of the timestamp up to the seconds
+	LONG64 _second = -1;
+	char _secondText[32];
+	int _secondLength = 0;
+};
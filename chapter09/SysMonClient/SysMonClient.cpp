@@ -3,125 +3,881 @@
 
 #include "pch.h"
 #include "..\SysMon\SysMonCommon.h"
+#include "..\SysMon\RecordView.h"
+#include "CaptureWriter.h"
+#include "EventFormatter.h"
 #include <string>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// interned strings sent by the driver, by ID
+std::unordered_map<ULONG, std::wstring> g_Strings;
+// image file names of live processes by process key
+std::unordered_map<ULONG, std::wstring> g_Processes;
+HANDLE g_hDevice;
 
 int Error(const char* text) {
 	printf("%s (%d)\n", text, ::GetLastError());
 	return 1;
 }
 
-void DisplayTime(const LARGE_INTEGER& time) {
-	SYSTEMTIME st;
-	::FileTimeToSystemTime((FILETIME*)&time, &st);
-	printf("%02d:%02d:%02d.%03d: ", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+// waits for the request to complete, also on a handle opened for overlapped I/O.
+// The completion is not queued to the handle's completion port
+bool SyncDeviceIoControl(HANDLE hDevice, DWORD code, PVOID input, DWORD inputSize, PVOID output, DWORD outputSize, DWORD* bytes) {
+	OVERLAPPED ov = { 0 };
+	HANDLE hEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if (!hEvent)
+		return false;
+
+	// setting the low bit of the event keeps the completion off the port
+	ov.hEvent = (HANDLE)((ULONG_PTR)hEvent | 1);
+	auto ok = ::DeviceIoControl(hDevice, code, input, inputSize, output, outputSize, bytes, &ov);
+	if (!ok && ::GetLastError() == ERROR_IO_PENDING)
+		ok = ::GetOverlappedResult(hDevice, &ov, bytes, TRUE);
+	::CloseHandle(hEvent);
+	return ok ? true : false;
 }
 
-void DisplayBinary(const UCHAR* buffer, DWORD size) {
-	for (DWORD i = 0; i < size; i++)
-		printf("%02X ", buffer[i]);
-	printf("\n");
+const std::wstring& GetString(ULONG id) {
+	auto it = g_Strings.find(id);
+	if (it != g_Strings.end())
+		return it->second;
+
+	// the definition was lost or sent before we started reading
+	WCHAR text[2048];
+	DWORD bytes;
+	std::wstring str(L"(unknown)");
+	if (SyncDeviceIoControl(g_hDevice, IOCTL_SYSMON_GET_STRING, &id, sizeof(id), text, sizeof(text), &bytes))
+		str.assign(text, bytes / sizeof(WCHAR));
+	return g_Strings[id] = std::move(str);
 }
 
-void DisplayInfo(BYTE* buffer, DWORD size) {
-	auto count = size;
-	while (count > 0) {
-		auto header = (ItemHeader*)buffer;
-		switch (header->Type) {
-			case ItemType::ProcessExit:
-			{
-				DisplayTime(header->Time);
-				auto info = (ProcessExitInfo*)buffer;
-				printf("Process %d Exited\n", info->ProcessId);
-				break;
+// an interned string or one in the record
+RecordText GetString(const RecordView& record, ULONG id, USHORT offset, USHORT length) {
+	if (id) {
+		auto& str = GetString(id);
+		return RecordText{ str.c_str(), str.size() };
+	}
+	return record.Text(offset, length);
+}
+
+// the file name part of the image of a process, empty if not known
+const WCHAR* ProcessName(ULONG key) {
+	auto it = g_Processes.find(key);
+	if (key == 0 || it == g_Processes.end())
+		return L"";
+
+	auto& path = it->second;
+	auto slash = path.rfind(L'\\');
+	return path.c_str() + (slash == std::wstring::npos ? 0 : slash + 1);
+}
+
+const char* ItemTypeName(ULONG type) {
+	static const char* names[] = {
+		"None", "Process Create", "Process Exit", "Thread Create", "Thread Exit",
+		"Image Load", "Registry Set Value", "Events Lost", "Thread Summary",
+		"String Definition", "Registry Create Key", "Registry Delete Key", "Registry Delete Value",
+		"Registry Rename Key"
+	};
+	return type < _countof(names) ? names[type] : "Unknown";
+}
+
+// the reader has checked that the record holds the fixed part of its type
+void DisplayItem(EventFormatter& out, const RecordView& record) {
+	auto header = record.Header();
+	if (header->Version != ItemHeaderVersion) {
+		// written by a driver with a different record layout
+		out.Flush();
+		printf("Unsupported record version %u\n", header->Version);
+		return;
+	}
+
+	switch (header->Type) {
+		case ItemType::StringDefinition:
+		{
+			auto info = record.As<StringDefinitionInfo>();
+			auto text = record.Text(info->Offset, info->Length);
+			if (text.Data)
+				g_Strings[info->Id].assign(text.Data, text.Length);
+			return;
+		}
+
+		case ItemType::None:
+			return;
+	}
+
+	out.BeginRecord(header, ItemTypeName((ULONG)header->Type));
+	switch (header->Type) {
+		case ItemType::ProcessExit:
+		{
+			auto info = record.As<ProcessExitInfo>();
+			out.Add(Field::ProcessId, info->ProcessId);
+			if (info->ImageFileNameId) {
+				auto& name = GetString(info->ImageFileNameId);
+				out.Add(Field::Image, name.c_str(), name.size());
 			}
+			g_Processes.erase(info->ProcessKey);
+			break;
+		}
 
-			case ItemType::ProcessCreate:
-			{
-				DisplayTime(header->Time);
-				auto info = (ProcessCreateInfo*)buffer;
-				std::wstring commandline((WCHAR*)(buffer + info->CommandLineOffset), info->CommandLineLength);
-				printf("Process %d Created. Command line: %ws\n", info->ProcessId, commandline.c_str());
-				break;
+		case ItemType::ProcessCreate:
+		{
+			auto info = record.As<ProcessCreateInfo>();
+			out.Add(Field::ProcessId, info->ProcessId);
+			out.Add(Field::ParentProcessId, info->ParentProcessId);
+			out.Add(Field::ParentProcess, ProcessName(info->ParentProcessKey));
+			if (info->ImageFileNameId) {
+				auto& name = GetString(info->ImageFileNameId);
+				out.Add(Field::Image, name.c_str(), name.size());
+				if (info->ProcessKey)
+					g_Processes[info->ProcessKey] = name;
 			}
+			auto commandLine = record.Text(info->CommandLineOffset, info->CommandLineLength);
+			out.Add(Field::CommandLine, commandLine.Data, commandLine.Length);
+			break;
+		}
+
+		case ItemType::ThreadCreate:
+		case ItemType::ThreadExit:
+		{
+			auto info = record.As<ThreadCreateExitInfo>();
+			out.Add(Field::ProcessId, info->ProcessId);
+			out.Add(Field::ThreadId, info->ThreadId);
+			out.Add(Field::Process, ProcessName(info->ProcessKey));
+			break;
+		}
+
+		case ItemType::ImageLoad:
+		{
+			auto info = record.As<ImageLoadInfo>();
+			auto name = GetString(record, info->ImageFileNameId, info->ImageFileNameOffset, info->ImageFileNameLength);
+			out.Add(Field::ProcessId, info->ProcessId);
+			out.Add(Field::Process, ProcessName(info->ProcessKey));
+			out.Add(Field::Image, name.Data, name.Length);
+			out.AddHex(Field::Address, info->LoadAddress);
+			break;
+		}
+
+		case ItemType::RegistrySetValue:
+		{
+			auto info = record.As<RegistrySetValueInfo>();
+			// data that does not fit the record is shown as empty
+			auto data = record.Data(info->DataOffset, info->DataLength);
+			USHORT dataLength = data ? info->DataLength : 0;
+			auto keyName = GetString(record, info->KeyNameId, info->KeyNameOffset, info->KeyNameLength);
+			out.Add(Field::ProcessId, info->ProcessId);
+			out.Add(Field::ThreadId, info->ThreadId);
+			out.Add(Field::Key, keyName.Data, keyName.Length);
+			auto valueName = record.Text(info->ValueNameOffset, info->ValueNameLength);
+			out.Add(Field::Name, valueName.Data, valueName.Length);
+			out.Add(Field::DataType, info->DataType);
+			out.Add(Field::DataSize, info->DataSize);
+			switch (info->DataType) {
+				case REG_DWORD:
+					if (dataLength >= sizeof(DWORD)) {
+						out.AddHex(Field::Data, *(const DWORD*)data);
+						break;
+					}
+					out.AddBinary(Field::Data, data, dataLength);
+					break;
+
+				case REG_SZ:
+				case REG_EXPAND_SZ:
+				{
+					// the data may not be NULL terminated
+					auto text = (const WCHAR*)data;
+					size_t length = dataLength / sizeof(WCHAR);
+					while (length && text[length - 1] == 0)
+						length--;
+					out.Add(Field::Data, text, length);
+					break;
+				}
+
+				default:
+					out.AddBinary(Field::Data, data, dataLength);
+					break;
 
-			case ItemType::ThreadCreate:
-			{
-				DisplayTime(header->Time);
-				auto info = (ThreadCreateExitInfo*)buffer;
-				printf("Thread %d Created in process %d\n", info->ThreadId, info->ProcessId);
-				break;
 			}
 
-			case ItemType::ThreadExit:
-			{
-				DisplayTime(header->Time);
-				auto info = (ThreadCreateExitInfo*)buffer;
-				printf("Thread %d Exited from process %d\n", info->ThreadId, info->ProcessId);
-				break;
+			break;
+		}
+
+		case ItemType::RegistryCreateKey:
+		case ItemType::RegistryDeleteKey:
+		case ItemType::RegistryDeleteValue:
+		case ItemType::RegistryRenameKey:
+		{
+			auto info = record.As<RegistryKeyInfo>();
+			auto keyName = GetString(record, info->KeyNameId, info->KeyNameOffset, info->KeyNameLength);
+			out.Add(Field::ProcessId, info->ProcessId);
+			out.Add(Field::ThreadId, info->ThreadId);
+			out.Add(Field::Key, keyName.Data, keyName.Length);
+			// the value name or the new key name
+			if (info->NameLength) {
+				auto name = record.Text(info->NameOffset, info->NameLength);
+				out.Add(Field::Name, name.Data, name.Length);
 			}
+			break;
+		}
 
-			case ItemType::ImageLoad:
-			{
-				DisplayTime(header->Time);
-				auto info = (ImageLoadInfo*)buffer;
-				printf("Image loaded into process %d at address 0x%p (%ws)\n", info->ProcessId, info->LoadAddress, info->ImageFileName);
-				break;
+		case ItemType::ThreadSummary:
+		{
+			auto info = record.As<ThreadSummaryInfo>();
+			out.Add(Field::ProcessId, info->ProcessId);
+			out.Add(Field::Process, ProcessName(info->ProcessKey));
+			out.Add(Field::Created, info->Created);
+			out.Add(Field::Exited, info->Exited);
+			out.Add(Field::Interval, info->IntervalMs);
+			break;
+		}
+
+		case ItemType::EventsLost:
+		{
+			auto info = record.As<EventsLostInfo>();
+			out.Add(Field::Count, info->Count);
+			break;
+		}
+
+		default:
+			break;
+	}
+	out.EndRecord();
+}
+
+void DisplayInfo(EventFormatter& out, const BYTE* buffer, DWORD size) {
+	RecordReader reader(buffer, size);
+	RecordView record;
+	while (reader.Next(record))
+		DisplayItem(out, record);
+	if (reader.Malformed()) {
+		out.Flush();
+		printf("Malformed record at offset %u, skipping %u bytes\n", (ULONG)reader.Offset(), (ULONG)(size - reader.Offset()));
+	}
+	// once per read, so output keeps up with a quiet system
+	out.Flush();
+}
+
+// returns the snapshot, or null on failure
+const ProcessSnapshot* GetProcesses(HANDLE hFile, std::vector<BYTE>& buffer) {
+	buffer.resize(1 << 20);
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_GET_PROCESSES, nullptr, 0, buffer.data(), (DWORD)buffer.size(), &bytes, nullptr))
+		return nullptr;
+	return (const ProcessSnapshot*)buffer.data();
+}
+
+void LoadProcesses(HANDLE hFile) {
+	std::vector<BYTE> buffer;
+	auto snapshot = GetProcesses(hFile, buffer);
+	if (snapshot == nullptr)
+		return;
+
+	auto entries = (const ProcessEntry*)(snapshot + 1);
+	for (ULONG i = 0; i < snapshot->Count; i++) {
+		auto& entry = entries[i];
+		g_Processes[entry.ProcessKey].assign((const WCHAR*)(buffer.data() + entry.ImageFileNameOffset), entry.ImageFileNameLength);
+	}
+}
+
+int DisplayProcesses(HANDLE hFile) {
+	std::vector<BYTE> buffer;
+	auto snapshot = GetProcesses(hFile, buffer);
+	if (snapshot == nullptr)
+		return Error("Failed to get processes");
+
+	printf("     PID     Key  Parent  Created       Image\n");
+	auto entries = (const ProcessEntry*)(snapshot + 1);
+	for (ULONG i = 0; i < snapshot->Count; i++) {
+		auto& entry = entries[i];
+		FILETIME local;
+		SYSTEMTIME st;
+		::FileTimeToLocalFileTime((const FILETIME*)&entry.CreateTime, &local);
+		::FileTimeToSystemTime(&local, &st);
+		printf("%8u %7u %7u  %02d:%02d:%02d.%03d  %.*ws\n", entry.ProcessId, entry.ProcessKey, entry.ParentProcessId,
+			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+			entry.ImageFileNameLength, (const WCHAR*)(buffer.data() + entry.ImageFileNameOffset));
+	}
+	if (snapshot->Total > snapshot->Count)
+		printf("(%u more not shown)\n", snapshot->Total - snapshot->Count);
+	printf("%u live processes started since the driver was loaded\n", snapshot->Total);
+	return 0;
+}
+
+int DisplayPoolStats(HANDLE hFile) {
+	PoolClassStats stats[16];
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_GET_POOL_STATS, nullptr, 0, stats, sizeof(stats), &bytes, nullptr))
+		return Error("Failed to get pool stats");
+
+	printf("Block size  Depth     Allocs     Misses    Hit %%      Frees     Misses\n");
+	for (DWORD i = 0; i < bytes / sizeof(PoolClassStats); i++) {
+		auto& s = stats[i];
+		if (s.BlockSize)
+			printf("%10u", s.BlockSize);
+		else
+			printf("  oversize");
+		printf(" %6u %10u %10u %7.1f%% %10u %10u\n", s.Depth, s.TotalAllocates, s.AllocateMisses,
+			s.TotalAllocates ? 100.0 * (s.TotalAllocates - s.AllocateMisses) / s.TotalAllocates : 0.0,
+			s.TotalFrees, s.FreeMisses);
+	}
+	return 0;
+}
+
+int SetReadBatching(HANDLE hFile, const char* minBytes, const char* maxDelayMs) {
+	ReadBatching batching;
+	batching.MinBytes = atoi(minBytes);
+	batching.MaxDelayMs = atoi(maxDelayMs);
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_SET_READ_BATCHING, &batching, sizeof(batching), nullptr, 0, &bytes, nullptr))
+		return Error("Failed to set read batching");
+	return 0;
+}
+
+int DisplayDropCounts(HANDLE hFile) {
+	DropCounts counts;
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_GET_DROP_COUNTS, nullptr, 0, &counts, sizeof(counts), &bytes, nullptr))
+		return Error("Failed to get drop counts");
+
+	printf("Dropped events: %u\n", counts.Total);
+	for (ULONG i = 0; i < MaxItemTypes; i++) {
+		if (counts.ByType[i])
+			printf("  %-20s %10u\n", ItemTypeName(i), counts.ByType[i]);
+	}
+	return 0;
+}
+
+bool GetStats(HANDLE hFile, SysMonStats& stats) {
+	DWORD bytes;
+	return ::DeviceIoControl(hFile, IOCTL_SYSMON_GET_STATS, nullptr, 0, &stats, sizeof(stats), &bytes, nullptr);
+}
+
+void DisplayHistogram(const CallbackStats& stats, double cyclesPerUsec) {
+	ULONG64 total = 0;
+	for (auto count : stats.Histogram)
+		total += count;
+	if (total == 0)
+		return;
+
+	for (ULONG i = 0; i < LatencyBuckets; i++) {
+		if (stats.Histogram[i] == 0)
+			continue;
+		// upper bound of the bucket, the last one is open ended
+		auto bound = double(1ULL << (i + LatencyBucketShift)) / cyclesPerUsec;
+		auto percent = 100.0 * stats.Histogram[i] / total;
+		if (i < LatencyBuckets - 1)
+			printf("    < %9.2f usec %12llu %6.2f%% ", bound, stats.Histogram[i], percent);
+		else
+			printf("    >=%9.2f usec %12llu %6.2f%% ", bound / 2, stats.Histogram[i], percent);
+		for (int bar = 0; bar < int(percent / 2); bar++)
+			printf("#");
+		printf("\n");
+	}
+}
+
+int DisplayStats(HANDLE hFile) {
+	static const char* names[] = { "Process", "Thread", "Image load", "Registry" };
+	static_assert(_countof(names) == (ULONG)CallbackKind::Count, "callback names");
+
+	SysMonStats prev;
+	if (!GetStats(hFile, prev))
+		return Error("Failed to get statistics");
+
+	// rates are per interval, histograms since the driver was loaded
+	for (;;) {
+		::Sleep(1000);
+		SysMonStats stats;
+		if (!GetStats(hFile, stats))
+			return Error("Failed to get statistics");
+
+		auto seconds = (stats.CollectTime - prev.CollectTime) / 10000000.0;
+		auto cyclesPerUsec = (stats.CollectCycles - prev.CollectCycles) / seconds / 1000000.0;
+
+		printf("\nCallback         Calls/sec   Avg usec  Alloc failures\n");
+		for (ULONG i = 0; i < (ULONG)CallbackKind::Count; i++) {
+			auto& now = stats.Callbacks[i];
+			auto& before = prev.Callbacks[i];
+			auto calls = now.Calls - before.Calls;
+			printf("%-12s %13.0f %10.2f %15llu\n", names[i], calls / seconds,
+				calls ? (now.Cycles - before.Cycles) / cyclesPerUsec / calls : 0.0,
+				now.AllocFailures - before.AllocFailures);
+			DisplayHistogram(now, cyclesPerUsec);
+		}
+
+		auto contentions = stats.MutexContentions - prev.MutexContentions;
+		printf("Reader mutex: %.0f acquires/sec, %.0f contended/sec, %.2f usec avg wait\n",
+			(stats.MutexAcquires - prev.MutexAcquires) / seconds, contentions / seconds,
+			contentions ? (stats.MutexWaitCycles - prev.MutexWaitCycles) / cyclesPerUsec / contentions : 0.0);
+		prev = stats;
+	}
+}
+
+int SetBufferPolicy(HANDLE hFile, int argc, const char* argv[]) {
+	BufferPolicy policy;
+	policy.CapacityBytes = atoi(argv[0]);
+	policy.Policy = OverflowPolicy::DropNewest;
+	policy.SampleRate = argc > 2 ? atoi(argv[2]) : 10;
+	if (argc > 1) {
+		if (::_stricmp(argv[1], "oldest") == 0)
+			policy.Policy = OverflowPolicy::DropOldest;
+		else if (::_stricmp(argv[1], "sample") == 0)
+			policy.Policy = OverflowPolicy::Sample;
+		else if (::_stricmp(argv[1], "newest") != 0) {
+			printf("Unknown overflow policy: %s\n", argv[1]);
+			return 1;
+		}
+	}
+
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_SET_BUFFER_POLICY, &policy, sizeof(policy), nullptr, 0, &bytes, nullptr))
+		return Error("Failed to set buffer policy");
+	return 0;
+}
+
+int SetThreadAggregation(HANDLE hFile, int argc, const char* argv[]) {
+	ThreadAggregation config = { 0 };
+	config.IntervalMs = atoi(argv[0]);
+	for (int i = 1; i < argc && config.WatchCount < MaxWatchPids; i++)
+		config.WatchPids[config.WatchCount++] = atoi(argv[i]);
+
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_SET_THREAD_AGGREGATION, &config, sizeof(config), nullptr, 0, &bytes, nullptr))
+		return Error("Failed to set thread aggregation");
+	return 0;
+}
+
+ULONG ParseEventTypes(const char* names) {
+	static const struct {
+		const char* Name;
+		ULONG Types;
+	} groups[] = {
+		{ "process", ItemTypeBit(ItemType::ProcessCreate) | ItemTypeBit(ItemType::ProcessExit) },
+		{ "thread", ItemTypeBit(ItemType::ThreadCreate) | ItemTypeBit(ItemType::ThreadExit) },
+		{ "image", ItemTypeBit(ItemType::ImageLoad) },
+		{ "registry", RegistryEventTypes },
+		{ "set", ItemTypeBit(ItemType::RegistrySetValue) },
+		{ "create", ItemTypeBit(ItemType::RegistryCreateKey) },
+		{ "delete", ItemTypeBit(ItemType::RegistryDeleteKey) },
+		{ "deletevalue", ItemTypeBit(ItemType::RegistryDeleteValue) },
+		{ "rename", ItemTypeBit(ItemType::RegistryRenameKey) },
+	};
+
+	ULONG types = 0;
+	std::string list(names);
+	size_t start = 0;
+	while (start <= list.size()) {
+		auto end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		auto name = list.substr(start, end - start);
+		for (auto& group : groups)
+			if (::_stricmp(name.c_str(), group.Name) == 0)
+				types |= group.Types;
+		start = end + 1;
+	}
+	return types;
+}
+
+int SetRegistryRules(HANDLE hFile, int argc, const char* argv[]) {
+	auto rules = std::make_unique<RegistryRules>();
+	::memset(rules.get(), 0, sizeof(RegistryRules));
+	rules->EventTypes = DefaultRegistryEventTypes;
+	for (int i = 0; i + 1 < argc; i += 2) {
+		auto option = argv[i], value = argv[i + 1];
+		if (::_stricmp(option, "-types") == 0)
+			rules->EventTypes = ParseEventTypes(value) & RegistryEventTypes;
+		else if (::_stricmp(option, "-key") == 0 && rules->KeyPrefixCount < MaxRegistryKeyPrefixes)
+			::MultiByteToWideChar(CP_ACP, 0, value, -1, rules->KeyPrefixes[rules->KeyPrefixCount++], MaxRegistryRuleName - 1);
+		else if (::_stricmp(option, "-value") == 0 && rules->ValueNameCount < MaxRegistryValueNames)
+			::MultiByteToWideChar(CP_ACP, 0, value, -1, rules->ValueNames[rules->ValueNameCount++], MaxRegistryRuleName - 1);
+		else {
+			printf("Unknown registry option: %s\n", option);
+			return 1;
+		}
+	}
+
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_SET_REGISTRY_RULES, rules.get(), sizeof(RegistryRules), nullptr, 0, &bytes, nullptr))
+		return Error("Failed to set registry rules");
+	printf("Registry rules set\n");
+	return 0;
+}
+
+int SetFilter(HANDLE hFile, int argc, const char* argv[]) {
+	DWORD bytes;
+	if (argc == 0) {
+		if (!::DeviceIoControl(hFile, IOCTL_SYSMON_SET_FILTER, nullptr, 0, nullptr, 0, &bytes, nullptr))
+			return Error("Failed to clear filter");
+		printf("Filter cleared\n");
+		return 0;
+	}
+
+	FilterRules rules = { 0 };
+	for (int i = 0; i + 1 < argc; i += 2) {
+		auto option = argv[i], value = argv[i + 1];
+		if (::_stricmp(option, "-types") == 0)
+			rules.EventTypes = ParseEventTypes(value);
+		else if (::_stricmp(option, "-pid") == 0 && rules.IncludeCount < MaxFilterPids)
+			rules.IncludePids[rules.IncludeCount++] = atoi(value);
+		else if (::_stricmp(option, "-xpid") == 0 && rules.ExcludeCount < MaxFilterPids)
+			rules.ExcludePids[rules.ExcludeCount++] = atoi(value);
+		else if (::_stricmp(option, "-parent") == 0)
+			rules.ParentProcessId = atoi(value);
+		else if (::_stricmp(option, "-image") == 0)
+			::MultiByteToWideChar(CP_ACP, 0, value, -1, rules.ImagePrefix, MaxFilterPrefix - 1);
+		else {
+			printf("Unknown filter option: %s\n", option);
+			return 1;
+		}
+	}
+
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_SET_FILTER, &rules, sizeof(rules), nullptr, 0, &bytes, nullptr))
+		return Error("Failed to set filter");
+	printf("Filter set\n");
+	return 0;
+}
+
+int ReadSharedChannel(HANDLE hFile, OutputFormat format) {
+	auto hEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	if (!hEvent)
+		return Error("Failed to create event");
+
+	MapChannelRequest request;
+	request.Size = 1 << 22;
+	request.Event = hEvent;
+	SharedChannelHeader* header;
+	DWORD bytes;
+	if (!::DeviceIoControl(hFile, IOCTL_SYSMON_MAP_CHANNEL, &request, sizeof(request), &header, sizeof(header), &bytes, nullptr))
+		return Error("Failed to map channel");
+
+	EventFormatter out(format, ::GetStdHandle(STD_OUTPUT_HANDLE));
+	auto data = (const BYTE*)(header + 1);
+	auto mask = header->DataSize - 1;
+	auto consumer = header->ConsumerOffset;
+
+	while (true) {
+		auto producer = header->ProducerOffset;
+		if (producer == consumer) {
+			// nothing to read - ask the driver to wake us, then check once more
+			::InterlockedExchange((volatile LONG*)&header->WaitingForData, 1);
+			if (header->ProducerOffset == consumer)
+				::WaitForSingleObject(hEvent, INFINITE);
+			header->WaitingForData = 0;
+			continue;
+		}
+
+		// records are read in place, up to the end of the record area at a time
+		while (consumer != producer) {
+			auto pos = consumer & mask;
+			RecordReader reader(data + pos, min(producer - consumer, header->DataSize - pos), SharedRecordAlignment);
+			RecordView record;
+			while (reader.Next(record)) {
+				if (record.Type() != ItemType::None)
+					DisplayItem(out, record);
+			}
+			consumer += (ULONG)reader.Offset();
+			if (reader.Malformed()) {
+				// no way to find the next record, drop everything written so far
+				out.Flush();
+				printf("Malformed record in the shared channel, skipping %u bytes\n", producer - consumer);
+				consumer = producer;
 			}
+		}
+		out.Flush();
+		::InterlockedExchange((volatile LONG*)&header->ConsumerOffset, consumer);
+	}
+}
 
-			case ItemType::RegistrySetValue:
-			{
-				DisplayTime(header->Time);
-				auto info = (RegistrySetValueInfo*)buffer;
-				printf("Registry write PID=%d: %ws\\%ws type: %d size: %d data: ", info->ProcessId, 
-					info->KeyName, info->ValueName, info->DataType, info->DataSize);
-				switch (info->DataType) {
-					case REG_DWORD:
-						printf("0x%08X\n", *(DWORD*)info->Data);
-						break;
+//
+// overlapped reader: an I/O thread keeps several reads pending on a completion port,
+// a decode thread formats the completed buffers. A slow console then only uses up
+// spare buffers instead of leaving the driver without a pending read.
+//
 
-					case REG_SZ:
-					case REG_EXPAND_SZ:
-						printf("%ws\n", (WCHAR*)info->Data);
-						break;
+struct ReadBuffer {
+	OVERLAPPED Overlapped;
+	ULONG64 Sequence;	// order in which the read was issued
+	DWORD Bytes;
+	BYTE Data[1 << 16];
+};
 
-					case REG_BINARY:
-						DisplayBinary(info->Data, min(info->DataSize, sizeof(info->Data)));
-						break;
+class EventReader {
+public:
+	// called on the decode thread with each buffer of records
+	using Sink = std::function<bool(const BYTE*, DWORD)>;
 
-					default:
-						DisplayBinary(info->Data, min(info->DataSize, sizeof(info->Data)));
-						break;
+	EventReader(HANDLE hDevice, int reads, Sink sink) : _hDevice(hDevice), _reads(reads), _sink(sink) {}
 
-				}
+	// may be called from any thread
+	void Stop() {
+		::PostQueuedCompletionStatus(_port, 0, StopKey, nullptr);
+	}
+
+	int Run() {
+		_port = ::CreateIoCompletionPort(_hDevice, nullptr, ReadKey, 1);
+		if (!_port)
+			return Error("Failed to create completion port");
+
+		// twice as many buffers as reads, so decoding can lag behind a little
+		for (int i = 0; i < _reads * 2; i++) {
+			_buffers.push_back(std::make_unique<ReadBuffer>());
+			_free.push_back(_buffers.back().get());
+		}
+
+		std::thread decoder([this] { Decode(); });
+		auto result = ReadLoop();
+		Cancel();
 
-				break;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_done = true;
+		}
+		_ready.notify_one();
+		decoder.join();
+		::CloseHandle(_port);
+		return result;
+	}
+
+private:
+	enum : ULONG_PTR {
+		ReadKey,		// a read has completed
+		FreedKey,		// the decoder is done with a buffer
+		StopKey
+	};
+
+	int ReadLoop() {
+		for (;;) {
+			// keep the driver supplied with reads as long as there are free buffers
+			while (_pending < _reads && !_free.empty()) {
+				auto buffer = _free.back();
+				_free.pop_back();
+				::memset(&buffer->Overlapped, 0, sizeof(buffer->Overlapped));
+				buffer->Sequence = _issued++;
+				if (!::ReadFile(_hDevice, buffer->Data, sizeof(buffer->Data), nullptr, &buffer->Overlapped) &&
+					::GetLastError() != ERROR_IO_PENDING)
+					return Error("Failed to read");
+				_pending++;
 			}
 
-			default:
-				break;
+			DWORD bytes;
+			ULONG_PTR key;
+			OVERLAPPED* ov;
+			auto ok = ::GetQueuedCompletionStatus(_port, &bytes, &key, &ov, INFINITE);
+			if (key == StopKey)
+				return 0;
+			if (ov == nullptr)
+				return Error("Failed to wait for reads");
+
+			auto buffer = CONTAINING_RECORD(ov, ReadBuffer, Overlapped);
+			if (key == FreedKey) {
+				_free.push_back(buffer);
+				continue;
+			}
+
+			_pending--;
+			if (!ok)
+				return Error("Failed to read");
+
+			buffer->Bytes = bytes;
+			Completed(buffer);
+		}
+	}
+
+	// the buffers of reads still pending must not go away before the reads do
+	void Cancel() {
+		::CancelIoEx(_hDevice, nullptr);
+		while (_pending > 0) {
+			DWORD bytes;
+			ULONG_PTR key;
+			OVERLAPPED* ov;
+			::GetQueuedCompletionStatus(_port, &bytes, &key, &ov, INFINITE);
+			if (ov && key == ReadKey)
+				_pending--;
+		}
+	}
+
+	void Completed(ReadBuffer* buffer) {
+		// the driver fills reads in the order they were issued, hand them on in that order
+		_completed[buffer->Sequence] = buffer;
+		std::lock_guard<std::mutex> lock(_lock);
+		for (auto it = _completed.begin(); it != _completed.end() && it->first == _delivered; it = _completed.erase(it)) {
+			_queue.push_back(it->second);
+			_delivered++;
+		}
+		_ready.notify_one();
+	}
+
+	void Decode() {
+		for (;;) {
+			ReadBuffer* buffer;
+			{
+				std::unique_lock<std::mutex> lock(_lock);
+				_ready.wait(lock, [this] { return _done || !_queue.empty(); });
+				if (_queue.empty())
+					return;
+				buffer = _queue.front();
+				_queue.pop_front();
+			}
+
+			if (buffer->Bytes && !_sink(buffer->Data, buffer->Bytes)) {
+				Stop();
+				return;
+			}
+			// only the I/O thread issues reads and touches the free list
+			::PostQueuedCompletionStatus(_port, 0, FreedKey, &buffer->Overlapped);
 		}
-		buffer += header->Size;
-		count -= header->Size;
 	}
 
+private:
+	HANDLE _hDevice;
+	HANDLE _port = nullptr;
+	int _reads;
+	Sink _sink;
+	std::vector<std::unique_ptr<ReadBuffer>> _buffers;
+
+	// I/O thread only
+	std::vector<ReadBuffer*> _free;
+	int _pending = 0;
+	std::map<ULONG64, ReadBuffer*> _completed;
+	ULONG64 _issued = 0;
+	ULONG64 _delivered = 0;
+
+	// shared with the decode thread
+	std::mutex _lock;
+	std::condition_variable _ready;
+	std::deque<ReadBuffer*> _queue;
+	bool _done = false;
+};
+
+EventReader* g_Reader;
+
+BOOL WINAPI OnConsoleCtrl(DWORD) {
+	// let the reader finish what it has, so a capture file is closed properly
+	if (g_Reader)
+		g_Reader->Stop();
+	return TRUE;
 }
 
-int main() {
-	auto hFile = ::CreateFile(L"\\\\.\\SysMon", GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+int ReadEvents(HANDLE hFile, int reads, EventReader::Sink sink) {
+	// reopen for overlapped I/O; events queued meanwhile are kept for the new handle
+	::CloseHandle(hFile);
+	hFile = ::CreateFile(L"\\\\.\\SysMon", GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
 	if (hFile == INVALID_HANDLE_VALUE)
 		return Error("Failed to open file");
+	g_hDevice = hFile;
 
-	BYTE buffer[1 << 16];
+	EventReader reader(hFile, reads, sink);
+	g_Reader = &reader;
+	::SetConsoleCtrlHandler(OnConsoleCtrl, TRUE);
+	auto result = reader.Run();
+	g_Reader = nullptr;
+	return result;
+}
 
-	while (true) {
-		DWORD bytes;
-		if (!::ReadFile(hFile, buffer, sizeof(buffer), &bytes, nullptr))
-			return Error("Failed to read");
+int DisplayEvents(HANDLE hFile, int reads, OutputFormat format) {
+	// names of processes started before we did
+	LoadProcesses(hFile);
+
+	EventFormatter out(format, ::GetStdHandle(STD_OUTPUT_HANDLE));
+	return ReadEvents(hFile, reads, [&](const BYTE* buffer, DWORD size) {
+		DisplayInfo(out, buffer, size);
+		return true;
+	});
+}
 
-		if (bytes != 0)
-			DisplayInfo(buffer, bytes);
+int Capture(HANDLE hFile, const char* path, ULONG chunkSize) {
+	std::wstring name(path, path + ::strlen(path));
+	CaptureWriter writer([](ULONG id) { return GetString(id); });
+	if (!writer.Open(name.c_str(), chunkSize))
+		return Error("Failed to create capture file");
 
-		::Sleep(200);
+	printf("Capturing to %s, Ctrl+C to stop\n", path);
+	auto result = ReadEvents(hFile, 4, [&](const BYTE* buffer, DWORD size) {
+		if (writer.Write(buffer, size))
+			return true;
+		Error("Failed to write capture file");
+		return false;
+	});
+
+	if (!writer.Close())
+		return Error("Failed to close capture file");
+	printf("%llu records captured\n", writer.GetRecordCount());
+	return result;
+}
+
+int main(int argc, const char* argv[]) {
+	auto hFile = ::CreateFile(L"\\\\.\\SysMon", GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return Error("Failed to open file");
+	g_hDevice = hFile;
+
+	// event output format, ahead of the command
+	auto format = OutputFormat::Text;
+	if (argc > 2 && ::_stricmp(argv[1], "-format") == 0) {
+		if (::_stricmp(argv[2], "json") == 0)
+			format = OutputFormat::Json;
+		else if (::_stricmp(argv[2], "csv") == 0)
+			format = OutputFormat::Csv;
+		else if (::_stricmp(argv[2], "text") != 0) {
+			printf("Unknown output format: %s\n", argv[2]);
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
 	}
+
+	if (argc > 1) {
+		if (::_stricmp(argv[1], "pools") == 0)
+			return DisplayPoolStats(hFile);
+		if (::_stricmp(argv[1], "processes") == 0)
+			return DisplayProcesses(hFile);
+		if (::_stricmp(argv[1], "read") == 0 && argc > 2 && atoi(argv[2]) > 0)
+			return DisplayEvents(hFile, atoi(argv[2]), format);
+		if (::_stricmp(argv[1], "capture") == 0 && argc > 2)
+			return Capture(hFile, argv[2], argc > 3 ? atoi(argv[3]) << 10 : DefaultCaptureChunkSize);
+		if (::_stricmp(argv[1], "batch") == 0 && argc > 3)
+			return SetReadBatching(hFile, argv[2], argv[3]);
+		if (::_stricmp(argv[1], "shared") == 0)
+			return ReadSharedChannel(hFile, format);
+		if (::_stricmp(argv[1], "filter") == 0)
+			return SetFilter(hFile, argc - 2, argv + 2);
+		if (::_stricmp(argv[1], "registry") == 0)
+			return SetRegistryRules(hFile, argc - 2, argv + 2);
+		if (::_stricmp(argv[1], "threads") == 0 && argc > 2)
+			return SetThreadAggregation(hFile, argc - 2, argv + 2);
+		if (::_stricmp(argv[1], "drops") == 0)
+			return DisplayDropCounts(hFile);
+		if (::_stricmp(argv[1], "stats") == 0)
+			return DisplayStats(hFile);
+		if (::_stricmp(argv[1], "buffer") == 0 && argc > 2)
+			return SetBufferPolicy(hFile, argc - 2, argv + 2);
+
+		printf("Usage: SysMonClient [-format text | json | csv] [command]\n");
+		printf("Commands: [read <pending reads> | capture <file> [chunk KB] | pools | processes |\n");
+		printf("          batch <min bytes> <max delay msec> | shared | drops | stats |\n");
+		printf("          buffer <bytes> [newest | oldest | sample [rate]] |\n");
+		printf("          threads <interval msec, 0 for off> [watched pid...] |\n");
+		printf("          filter [options] | registry [options]]\n");
+		printf("Filter options (no options clears the filter):\n");
+		printf("  -types process,thread,image,registry\n");
+		printf("  -pid <pid>        capture this process (repeatable)\n");
+		printf("  -xpid <pid>       ignore this process (repeatable)\n");
+		printf("  -parent <pid>     capture process creation by this parent only\n");
+		printf("  -image <prefix>   NT path prefix for process creation and image loads\n");
+		printf("Registry options (no options restores HKLM value writes):\n");
+		printf("  -types set,create,delete,deletevalue,rename\n");
+		printf("  -key <prefix>     full key path prefix, e.g. \\REGISTRY\\MACHINE\\SOFTWARE (repeatable)\n");
+		printf("  -value <name>     capture writes and deletes of this value only (repeatable)\n");
+		return 1;
+	}
+
+	return DisplayEvents(hFile, 4, format);
 }
 
@@ -11,5 +11,6 @@
 
 #include <Windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #endif //PCH_H
@@ -0,0 +1,356 @@
+// SysMonHostBench.cpp : runs SysMon's notification callbacks, event queue and read path on a Linux host,
+// built against the user-mode stand-in in ntddk.h, and measures event throughput and callback latency.
+//
+// Synthetic processes are created on each producer thread: every process loads images and creates and
+// exits threads before it exits itself. A delivery thread reads the events the way the driver's read path does.
+//
+// Build from this directory (one command line; -fms-extensions accepts members named after their type):
+//   g++ -std=c++17 -O2 -pthread -fms-extensions -Wno-multichar -I. SysMonHostBench.cpp
+//     ../SysMon/Callbacks.cpp ../SysMon/EventQueue.cpp ../SysMon/Memory.cpp ../SysMon/FastMutex.cpp
+//     ../SysMon/PushLock.cpp ../SysMon/Stats.cpp ../SysMon/Filter.cpp ../SysMon/StringTable.cpp
+//     ../SysMon/ProcessTable.cpp ../SysMon/ThreadAggregator.cpp -o sysmonhostbench
+//
+// Usage: sysmonhostbench [seconds per step] [max producers]
+//
+
+#include "ntddk.h"
+#include "../SysMon/SysMon.h"
+#include "../SysMon/AutoLock.h"
+#include <pthread.h>
+#include <chrono>
+
+void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo);
+void OnThreadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create);
+void OnImageLoadNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo);
+
+Globals g_Globals;
+
+const int ThreadsPerProcess = 8;
+const int ImagesPerProcess = 16;
+const int ImageNames = 64;
+const int ProcessImageNames = 32;
+
+//
+// the benchmark's delivery thread stands in for the driver's ReadQueue
+//
+
+std::mutex g_WakeLock;
+std::condition_variable g_Wake;
+std::atomic<bool> g_ReaderWaiting;
+
+void ReadQueue::NotifyPush() {
+	// like the driver's, cheap unless the reader is waiting
+	if (g_ReaderWaiting.load(std::memory_order_relaxed))
+		g_Wake.notify_one();
+}
+
+void ReadQueue::Wake() {
+	g_Wake.notify_one();
+}
+
+// no shared channels on the host, so the process exit callback never unmaps one
+volatile LONG SharedChannel::_mappedCount;
+
+void SharedChannel::Unmap() {
+}
+
+// callback latencies in cycles, 16 buckets per power of 2
+class LatencyHistogram {
+public:
+	void Add(ULONG64 cycles) {
+		_counts[Bucket(cycles)]++;
+		_total++;
+	}
+
+	void Merge(const LatencyHistogram& other) {
+		for (int i = 0; i < Buckets; i++)
+			_counts[i] += other._counts[i];
+		_total += other._total;
+	}
+
+	// the lower bound of the bucket holding the given fraction of calls
+	ULONG64 Percentile(double fraction) const {
+		auto target = (ULONG64)(fraction * _total);
+		ULONG64 count = 0;
+		for (int i = 0; i < Buckets; i++) {
+			count += _counts[i];
+			if (count > target)
+				return LowerBound(i);
+		}
+		return 0;
+	}
+
+private:
+	static const int SubBits = 4;
+	static const int Buckets = 64 << SubBits;
+
+	static int Bucket(ULONG64 cycles) {
+		if (cycles < (1 << SubBits))
+			return (int)cycles;
+		int msb = 63 - __builtin_clzll(cycles);
+		return ((msb - SubBits + 1) << SubBits) + (int)((cycles >> (msb - SubBits)) & ((1 << SubBits) - 1));
+	}
+
+	static ULONG64 LowerBound(int bucket) {
+		if (bucket < (1 << SubBits))
+			return bucket;
+		int msb = (bucket >> SubBits) + SubBits - 1;
+		return (ULONG64)((1 << SubBits) + (bucket & ((1 << SubBits) - 1))) << (msb - SubBits);
+	}
+
+private:
+	ULONG64 _counts[Buckets] = { 0 };
+	ULONG64 _total = 0;
+};
+
+struct Producer {
+	ULONG Cpu;
+	ULONG64 Calls = 0;
+	LatencyHistogram Latency;
+};
+
+struct Reader {
+	ULONG64 Events = 0;		// not counting markers and string definitions
+	ULONG64 Lost = 0;
+	ULONG64 Bytes = 0;
+};
+
+struct Names {
+	std::vector<std::wstring> Images;
+	std::vector<std::wstring> Processes;
+	std::wstring CommandLine;
+};
+
+UNICODE_STRING MakeString(const std::wstring& text) {
+	UNICODE_STRING str;
+	str.Buffer = (PWSTR)text.c_str();
+	str.Length = (USHORT)(text.size() * sizeof(WCHAR));
+	str.MaximumLength = str.Length;
+	return str;
+}
+
+void PinThread(ULONG core) {
+	auto cores = std::thread::hardware_concurrency();
+	if (cores == 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % cores, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+template<typename F>
+void Timed(Producer& producer, F f) {
+	auto start = __rdtsc();
+	f();
+	producer.Latency.Add(__rdtsc() - start);
+	producer.Calls++;
+}
+
+void ProducerThread(Producer& producer, const Names& names, const std::atomic<bool>& stop) {
+	ShimSetCurrentProcessor(producer.Cpu);
+	PinThread(producer.Cpu + 1);
+
+	// each producer has its own PID range, and one live process at a time
+	ULONG pidBase = (producer.Cpu + 1) << 20;
+	ULONG sequence = 0;
+	auto commandLine = MakeString(names.CommandLine);
+
+	while (!stop.load(std::memory_order_relaxed)) {
+		auto pid = pidBase + ((sequence++ & 0xFFFF) << 2);
+		auto image = MakeString(names.Processes[sequence % ProcessImageNames]);
+
+		PS_CREATE_NOTIFY_INFO createInfo = { 0 };
+		createInfo.Size = sizeof(createInfo);
+		createInfo.ParentProcessId = ULongToHandle(4);
+		createInfo.ImageFileName = &image;
+		createInfo.CommandLine = &commandLine;
+		Timed(producer, [&] { OnProcessNotify(nullptr, ULongToHandle(pid), &createInfo); });
+
+		for (int i = 0; i < ImagesPerProcess; i++) {
+			auto name = MakeString(names.Images[(sequence + i) % ImageNames]);
+			IMAGE_INFO info = { 0 };
+			info.ImageBase = (PVOID)(0x7FF800000000ULL + ((ULONG64)i << 24));
+			info.ImageSize = 1 << 20;
+			Timed(producer, [&] { OnImageLoadNotify(&name, ULongToHandle(pid), &info); });
+		}
+
+		for (int i = 0; i < ThreadsPerProcess; i++) {
+			auto tid = ULongToHandle(pid + 4 + i * 4);
+			Timed(producer, [&] { OnThreadNotify(ULongToHandle(pid), tid, TRUE); });
+			Timed(producer, [&] { OnThreadNotify(ULongToHandle(pid), tid, FALSE); });
+		}
+
+		Timed(producer, [&] { OnProcessNotify(nullptr, ULongToHandle(pid), nullptr); });
+	}
+}
+
+// reads until stopped and nothing is left
+void ReaderThread(Reader& reader, Consumer* consumer, ULONG cpu, const std::atomic<bool>& stop) {
+	ShimSetCurrentProcessor(cpu);
+	PinThread(0);
+	static UCHAR buffer[1 << 16];
+
+	for (;;) {
+		ULONG bytes;
+		{
+			AutoLock locker(g_Globals.Mutex);
+			g_Globals.Queue.Trim();
+			bytes = g_Globals.Queue.Read(consumer, buffer, sizeof(buffer));
+			g_Globals.Queue.Reclaim();
+		}
+
+		if (bytes == 0) {
+			if (stop.load())
+				break;
+			// the producers wake us once we say we are waiting; the timeout covers a wake-up lost in between
+			std::unique_lock<std::mutex> lock(g_WakeLock);
+			g_ReaderWaiting = true;
+			g_Wake.wait_for(lock, std::chrono::milliseconds(1));
+			g_ReaderWaiting = false;
+			continue;
+		}
+
+		// walk the records like a client would
+		reader.Bytes += bytes;
+		for (ULONG offset = 0; offset < bytes; ) {
+			auto header = (const ItemHeader*)(buffer + offset);
+			if (header->Type == ItemType::EventsLost)
+				reader.Lost += ((const EventsLostInfo*)header)->Count;
+			else if (header->Type != ItemType::StringDefinition)
+				reader.Events++;
+			offset += header->Size;
+		}
+	}
+}
+
+void RunStep(int producers, ULONG readerCpu, int seconds, const Names& names) {
+	Consumer* consumer;
+	{
+		AutoLock locker(g_Globals.Mutex);
+		consumer = g_Globals.Queue.AddConsumer(nullptr);
+	}
+	if (consumer == nullptr) {
+		printf("Failed to add consumer\n");
+		return;
+	}
+
+	std::atomic<bool> stopProducers(false), stopReader(false);
+	Reader reader;
+	std::vector<Producer> state(producers);
+	std::vector<std::thread> threads;
+
+	auto startTime = std::chrono::steady_clock::now();
+	auto startCycles = __rdtsc();
+	std::thread readerThread(ReaderThread, std::ref(reader), consumer, readerCpu, std::cref(stopReader));
+	for (int i = 0; i < producers; i++) {
+		state[i].Cpu = i;
+		threads.emplace_back(ProducerThread, std::ref(state[i]), std::cref(names), std::cref(stopProducers));
+	}
+
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	stopProducers = true;
+	for (auto& t : threads)
+		t.join();
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	auto cyclesPerNsec = (__rdtsc() - startCycles) / elapsed / 1e9;
+
+	// let the reader catch up with what was pushed before the producers stopped
+	stopReader = true;
+	g_Globals.Reads.Wake();
+	readerThread.join();
+
+	{
+		AutoLock locker(g_Globals.Mutex);
+		g_Globals.Queue.RemoveConsumer(consumer);
+		ExFreePool(consumer);
+	}
+
+	ULONG64 calls = 0;
+	LatencyHistogram latency;
+	for (auto& p : state) {
+		calls += p.Calls;
+		latency.Merge(p.Latency);
+	}
+
+	auto pushed = reader.Events + reader.Lost;
+	printf("%9d %14.0f %14.0f %14.0f %8.2f%% %9.1f %8.0f %8.0f %9.0f\n", producers,
+		calls / elapsed, pushed / elapsed, reader.Events / elapsed,
+		pushed ? 100.0 * reader.Lost / pushed : 0.0, reader.Bytes / elapsed / (1 << 20),
+		latency.Percentile(0.5) / cyclesPerNsec, latency.Percentile(0.99) / cyclesPerNsec,
+		latency.Percentile(0.999) / cyclesPerNsec);
+}
+
+NTSTATUS Init() {
+	auto status = g_Globals.Stats.Init();
+	if (!NT_SUCCESS(status))
+		return status;
+	status = g_Globals.Queue.Init();
+	if (!NT_SUCCESS(status))
+		return status;
+	status = g_Globals.Allocator.Init();
+	if (!NT_SUCCESS(status))
+		return status;
+	g_Globals.Mutex.Init();
+	g_Globals.Filter.Init();
+	status = g_Globals.Aggregator.Init();
+	if (!NT_SUCCESS(status))
+		return status;
+	status = g_Globals.Strings.Init();
+	if (!NT_SUCCESS(status))
+		return status;
+	return g_Globals.Processes.Init();
+}
+
+void Term() {
+	g_Globals.Aggregator.Term();
+	g_Globals.Queue.Drain();
+	g_Globals.Processes.Term();
+	g_Globals.Strings.Term();
+	g_Globals.Queue.Term();
+	g_Globals.Allocator.Term();
+	g_Globals.Stats.Term();
+}
+
+int main(int argc, const char* argv[]) {
+	int seconds = argc > 1 ? atoi(argv[1]) : 5;
+	if (seconds <= 0)
+		seconds = 5;
+	// one core is left for the reader
+	int maxProducers = argc > 2 ? atoi(argv[2]) : max((int)std::thread::hardware_concurrency() - 1, 1);
+	if (maxProducers <= 0)
+		maxProducers = 1;
+
+	// a processor for every producer and one for the reader
+	ShimSetProcessorCount(maxProducers + 1);
+	ShimSetCurrentProcessor(maxProducers);
+	if (!NT_SUCCESS(Init())) {
+		printf("Failed to initialize\n");
+		return 1;
+	}
+
+	Names names;
+	WCHAR text[128];
+	for (int i = 0; i < ImageNames; i++) {
+		swprintf(text, ARRAYSIZE(text), L"\\Device\\HarddiskVolume3\\Windows\\System32\\module%02d.dll", i);
+		names.Images.push_back(text);
+	}
+	for (int i = 0; i < ProcessImageNames; i++) {
+		swprintf(text, ARRAYSIZE(text), L"\\Device\\HarddiskVolume3\\Program Files\\App\\app%02d.exe", i);
+		names.Processes.push_back(text);
+	}
+	names.CommandLine = L"\"C:\\Program Files\\App\\app.exe\" --type=renderer --lang=en-US --enable-features=A,B,C";
+
+	printf("%d sec per step, %d images and %d threads per process\n", seconds, ImagesPerProcess, ThreadsPerProcess);
+	printf("Producers  callbacks/sec     events/sec   received/sec    dropped    MB/sec   p50 ns   p99 ns  p99.9 ns\n");
+	for (int producers = 1; ; producers *= 2) {
+		if (producers > maxProducers)
+			producers = maxProducers;
+		RunStep(producers, maxProducers, seconds, names);
+		if (producers == maxProducers)
+			break;
+	}
+
+	Term();
+	return 0;
+}
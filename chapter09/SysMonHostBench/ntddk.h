@@ -0,0 +1,610 @@
+#pragma once
+
+//
+// user-mode stand-in for the parts of the WDK used by SysMon's event pipeline, so that the
+// callbacks, filter, tables, allocator and event queue build and run on a Linux host.
+// ProcessProtect's policy builds against it as well.
+// The driver's pch.h includes <ntddk.h>, which finds this file when it is on the include path.
+//
+// Each benchmark thread acts as a processor of its own (see ShimSetCurrentProcessor):
+// raising to DISPATCH_LEVEL does nothing, since no other thread ever runs on "its" processor.
+// WCHAR is the host's wchar_t, so records carry 4-byte characters here.
+// Only what the pipeline needs is implemented; timers never fire.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <time.h>
+#include <assert.h>
+#include <new>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+#include <x86intrin.h>
+
+typedef uint8_t UCHAR, *PUCHAR, BOOLEAN;
+typedef int16_t SHORT, CSHORT;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG, NTSTATUS;
+typedef uint32_t ULONG, *PULONG, ACCESS_MASK;
+typedef int64_t LONGLONG, LONG64;
+typedef uint64_t ULONGLONG, ULONG64;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef char CHAR, CCHAR;
+typedef wchar_t WCHAR, *PWSTR, *PWCH;
+typedef const wchar_t* PCWSTR;
+typedef void* PVOID;
+typedef void* HANDLE;
+typedef UCHAR KIRQL;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXULONG 0xffffffffUL
+#define MAXUSHORT 0xffff
+#define MAXLONG 0x7fffffffL
+
+#define STATUS_SUCCESS					((NTSTATUS)0)
+#define STATUS_PENDING					((NTSTATUS)0x00000103L)
+#define STATUS_NOT_FOUND				((NTSTATUS)0xC0000225L)
+#define STATUS_INVALID_PARAMETER		((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009AL)
+#define STATUS_BUFFER_TOO_SMALL			((NTSTATUS)0xC0000023L)
+#define STATUS_NOT_SUPPORTED			((NTSTATUS)0xC00000BBL)
+#define STATUS_TOO_MANY_CONTEXT_IDS		((NTSTATUS)0xC000015AL)
+#define NT_SUCCESS(status) ((NTSTATUS)(status) >= 0)
+
+#define KdPrint(args)
+#define NT_ASSERT(expr) assert(expr)
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define DECLSPEC_CACHEALIGN alignas(64)
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+#define CTL_CODE(type, function, method, access) (((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+#define METHOD_BUFFERED 0
+#define METHOD_NEITHER 3
+#define FILE_ANY_ACCESS 0
+
+inline ULONG HandleToULong(HANDLE h) {
+	return (ULONG)(ULONG_PTR)h;
+}
+
+inline HANDLE ULongToHandle(ULONG value) {
+	return (HANDLE)(ULONG_PTR)value;
+}
+
+//
+// processors and IRQL
+//
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+#define DISPATCH_LEVEL 2
+
+struct PROCESSOR_NUMBER {
+	USHORT Group;
+	UCHAR Number;
+	UCHAR Reserved;
+};
+typedef PROCESSOR_NUMBER* PPROCESSOR_NUMBER;
+
+inline ULONG g_ShimProcessorCount = 1;
+inline thread_local ULONG g_ShimCurrentProcessor;
+
+// must be called before the queue and statistics are initialized
+inline void ShimSetProcessorCount(ULONG count) {
+	g_ShimProcessorCount = count;
+}
+
+// every thread that calls into the pipeline needs a processor number no other thread uses
+inline void ShimSetCurrentProcessor(ULONG number) {
+	g_ShimCurrentProcessor = number;
+}
+
+inline ULONG KeQueryMaximumProcessorCountEx(USHORT) {
+	return g_ShimProcessorCount;
+}
+
+inline ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER) {
+	return g_ShimCurrentProcessor;
+}
+
+inline KIRQL KeRaiseIrqlToDpcLevel() {
+	return 0;
+}
+
+inline void KeLowerIrql(KIRQL) {}
+inline void KeEnterCriticalRegion() {}
+inline void KeLeaveCriticalRegion() {}
+
+//
+// time
+//
+
+inline void KeQuerySystemTimePrecise(PLARGE_INTEGER time) {
+	// 100nsec units since 1601
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time->QuadPart = (ts.tv_sec + 11644473600LL) * 10000000 + ts.tv_nsec / 100;
+}
+
+inline ULONGLONG KeQueryInterruptTime() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 10000000ULL + ts.tv_nsec / 100;
+}
+
+inline BOOLEAN _BitScanReverse64(ULONG* index, ULONG64 mask) {
+	if (mask == 0)
+		return FALSE;
+	*index = 63 - __builtin_clzll(mask);
+	return TRUE;
+}
+
+//
+// interlocked operations
+//
+
+inline LONG InterlockedIncrement(volatile LONG* target) {
+	return __atomic_add_fetch(target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(volatile LONG* target) {
+	return __atomic_sub_fetch(target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchange(volatile LONG* target, LONG value) {
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(volatile LONG* target, LONG exchange, LONG comparand) {
+	__atomic_compare_exchange_n(target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+template<typename T>
+inline T ReadNoFence(const volatile T* source) {
+	return __atomic_load_n(source, __ATOMIC_RELAXED);
+}
+
+template<typename T>
+inline T ReadAcquire(const volatile T* source) {
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+inline void WriteRelease(volatile T* target, T value) {
+	__atomic_store_n(target, value, __ATOMIC_RELEASE);
+}
+
+inline PVOID ReadPointerAcquire(PVOID const volatile* source) {
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline PVOID InterlockedExchangePointer(PVOID volatile* target, PVOID value) {
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline void YieldProcessor() {
+	_mm_pause();
+}
+
+//
+// lists
+//
+
+struct LIST_ENTRY {
+	LIST_ENTRY* Flink;
+	LIST_ENTRY* Blink;
+};
+typedef LIST_ENTRY* PLIST_ENTRY;
+
+inline void InitializeListHead(PLIST_ENTRY head) {
+	head->Flink = head->Blink = head;
+}
+
+inline bool IsListEmpty(const LIST_ENTRY* head) {
+	return head->Flink == head;
+}
+
+inline void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+	entry->Flink = head;
+	entry->Blink = head->Blink;
+	head->Blink->Flink = entry;
+	head->Blink = entry;
+}
+
+inline void InsertHeadList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+	entry->Flink = head->Flink;
+	entry->Blink = head;
+	head->Flink->Blink = entry;
+	head->Flink = entry;
+}
+
+inline bool RemoveEntryList(PLIST_ENTRY entry) {
+	entry->Blink->Flink = entry->Flink;
+	entry->Flink->Blink = entry->Blink;
+	return entry->Flink == entry->Blink;
+}
+
+//
+// pool and lookaside lists
+//
+
+enum POOL_TYPE {
+	NonPagedPool,
+	PagedPool,
+	NonPagedPoolNx = 512
+};
+
+inline PVOID ExAllocatePoolWithTag(POOL_TYPE, SIZE_T size, ULONG) {
+	// pool blocks are at least cache line aligned
+	return aligned_alloc(64, (size + 63) & ~(SIZE_T)63);
+}
+
+inline void ExFreePool(PVOID p) {
+	free(p);
+}
+
+struct GENERAL_LOOKASIDE_POOL {
+	ULONG TotalAllocates;
+	ULONG AllocateMisses;
+	ULONG TotalFrees;
+	ULONG FreeMisses;
+	USHORT Depth;
+};
+
+struct LOOKASIDE_LIST_EX {
+	GENERAL_LOOKASIDE_POOL L;
+	// like the kernel's, a single list shared by all processors
+	std::atomic_flag Lock;
+	std::vector<PVOID>* Free;
+	ULONG Size;
+};
+typedef LOOKASIDE_LIST_EX* PLOOKASIDE_LIST_EX;
+
+const USHORT ShimLookasideDepth = 256;
+
+inline NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX list, PVOID, PVOID, POOL_TYPE, ULONG, SIZE_T size, ULONG, USHORT) {
+	memset(&list->L, 0, sizeof(list->L));
+	list->L.Depth = ShimLookasideDepth;
+	list->Lock.clear();
+	list->Free = new std::vector<PVOID>;
+	list->Free->reserve(ShimLookasideDepth);
+	list->Size = (ULONG)size;
+	return STATUS_SUCCESS;
+}
+
+inline void ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX list) {
+	for (auto p : *list->Free)
+		free(p);
+	delete list->Free;
+	list->Free = nullptr;
+}
+
+inline PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX list) {
+	PVOID p = nullptr;
+	while (list->Lock.test_and_set(std::memory_order_acquire))
+		;
+	list->L.TotalAllocates++;
+	if (!list->Free->empty()) {
+		p = list->Free->back();
+		list->Free->pop_back();
+	}
+	else {
+		list->L.AllocateMisses++;
+	}
+	list->Lock.clear(std::memory_order_release);
+	return p ? p : malloc(list->Size);
+}
+
+inline void ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX list, PVOID p) {
+	while (list->Lock.test_and_set(std::memory_order_acquire))
+		;
+	list->L.TotalFrees++;
+	if (list->Free->size() < list->L.Depth) {
+		list->Free->push_back(p);
+		p = nullptr;
+	}
+	else {
+		list->L.FreeMisses++;
+	}
+	list->Lock.clear(std::memory_order_release);
+	free(p);
+}
+
+//
+// locks
+//
+
+struct FAST_MUTEX {
+	std::mutex Mutex;
+};
+
+inline void ExInitializeFastMutex(FAST_MUTEX* mutex) {
+	new (&mutex->Mutex) std::mutex;
+}
+
+inline void ExAcquireFastMutex(FAST_MUTEX* mutex) {
+	mutex->Mutex.lock();
+}
+
+inline BOOLEAN ExTryToAcquireFastMutex(FAST_MUTEX* mutex) {
+	return mutex->Mutex.try_lock();
+}
+
+inline void ExReleaseFastMutex(FAST_MUTEX* mutex) {
+	mutex->Mutex.unlock();
+}
+
+struct EX_PUSH_LOCK {
+	std::shared_mutex Lock;
+};
+
+inline void ExInitializePushLock(EX_PUSH_LOCK* lock) {
+	new (&lock->Lock) std::shared_mutex;
+}
+
+inline void ExAcquirePushLockExclusive(EX_PUSH_LOCK* lock) {
+	lock->Lock.lock();
+}
+
+inline void ExReleasePushLockExclusive(EX_PUSH_LOCK* lock) {
+	lock->Lock.unlock();
+}
+
+inline void ExAcquirePushLockShared(EX_PUSH_LOCK* lock) {
+	lock->Lock.lock_shared();
+}
+
+inline void ExReleasePushLockShared(EX_PUSH_LOCK* lock) {
+	lock->Lock.unlock_shared();
+}
+
+//
+// cache aware rundown protection: a reference count per processor, so that
+// readers on different processors do not share a cache line
+//
+
+struct EX_RUNDOWN_REF_CACHE_AWARE {
+	struct alignas(64) Slot {
+		std::atomic<LONG> Count;
+	};
+	static const ULONG Slots = 64;
+
+	Slot Counts[Slots];
+	std::atomic<bool> RundownActive;
+};
+typedef EX_RUNDOWN_REF_CACHE_AWARE* PEX_RUNDOWN_REF_CACHE_AWARE;
+
+inline PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE, ULONG) {
+	return new EX_RUNDOWN_REF_CACHE_AWARE();
+}
+
+inline void ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE rundown) {
+	delete rundown;
+}
+
+inline BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown) {
+	auto& count = rundown->Counts[g_ShimCurrentProcessor % EX_RUNDOWN_REF_CACHE_AWARE::Slots].Count;
+	count.fetch_add(1);
+	if (rundown->RundownActive.load()) {
+		count.fetch_sub(1);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+inline void ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown) {
+	// the slot of the acquiring processor does not matter, only the total does
+	rundown->Counts[g_ShimCurrentProcessor % EX_RUNDOWN_REF_CACHE_AWARE::Slots].Count.fetch_sub(1);
+}
+
+inline void ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown) {
+	rundown->RundownActive.store(true);
+	for (;;) {
+		LONG total = 0;
+		for (auto& slot : rundown->Counts)
+			total += slot.Count.load();
+		if (total == 0)
+			break;
+		std::this_thread::yield();
+	}
+}
+
+inline void ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown) {
+	rundown->RundownActive.store(false);
+}
+
+// reader/writer spin lock: the high bit is the writer, the rest counts readers
+typedef volatile LONG EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+const LONG ShimSpinWriter = (LONG)0x80000000;
+
+inline void ExAcquireSpinLockExclusiveAtDpcLevel(PEX_SPIN_LOCK lock) {
+	for (;;) {
+		if (ReadNoFence(lock) == 0 && InterlockedCompareExchange(lock, ShimSpinWriter, 0) == 0)
+			return;
+		_mm_pause();
+	}
+}
+
+inline void ExReleaseSpinLockExclusiveFromDpcLevel(PEX_SPIN_LOCK lock) {
+	WriteRelease(lock, (LONG)0);
+}
+
+inline KIRQL ExAcquireSpinLockExclusive(PEX_SPIN_LOCK lock) {
+	ExAcquireSpinLockExclusiveAtDpcLevel(lock);
+	return 0;
+}
+
+inline void ExReleaseSpinLockExclusive(PEX_SPIN_LOCK lock, KIRQL) {
+	ExReleaseSpinLockExclusiveFromDpcLevel(lock);
+}
+
+inline KIRQL ExAcquireSpinLockShared(PEX_SPIN_LOCK lock) {
+	for (;;) {
+		auto value = ReadNoFence(lock);
+		if ((value & ShimSpinWriter) == 0 && InterlockedCompareExchange(lock, value + 1, value) == value)
+			return 0;
+		_mm_pause();
+	}
+}
+
+inline void ExReleaseSpinLockShared(PEX_SPIN_LOCK lock, KIRQL) {
+	InterlockedDecrement(lock);
+}
+
+typedef ULONG_PTR KSPIN_LOCK;
+
+//
+// timers and DPCs, accepted but never run
+//
+
+struct KDPC;
+typedef KDPC* PKDPC;
+typedef void KDEFERRED_ROUTINE(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2);
+
+struct KDPC {
+	KDEFERRED_ROUTINE* Routine;
+	PVOID Context;
+};
+
+enum TIMER_TYPE {
+	NotificationTimer,
+	SynchronizationTimer
+};
+
+struct KTIMER {
+	TIMER_TYPE Type;
+};
+
+inline void KeInitializeTimerEx(KTIMER* timer, TIMER_TYPE type) {
+	timer->Type = type;
+}
+
+inline void KeInitializeDpc(PKDPC dpc, KDEFERRED_ROUTINE* routine, PVOID context) {
+	dpc->Routine = routine;
+	dpc->Context = context;
+}
+
+inline BOOLEAN KeSetTimerEx(KTIMER*, LARGE_INTEGER, LONG, PKDPC) {
+	return FALSE;
+}
+
+inline BOOLEAN KeCancelTimer(KTIMER*) {
+	return FALSE;
+}
+
+inline void KeFlushQueuedDpcs() {}
+
+//
+// strings
+//
+
+struct UNICODE_STRING {
+	USHORT Length;			// in bytes
+	USHORT MaximumLength;
+	PWSTR Buffer;
+};
+typedef UNICODE_STRING* PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+#define RTL_CONSTANT_STRING(s) { sizeof(s) - sizeof((s)[0]), sizeof(s), (PWSTR)(s) }
+
+inline WCHAR RtlUpcaseUnicodeChar(WCHAR ch) {
+	return towupper(ch);
+}
+
+inline BOOLEAN RtlPrefixUnicodeString(PCUNICODE_STRING prefix, PCUNICODE_STRING string, BOOLEAN caseInsensitive) {
+	if (prefix->Length > string->Length)
+		return FALSE;
+	for (ULONG i = 0; i < prefix->Length / sizeof(WCHAR); i++) {
+		auto a = prefix->Buffer[i], b = string->Buffer[i];
+		if (caseInsensitive ? towupper(a) != towupper(b) : a != b)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+//
+// types that appear in the driver's headers only
+//
+
+struct IRP;
+typedef IRP* PIRP;
+struct FILE_OBJECT;
+typedef FILE_OBJECT* PFILE_OBJECT;
+struct MDL;
+typedef MDL* PMDL;
+struct EPROCESS;
+typedef EPROCESS* PEPROCESS;
+struct KTHREAD;
+typedef KTHREAD* PKTHREAD;
+
+struct KEVENT {
+	LONG State;
+};
+typedef KEVENT* PKEVENT;
+
+struct IO_CSQ {
+	PVOID Reserved[8];
+};
+typedef IO_CSQ* PIO_CSQ;
+
+typedef NTSTATUS IO_CSQ_INSERT_IRP_EX(PIO_CSQ csq, PIRP irp, PVOID context);
+typedef void IO_CSQ_REMOVE_IRP(PIO_CSQ csq, PIRP irp);
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(PIO_CSQ csq, PIRP irp, PVOID context);
+typedef void IO_CSQ_ACQUIRE_LOCK(PIO_CSQ csq, KIRQL* irql);
+typedef void IO_CSQ_RELEASE_LOCK(PIO_CSQ csq, KIRQL irql);
+typedef void IO_CSQ_COMPLETE_CANCELED_IRP(PIO_CSQ csq, PIRP irp);
+typedef void KSTART_ROUTINE(PVOID context);
+
+//
+// notification callback arguments
+//
+
+struct CLIENT_ID {
+	HANDLE UniqueProcess;
+	HANDLE UniqueThread;
+};
+
+struct PS_CREATE_NOTIFY_INFO {
+	SIZE_T Size;
+	ULONG Flags;
+	HANDLE ParentProcessId;
+	CLIENT_ID CreatingThreadId;
+	PFILE_OBJECT FileObject;
+	PCUNICODE_STRING ImageFileName;
+	PCUNICODE_STRING CommandLine;
+	NTSTATUS CreationStatus;
+};
+typedef PS_CREATE_NOTIFY_INFO* PPS_CREATE_NOTIFY_INFO;
+
+struct IMAGE_INFO {
+	ULONG Properties;
+	PVOID ImageBase;
+	ULONG ImageSelector;
+	SIZE_T ImageSize;
+	ULONG ImageSectionNumber;
+};
+typedef IMAGE_INFO* PIMAGE_INFO;
@@ -0,0 +1,34 @@
+#pragma once
+
+//
+// the Windows types used by SysMonCommon.h and CaptureFormat.h,
+// so that the offline tools build on other platforms as well
+//
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t BYTE;
+typedef uint8_t UCHAR;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64;
+typedef char16_t WCHAR;		// records hold UTF-16 strings
+typedef void* HANDLE;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONG64 QuadPart;
+} LARGE_INTEGER;
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define METHOD_BUFFERED		0
+#define METHOD_NEITHER		3
+#define FILE_ANY_ACCESS		0
@@ -0,0 +1,725 @@
+// SysMonQuery.cpp : filters and aggregates SysMon capture files, decoding their chunks in parallel.
+//
+// Builds with the project file on Windows, and with any C++14 compiler elsewhere, e.g.
+//   g++ -std=c++14 -O2 -pthread SysMonQuery.cpp -o sysmonquery
+//
+
+#include "pch.h"
+#include "../SysMon/CaptureFormat.h"
+#include "../SysMon/RecordView.h"
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <limits>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// capture file mapped read only
+class MappedFile {
+public:
+	~MappedFile() {
+#ifdef _WIN32
+		if (_data)
+			::UnmapViewOfFile(_data);
+		if (_hMapping)
+			::CloseHandle(_hMapping);
+		if (_hFile != INVALID_HANDLE_VALUE)
+			::CloseHandle(_hFile);
+#else
+		if (_data)
+			::munmap((void*)_data, _size);
+		if (_fd >= 0)
+			::close(_fd);
+#endif
+	}
+
+	bool Open(const char* path) {
+#ifdef _WIN32
+		_hFile = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (_hFile == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER size;
+		if (!::GetFileSizeEx(_hFile, &size) || size.QuadPart == 0)
+			return false;
+		_size = size.QuadPart;
+		_hMapping = ::CreateFileMapping(_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!_hMapping)
+			return false;
+		_data = (const BYTE*)::MapViewOfFile(_hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		_fd = ::open(path, O_RDONLY);
+		if (_fd < 0)
+			return false;
+		struct stat st;
+		if (::fstat(_fd, &st) < 0 || st.st_size == 0)
+			return false;
+		_size = st.st_size;
+		auto data = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+		_data = (const BYTE*)data;
+#endif
+		return _data != nullptr;
+	}
+
+	const BYTE* Data() const {
+		return _data;
+	}
+
+	ULONG64 Size() const {
+		return _size;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE _hFile = INVALID_HANDLE_VALUE;
+	HANDLE _hMapping = nullptr;
+#else
+	int _fd = -1;
+#endif
+	const BYTE* _data = nullptr;
+	ULONG64 _size = 0;
+};
+
+// a UTF-16 string inside the capture
+struct Text {
+	const char16_t* Data;
+	size_t Length;
+};
+
+using StringMap = std::unordered_map<ULONG, std::u16string>;
+
+struct Query {
+	ULONG Types = 0;		// ItemTypeBit mask, zero for all events
+	std::vector<ULONG> Pids;	// sorted, empty for all
+	LONG64 From = std::numeric_limits<LONG64>::min();
+	LONG64 To = std::numeric_limits<LONG64>::max();
+	std::u16string Image;	// lower case substring of the image path, empty for any
+};
+
+const char* ItemTypeName(ULONG type) {
+	static const char* names[] = {
+		"None", "ProcessCreate", "ProcessExit", "ThreadCreate", "ThreadExit",
+		"ImageLoad", "RegistrySetValue", "EventsLost", "ThreadSummary",
+		"StringDefinition", "RegistryCreateKey", "RegistryDeleteKey", "RegistryDeleteValue",
+		"RegistryRenameKey"
+	};
+	return type < sizeof(names) / sizeof(names[0]) ? names[type] : "Unknown";
+}
+
+ULONG ParseTypes(const char* list) {
+	ULONG types = 0;
+	std::string names(list);
+	size_t start = 0;
+	while (start <= names.size()) {
+		auto end = names.find(',', start);
+		if (end == std::string::npos)
+			end = names.size();
+		auto name = names.substr(start, end - start);
+		for (ULONG type = 0; type < MaxItemTypes; type++) {
+			if (name == ItemTypeName(type))
+				types |= ItemTypeBit((ItemType)type);
+		}
+		if (name == "process")
+			types |= ItemTypeBit(ItemType::ProcessCreate) | ItemTypeBit(ItemType::ProcessExit);
+		else if (name == "thread")
+			types |= ItemTypeBit(ItemType::ThreadCreate) | ItemTypeBit(ItemType::ThreadExit) | ItemTypeBit(ItemType::ThreadSummary);
+		else if (name == "image")
+			types |= ItemTypeBit(ItemType::ImageLoad);
+		else if (name == "registry")
+			types |= RegistryEventTypes;
+		start = end + 1;
+	}
+	return types;
+}
+
+//
+// record access
+//
+
+// calls f for every record of the chunk, stops at the first malformed one.
+// Records of the current version hold at least the fixed part of their type
+template<typename F>
+void ForEachRecord(const CaptureChunkHeader* chunk, ULONG64 available, F f) {
+	ULONG64 size = std::min<ULONG64>(chunk->DataSize, available - sizeof(CaptureChunkHeader));
+	RecordReader reader(chunk + 1, (size_t)size);
+	RecordView record;
+	while (reader.Next(record))
+		f(record.Header());
+}
+
+Text GetText(const ItemHeader* header, USHORT offset, USHORT length) {
+	auto text = RecordView(header).Text(offset, length);
+	return Text{ (const char16_t*)text.Data, text.Length };
+}
+
+Text GetText(const StringMap& strings, const ItemHeader* header, ULONG id, USHORT offset, USHORT length) {
+	if (id == 0)
+		return GetText(header, offset, length);
+
+	auto it = strings.find(id);
+	if (it == strings.end())
+		return Text{ nullptr, 0 };
+	return Text{ it->second.data(), it->second.size() };
+}
+
+// the image path of process and image load records
+Text GetImage(const StringMap& strings, const ItemHeader* header) {
+	switch (header->Type) {
+		case ItemType::ImageLoad:
+		{
+			auto info = (const ImageLoadInfo*)header;
+			return GetText(strings, header, info->ImageFileNameId, info->ImageFileNameOffset, info->ImageFileNameLength);
+		}
+		case ItemType::ProcessCreate:
+		case ItemType::ProcessExit:
+			return GetText(strings, header, GetRecordStringId(header), 0, 0);
+
+		default:
+			break;
+	}
+	return Text{ nullptr, 0 };
+}
+
+char16_t ToLower(char16_t c) {
+	return c >= u'A' && c <= u'Z' ? c + (u'a' - u'A') : c;
+}
+
+bool ContainsNoCase(Text text, const std::u16string& lowerPattern) {
+	if (lowerPattern.size() > text.Length)
+		return false;
+	for (size_t i = 0; i + lowerPattern.size() <= text.Length; i++) {
+		size_t j = 0;
+		while (j < lowerPattern.size() && ToLower(text.Data[i + j]) == lowerPattern[j])
+			j++;
+		if (j == lowerPattern.size())
+			return true;
+	}
+	return false;
+}
+
+bool Matches(const Query& query, const StringMap& strings, const ItemHeader* header) {
+	if (header->Type == ItemType::StringDefinition || header->Type == ItemType::None)
+		return false;
+	// the layout of other versions is not known
+	if (header->Version != ItemHeaderVersion)
+		return false;
+	if (query.Types && (query.Types & ItemTypeBit(header->Type)) == 0)
+		return false;
+	if (header->Time.QuadPart < query.From || header->Time.QuadPart > query.To)
+		return false;
+	if (!query.Pids.empty() && !std::binary_search(query.Pids.begin(), query.Pids.end(), GetRecordProcessId(header)))
+		return false;
+	if (!query.Image.empty() && !ContainsNoCase(GetImage(strings, header), query.Image))
+		return false;
+	return true;
+}
+
+// true if the chunk header rules out a match
+bool CanSkip(const Query& query, const CaptureChunkHeader* chunk) {
+	if (chunk->RecordCount == 0)
+		return true;
+	if (chunk->LastTime.QuadPart < query.From || chunk->FirstTime.QuadPart > query.To)
+		return true;
+
+	if (query.Types) {
+		bool any = false;
+		for (ULONG type = 0; type < MaxItemTypes && !any; type++)
+			any = chunk->TypeCounts[type] && (query.Types & (1UL << type));
+		if (!any)
+			return true;
+	}
+
+	if (!query.Pids.empty()) {
+		bool any = false;
+		for (size_t i = 0; i < query.Pids.size() && !any; i++)
+			any = CaptureBloomMayContain(chunk->PidBloom, query.Pids[i]);
+		if (!any)
+			return true;
+	}
+	return false;
+}
+
+//
+// formatting
+//
+
+void AppendUtf8(std::string& out, Text text) {
+	for (size_t i = 0; i < text.Length; i++) {
+		ULONG c = text.Data[i];
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.Length && text.Data[i + 1] >= 0xDC00 && text.Data[i + 1] < 0xE000)
+			c = 0x10000 + ((c - 0xD800) << 10) + (text.Data[++i] - 0xDC00);
+
+		if (c < 0x80) {
+			out += (char)c;
+		}
+		else if (c < 0x800) {
+			out += (char)(0xC0 | (c >> 6));
+			out += (char)(0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000) {
+			out += (char)(0xE0 | (c >> 12));
+			out += (char)(0x80 | ((c >> 6) & 0x3F));
+			out += (char)(0x80 | (c & 0x3F));
+		}
+		else {
+			out += (char)(0xF0 | (c >> 18));
+			out += (char)(0x80 | ((c >> 12) & 0x3F));
+			out += (char)(0x80 | ((c >> 6) & 0x3F));
+			out += (char)(0x80 | (c & 0x3F));
+		}
+	}
+}
+
+std::string ToUtf8(Text text) {
+	std::string out;
+	AppendUtf8(out, text);
+	return out;
+}
+
+// UTC, from a FILETIME value
+void AppendTime(std::string& out, LONG64 time) {
+	auto ticks = time % 10000000;
+	auto seconds = time / 10000000;
+	auto days = (LONG)(seconds / 86400);
+	auto secondOfDay = (LONG)(seconds % 86400);
+
+	// civil date from days since 1601-01-01, which starts a 400 year cycle
+	auto cycles = days / 146097;
+	auto day = days % 146097;
+	auto centuries = std::min<LONG>(day / 36524, 3);
+	day -= centuries * 36524;
+	auto quads = day / 1461;
+	day %= 1461;
+	auto years = std::min<LONG>(day / 365, 3);
+	day -= years * 365;
+	auto year = 1601 + cycles * 400 + centuries * 100 + quads * 4 + years;
+
+	static const int monthDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+	int month = 0;
+	while (day >= monthDays[month] + (month == 1 && leap ? 1 : 0)) {
+		day -= monthDays[month] + (month == 1 && leap ? 1 : 0);
+		month++;
+	}
+
+	char text[48];
+	snprintf(text, sizeof(text), "%04d-%02d-%02d %02d:%02d:%02d.%03d", year, month + 1, day + 1,
+		secondOfDay / 3600, secondOfDay / 60 % 60, secondOfDay % 60, (int)(ticks / 10000));
+	out += text;
+}
+
+void AppendRecord(std::string& out, const StringMap& strings, const ItemHeader* header) {
+	char text[128];
+	AppendTime(out, header->Time.QuadPart);
+	out += ' ';
+	out += ItemTypeName((ULONG)header->Type);
+
+	switch (header->Type) {
+		case ItemType::ProcessCreate:
+		{
+			auto info = (const ProcessCreateInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u parent=%u image=", info->ProcessId, info->ParentProcessId);
+			out += text;
+			AppendUtf8(out, GetImage(strings, header));
+			out += " cmd=";
+			AppendUtf8(out, GetText(header, info->CommandLineOffset, info->CommandLineLength));
+			break;
+		}
+
+		case ItemType::ProcessExit:
+		{
+			auto info = (const ProcessExitInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u image=", info->ProcessId);
+			out += text;
+			AppendUtf8(out, GetImage(strings, header));
+			break;
+		}
+
+		case ItemType::ThreadCreate:
+		case ItemType::ThreadExit:
+		{
+			auto info = (const ThreadCreateExitInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u tid=%u", info->ProcessId, info->ThreadId);
+			out += text;
+			break;
+		}
+
+		case ItemType::ImageLoad:
+		{
+			auto info = (const ImageLoadInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u base=0x%llX image=", info->ProcessId, (unsigned long long)info->LoadAddress);
+			out += text;
+			AppendUtf8(out, GetImage(strings, header));
+			break;
+		}
+
+		case ItemType::RegistrySetValue:
+		{
+			auto info = (const RegistrySetValueInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u type=%u size=%u key=", info->ProcessId, info->DataType, info->DataSize);
+			out += text;
+			AppendUtf8(out, GetText(strings, header, info->KeyNameId, info->KeyNameOffset, info->KeyNameLength));
+			out += " value=";
+			AppendUtf8(out, GetText(header, info->ValueNameOffset, info->ValueNameLength));
+			break;
+		}
+
+		case ItemType::RegistryCreateKey:
+		case ItemType::RegistryDeleteKey:
+		case ItemType::RegistryDeleteValue:
+		case ItemType::RegistryRenameKey:
+		{
+			auto info = (const RegistryKeyInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u key=", info->ProcessId);
+			out += text;
+			AppendUtf8(out, GetText(strings, header, info->KeyNameId, info->KeyNameOffset, info->KeyNameLength));
+			if (info->NameLength) {
+				out += " name=";
+				AppendUtf8(out, GetText(header, info->NameOffset, info->NameLength));
+			}
+			break;
+		}
+
+		case ItemType::ThreadSummary:
+		{
+			auto info = (const ThreadSummaryInfo*)header;
+			snprintf(text, sizeof(text), " pid=%u created=%u exited=%u interval=%u", info->ProcessId, info->Created, info->Exited, info->IntervalMs);
+			out += text;
+			break;
+		}
+
+		case ItemType::EventsLost:
+			snprintf(text, sizeof(text), " count=%u", ((const EventsLostInfo*)header)->Count);
+			out += text;
+			break;
+
+		default:
+			// None and StringDefinition records never match a query
+			break;
+	}
+	out += '\n';
+}
+
+//
+// the capture
+//
+
+class Capture {
+public:
+	bool Open(const char* path) {
+		if (!_file.Open(path) || _file.Size() < CaptureFileHeaderSize)
+			return false;
+
+		_header = (const CaptureFileHeader*)_file.Data();
+		if (_header->Magic != CaptureFileMagic || _header->FormatVersion != CaptureFormatVersion ||
+			_header->ChunkSize < MinCaptureChunkSize)
+			return false;
+
+		// the count in the header is stale if the capture was not closed properly
+		for (ULONG64 offset = CaptureFileHeaderSize; offset + sizeof(CaptureChunkHeader) <= _file.Size(); offset += _header->ChunkSize) {
+			auto chunk = (const CaptureChunkHeader*)(_file.Data() + offset);
+			if (chunk->Magic != CaptureChunkMagic)
+				break;
+			_chunks.push_back(chunk);
+		}
+		return true;
+	}
+
+	const CaptureFileHeader& Header() const {
+		return *_header;
+	}
+
+	size_t ChunkCount() const {
+		return _chunks.size();
+	}
+
+	const CaptureChunkHeader* Chunk(size_t index) const {
+		return _chunks[index];
+	}
+
+	// bytes of the file from the chunk on
+	ULONG64 Available(size_t index) const {
+		return _file.Size() - ((const BYTE*)_chunks[index] - _file.Data());
+	}
+
+private:
+	MappedFile _file;
+	const CaptureFileHeader* _header = nullptr;
+	std::vector<const CaptureChunkHeader*> _chunks;
+};
+
+// runs f(index, worker) for every index on the given number of threads
+template<typename F>
+void ParallelFor(size_t count, unsigned workers, F f) {
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	for (unsigned worker = 0; worker < workers; worker++) {
+		threads.emplace_back([&, worker] {
+			for (size_t index; (index = next++) < count; )
+				f(index, worker);
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+}
+
+StringMap LoadStrings(const Capture& capture, unsigned workers) {
+	// definitions are few and marked in the chunk headers
+	std::vector<StringMap> partial(workers);
+	ParallelFor(capture.ChunkCount(), workers, [&](size_t index, unsigned worker) {
+		auto chunk = capture.Chunk(index);
+		if (chunk->TypeCounts[(ULONG)ItemType::StringDefinition] == 0)
+			return;
+		ForEachRecord(chunk, capture.Available(index), [&](const ItemHeader* header) {
+			if (header->Type != ItemType::StringDefinition)
+				return;
+			auto info = (const StringDefinitionInfo*)header;
+			auto text = GetText(header, info->Offset, info->Length);
+			if (text.Data)
+				partial[worker][info->Id].assign(text.Data, text.Length);
+		});
+	});
+
+	StringMap strings;
+	for (auto& map : partial)
+		strings.insert(map.begin(), map.end());
+	return strings;
+}
+
+int List(const Capture& capture, const Query& query, const StringMap& strings, unsigned workers) {
+	// decode a batch of chunks in parallel, print it in file order
+	const size_t batch = workers * 4;
+	std::vector<std::string> output(batch);
+	for (size_t first = 0; first < capture.ChunkCount(); first += batch) {
+		auto count = std::min(batch, capture.ChunkCount() - first);
+		ParallelFor(count, workers, [&](size_t i, unsigned) {
+			auto& out = output[i];
+			out.clear();
+			auto chunk = capture.Chunk(first + i);
+			if (CanSkip(query, chunk))
+				return;
+			ForEachRecord(chunk, capture.Available(first + i), [&](const ItemHeader* header) {
+				if (Matches(query, strings, header))
+					AppendRecord(out, strings, header);
+			});
+		});
+		for (size_t i = 0; i < count; i++)
+			fwrite(output[i].data(), 1, output[i].size(), stdout);
+	}
+	return 0;
+}
+
+int CountTypes(const Capture& capture, const Query& query, const StringMap& strings, unsigned workers) {
+	std::vector<std::vector<ULONG64>> partial(workers, std::vector<ULONG64>(MaxItemTypes));
+	std::atomic<ULONG64> skipped(0);
+	ParallelFor(capture.ChunkCount(), workers, [&](size_t index, unsigned worker) {
+		auto chunk = capture.Chunk(index);
+		if (CanSkip(query, chunk)) {
+			skipped++;
+			return;
+		}
+		ForEachRecord(chunk, capture.Available(index), [&](const ItemHeader* header) {
+			if (Matches(query, strings, header))
+				partial[worker][(ULONG)header->Type % MaxItemTypes]++;
+		});
+	});
+
+	ULONG64 total = 0;
+	for (ULONG type = 0; type < MaxItemTypes; type++) {
+		ULONG64 count = 0;
+		for (auto& counts : partial)
+			count += counts[type];
+		if (count)
+			printf("%-20s %12llu\n", ItemTypeName(type), (unsigned long long)count);
+		total += count;
+	}
+	printf("%-20s %12llu\n", "Total", (unsigned long long)total);
+	printf("%llu of %zu chunks skipped\n", (unsigned long long)skipped.load(), capture.ChunkCount());
+	return 0;
+}
+
+struct Churn {
+	ULONG ProcessId = 0;
+	ULONG ProcessKey = 0;
+	ULONG64 Created = 0;
+	ULONG64 Exited = 0;
+	ULONG ImageId = 0;
+	Text Image = { nullptr, 0 };
+};
+
+int ThreadChurn(const Capture& capture, Query query, const StringMap& strings, unsigned workers, size_t top) {
+	// process records only supply the names
+	query.Types = ItemTypeBit(ItemType::ThreadCreate) | ItemTypeBit(ItemType::ThreadExit) | ItemTypeBit(ItemType::ThreadSummary) |
+		ItemTypeBit(ItemType::ProcessCreate) | ItemTypeBit(ItemType::ProcessExit);
+	query.Image.clear();
+
+	// by process key, PIDs are reused; by PID for processes the driver had no key for
+	auto processOf = [](ULONG pid, ULONG key) {
+		return key ? (1ULL << 32) | key : pid;
+	};
+
+	std::vector<std::unordered_map<ULONG64, Churn>> partial(workers);
+	ParallelFor(capture.ChunkCount(), workers, [&](size_t index, unsigned worker) {
+		auto chunk = capture.Chunk(index);
+		if (CanSkip(query, chunk))
+			return;
+		auto& map = partial[worker];
+		ForEachRecord(chunk, capture.Available(index), [&](const ItemHeader* header) {
+			if (!Matches(query, strings, header))
+				return;
+			auto pid = GetRecordProcessId(header);
+			auto key = GetRecordProcessKey(header);
+			auto& churn = map[processOf(pid, key)];
+			churn.ProcessId = pid;
+			churn.ProcessKey = key;
+			switch (header->Type) {
+				case ItemType::ThreadCreate: churn.Created++; break;
+				case ItemType::ThreadExit: churn.Exited++; break;
+				case ItemType::ThreadSummary:
+					churn.Created += ((const ThreadSummaryInfo*)header)->Created;
+					churn.Exited += ((const ThreadSummaryInfo*)header)->Exited;
+					break;
+				default:
+					churn.Image = GetImage(strings, header);
+					break;
+			}
+		});
+	});
+
+	std::unordered_map<ULONG64, Churn> total;
+	for (auto& map : partial) {
+		for (auto& entry : map) {
+			auto& churn = total[entry.first];
+			churn.ProcessId = entry.second.ProcessId;
+			churn.ProcessKey = entry.second.ProcessKey;
+			churn.Created += entry.second.Created;
+			churn.Exited += entry.second.Exited;
+			if (entry.second.Image.Data)
+				churn.Image = entry.second.Image;
+		}
+	}
+
+	std::vector<Churn> sorted;
+	sorted.reserve(total.size());
+	for (auto& entry : total)
+		sorted.push_back(entry.second);
+	std::sort(sorted.begin(), sorted.end(), [](const Churn& a, const Churn& b) {
+		return a.Created + a.Exited > b.Created + b.Exited;
+	});
+
+	printf("     PID      Key      Created       Exited  Image\n");
+	for (size_t i = 0; i < sorted.size() && i < top; i++) {
+		auto& churn = sorted[i];
+		if (churn.Created + churn.Exited == 0)
+			break;
+		printf("%8u %8u %12llu %12llu  %s\n", churn.ProcessId, churn.ProcessKey, (unsigned long long)churn.Created,
+			(unsigned long long)churn.Exited, ToUtf8(churn.Image).c_str());
+	}
+	return 0;
+}
+
+int ImageLoads(const Capture& capture, Query query, const StringMap& strings, unsigned workers, size_t top) {
+	query.Types = ItemTypeBit(ItemType::ImageLoad);
+
+	std::vector<std::unordered_map<std::u16string, ULONG64>> partial(workers);
+	ParallelFor(capture.ChunkCount(), workers, [&](size_t index, unsigned worker) {
+		auto chunk = capture.Chunk(index);
+		if (CanSkip(query, chunk))
+			return;
+		auto& map = partial[worker];
+		ForEachRecord(chunk, capture.Available(index), [&](const ItemHeader* header) {
+			if (!Matches(query, strings, header))
+				return;
+			auto image = GetImage(strings, header);
+			map[std::u16string(image.Data ? image.Data : u"", image.Length)]++;
+		});
+	});
+
+	std::unordered_map<std::u16string, ULONG64> total;
+	for (auto& map : partial)
+		for (auto& entry : map)
+			total[entry.first] += entry.second;
+
+	std::vector<std::pair<std::u16string, ULONG64>> sorted(total.begin(), total.end());
+	std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::u16string, ULONG64>& a, const std::pair<std::u16string, ULONG64>& b) {
+		return a.second > b.second;
+	});
+
+	printf("       Loads  Image\n");
+	for (size_t i = 0; i < sorted.size() && i < top; i++) {
+		Text image = { sorted[i].first.data(), sorted[i].first.size() };
+		printf("%12llu  %s\n", (unsigned long long)sorted[i].second, ToUtf8(image).c_str());
+	}
+	return 0;
+}
+
+int Usage() {
+	printf("Usage: sysmonquery <capture file> [options] [list | count | churn [top] | images [top]]\n");
+	printf("  -types <list>     event types, e.g. process,thread,image,registry,ImageLoad\n");
+	printf("  -pid <pid>        events of this process (repeatable)\n");
+	printf("  -from <seconds>   events from this many seconds after the capture started\n");
+	printf("  -to <seconds>     events up to this many seconds after the capture started\n");
+	printf("  -image <text>     process and image load events whose image path contains the text\n");
+	printf("  -threads <count>  decoding threads, all cores by default\n");
+	return 1;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc < 2)
+		return Usage();
+
+	Capture capture;
+	if (!capture.Open(argv[1])) {
+		printf("Failed to open capture file %s\n", argv[1]);
+		return 1;
+	}
+
+	Query query;
+	unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+	auto start = capture.Header().StartTime.QuadPart;
+	int i = 2;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		auto option = argv[i], value = argv[i + 1];
+		if (strcmp(option, "-types") == 0)
+			query.Types = ParseTypes(value);
+		else if (strcmp(option, "-pid") == 0)
+			query.Pids.push_back(strtoul(value, nullptr, 0));
+		else if (strcmp(option, "-from") == 0)
+			query.From = start + (LONG64)(atof(value) * 10000000);
+		else if (strcmp(option, "-to") == 0)
+			query.To = start + (LONG64)(atof(value) * 10000000);
+		else if (strcmp(option, "-image") == 0) {
+			// ASCII case folding, like ToLower
+			for (auto p = value; *p; p++)
+				query.Image += ToLower((char16_t)(unsigned char)*p);
+		}
+		else if (strcmp(option, "-threads") == 0)
+			workers = std::max(1, atoi(value));
+		else
+			return Usage();
+	}
+	std::sort(query.Pids.begin(), query.Pids.end());
+
+	auto command = i < argc ? argv[i] : "list";
+	size_t top = i + 1 < argc ? strtoul(argv[i + 1], nullptr, 0) : 20;
+
+	auto strings = LoadStrings(capture, workers);
+	if (strcmp(command, "list") == 0)
+		return List(capture, query, strings, workers);
+	if (strcmp(command, "count") == 0)
+		return CountTypes(capture, query, strings, workers);
+	if (strcmp(command, "churn") == 0)
+		return ThreadChurn(capture, query, strings, workers, top);
+	if (strcmp(command, "images") == 0)
+		return ImageLoads(capture, query, strings, workers, top);
+	return Usage();
+}
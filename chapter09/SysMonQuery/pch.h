@@ -0,0 +1,15 @@
+#ifndef PCH_H
+#define PCH_H
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include "Portable.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#endif //PCH_H
@@ -0,0 +1,73 @@
+// RecordBench.cpp : measures the cost of validating records with RecordReader,
+// against walking the same buffer by trusting each record's size.
+//
+// Build from this directory:
+//   g++ -std=c++14 -O2 RecordBench.cpp -o recordbench
+//
+// Usage: recordbench [megabytes of records] [passes]
+//
+
+#include "RecordSamples.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+using Clock = std::chrono::steady_clock;
+
+// the walk the client did before, which trusts the sizes
+ULONG64 WalkUnchecked(const UCHAR* buffer, size_t size, bool touch) {
+	ULONG64 sum = 0;
+	size_t offset = 0;
+	while (offset < size) {
+		auto header = (const ItemHeader*)(buffer + offset);
+		sum += touch ? TouchRecord(RecordView(header)) : (ULONG64)header->Type;
+		offset += header->Size;
+	}
+	return sum;
+}
+
+ULONG64 WalkChecked(const UCHAR* buffer, size_t size, bool touch) {
+	ULONG64 sum = 0;
+	RecordReader reader(buffer, size);
+	RecordView record;
+	while (reader.Next(record))
+		sum += touch ? TouchRecord(record) : (ULONG64)record.Type();
+	return sum;
+}
+
+void Run(const char* name, ULONG64 (*walk)(const UCHAR*, size_t, bool), bool touch,
+	const std::vector<UCHAR>& buffer, ULONG64 records, int passes) {
+	volatile ULONG64 sum = 0;
+	// the first pass warms the caches
+	sum += walk(buffer.data(), buffer.size(), touch);
+
+	auto start = Clock::now();
+	for (int i = 0; i < passes; i++)
+		sum += walk(buffer.data(), buffer.size(), touch);
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	auto total = (double)records * passes;
+	printf("%-24s %10.2f %12.1f %10.2f\n", name, seconds * 1e9 / total, total / seconds / 1e6,
+		(double)buffer.size() * passes / seconds / (1 << 30));
+}
+
+int main(int argc, const char* argv[]) {
+	auto megabytes = argc > 1 ? atoi(argv[1]) : 64;
+	auto passes = argc > 2 ? atoi(argv[2]) : 10;
+
+	std::vector<UCHAR> buffer;
+	buffer.reserve((size_t)megabytes << 20);
+	ULONG64 records = 0;
+	while (buffer.size() < ((size_t)megabytes << 20)) {
+		AppendSampleRecords(buffer, 1 << 12);
+		records += 1 << 12;
+	}
+
+	printf("%llu records, %llu bytes, %d passes\n", (unsigned long long)records, (unsigned long long)buffer.size(), passes);
+	printf("%-24s %10s %12s %10s\n", "Walk", "ns/record", "Mrecords/s", "GB/s");
+	Run("unchecked, headers", WalkUnchecked, false, buffer, records, passes);
+	Run("RecordReader, headers", WalkChecked, false, buffer, records, passes);
+	Run("unchecked, all fields", WalkUnchecked, true, buffer, records, passes);
+	Run("RecordReader, all fields", WalkChecked, true, buffer, records, passes);
+	return 0;
+}
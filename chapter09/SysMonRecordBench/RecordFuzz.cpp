@@ -0,0 +1,130 @@
+// RecordFuzz.cpp : fuzz target for RecordReader and RecordView, the checks every SysMon client relies on
+// before it touches a record from the driver, the shared channel or a capture file.
+//
+// With libFuzzer:
+//   clang++ -std=c++14 -g -O1 -fsanitize=fuzzer,address,undefined -fno-sanitize=alignment -DLIBFUZZER RecordFuzz.cpp -o recordfuzz
+// Standalone, mutating well formed buffers at random:
+//   g++ -std=c++14 -g -O1 -fsanitize=address,undefined -fno-sanitize=alignment RecordFuzz.cpp -o recordfuzz
+//
+// Records are only as aligned as the buffer they are in, which x86 and x64 do not mind.
+//
+// Usage (standalone): recordfuzz [iterations] [seed] | recordfuzz <input file>...
+//
+
+#include "RecordSamples.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+
+void Check(bool condition, const char* text) {
+	if (!condition) {
+		printf("Check failed: %s\n", text);
+		abort();
+	}
+}
+
+void Walk(const UCHAR* data, size_t size, ULONG alignment) {
+	RecordReader reader(data, size, alignment);
+	RecordView record;
+	size_t last = 0;
+	volatile ULONG64 sum = 0;
+	while (reader.Next(record)) {
+		// every record is inside the buffer and the reader moves forward
+		Check((const UCHAR*)record.Header() == data + last, "record at the reader's offset");
+		Check(reader.Offset() > last && reader.Offset() <= size, "reader progress");
+		Check(record.Size() <= size - last, "record inside the buffer");
+		last = reader.Offset();
+		sum += TouchRecord(record);
+	}
+	Check(reader.Malformed() ? reader.Offset() < size : reader.Offset() == size, "stops at the end or at a malformed record");
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	// a buffer of exactly the input's size, so that reading past it is caught
+	std::vector<UCHAR> buffer(data, data + size);
+	Walk(buffer.data(), buffer.size(), 1);
+	Walk(buffer.data(), buffer.size(), SharedRecordAlignment);
+	return 0;
+}
+
+#ifndef LIBFUZZER
+
+// overwrites a few bytes, favoring the header fields and string offsets/lengths
+void Mutate(std::vector<UCHAR>& buffer, std::mt19937& random) {
+	auto mutations = 1 + random() % 8;
+	for (ULONG i = 0; i < mutations && !buffer.empty(); i++) {
+		auto pos = random() % buffer.size();
+		switch (random() % 6) {
+			case 0:
+				buffer[pos] = (UCHAR)random();
+				break;
+
+			case 1:
+			case 2:
+			{
+				static const USHORT values[] = { 0, 1, 5, 6, 8, 15, 16, 0x7FFF, 0x8000, 0xFFFF };
+				if (pos + 1 < buffer.size()) {
+					auto value = values[random() % (sizeof(values) / sizeof(values[0]))];
+					::memcpy(&buffer[pos & ~(size_t)1], &value, sizeof(value));
+				}
+				break;
+			}
+
+			case 3:
+				buffer.resize(pos);
+				break;
+
+			case 4:
+				buffer[pos] ^= 1 << (random() % 8);
+				break;
+
+			default:
+				// a type that is not known
+				if (pos + 1 < buffer.size())
+					buffer[pos] = (UCHAR)(14 + random() % 32);
+				break;
+		}
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc > 1 && atoll(argv[1]) == 0) {
+		// replay inputs saved from a failing run
+		for (int i = 1; i < argc; i++) {
+			auto file = fopen(argv[i], "rb");
+			if (!file) {
+				printf("Failed to open %s\n", argv[i]);
+				return 1;
+			}
+			std::vector<UCHAR> input;
+			UCHAR chunk[1 << 12];
+			size_t bytes;
+			while ((bytes = fread(chunk, 1, sizeof(chunk), file)) > 0)
+				input.insert(input.end(), chunk, chunk + bytes);
+			fclose(file);
+			LLVMFuzzerTestOneInput(input.data(), input.size());
+		}
+		return 0;
+	}
+
+	auto iterations = argc > 1 ? atoll(argv[1]) : 1000000;
+	std::mt19937 random(argc > 2 ? atoi(argv[2]) : 1);
+
+	std::vector<UCHAR> seeds[2];
+	AppendSampleRecords(seeds[0], 48);
+	AppendSampleRecords(seeds[1], 48, SharedRecordAlignment);
+
+	std::vector<UCHAR> input;
+	for (long long i = 0; i < iterations; i++) {
+		auto& seed = seeds[i % 2];
+		// a window of the seed, so that records are cut at both ends
+		auto start = random() % 64 ? 0 : random() % seed.size();
+		input.assign(seed.begin() + start, seed.begin() + start + random() % (seed.size() - start + 1));
+		Mutate(input, random);
+		LLVMFuzzerTestOneInput(input.data(), input.size());
+	}
+	printf("%lld inputs, no failures\n", iterations);
+	return 0;
+}
+
+#endif
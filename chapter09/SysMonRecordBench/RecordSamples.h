@@ -0,0 +1,224 @@
+#pragma once
+
+//
+// well formed records of every type, as the driver writes them, for the record reader's fuzz and benchmark targets
+//
+
+#include "../SysMonQuery/Portable.h"
+#include "../SysMon/RecordView.h"
+#include "../SysMon/CaptureFormat.h"
+#include <string.h>
+#include <vector>
+
+// one record under construction; strings follow the fixed part
+class SampleRecord {
+public:
+	template<typename T>
+	T* Init(ItemType type, LONG64 time) {
+		::memset(_data, 0, sizeof(T));
+		auto info = (T*)_data;
+		info->Type = type;
+		info->Version = ItemHeaderVersion;
+		info->Time.QuadPart = time;
+		_size = sizeof(T);
+		return info;
+	}
+
+	// returns the offset of the string and sets its length
+	USHORT AddText(const WCHAR* text, USHORT& length) {
+		auto offset = _size;
+		length = 0;
+		while (text[length])
+			length++;
+		::memcpy(_data + offset, text, length * sizeof(WCHAR));
+		_size += length * sizeof(WCHAR);
+		return offset;
+	}
+
+	USHORT AddData(const void* data, USHORT size) {
+		auto offset = _size;
+		::memcpy(_data + offset, data, size);
+		_size += size;
+		return offset;
+	}
+
+	// appends the finished record, padded to the alignment
+	void AppendTo(std::vector<UCHAR>& buffer, ULONG alignment) {
+		((ItemHeader*)_data)->Size = _size;
+		auto start = buffer.size();
+		buffer.resize(start + ((_size + alignment - 1) & ~(alignment - 1)));
+		::memcpy(buffer.data() + start, _data, _size);
+	}
+
+private:
+	alignas(8) UCHAR _data[1 << 12];
+	USHORT _size = 0;
+};
+
+// appends records of every type in the proportions of a busy system: mostly thread and image load events
+inline void AppendSampleRecords(std::vector<UCHAR>& buffer, ULONG count, ULONG alignment = 1) {
+	SampleRecord record;
+	LONG64 time = 132000000000000000LL;
+	for (ULONG i = 0; i < count; i++) {
+		time += 1000;
+		ULONG pid = 1000 + i / 64 * 4;
+		switch (i % 16) {
+			case 0:
+			{
+				auto info = record.Init<StringDefinitionInfo>(ItemType::StringDefinition, time);
+				info->Id = i + 1;
+				info->Offset = record.AddText(u"\\Device\\HarddiskVolume3\\Windows\\System32\\notepad.exe", info->Length);
+				break;
+			}
+			case 1:
+			{
+				auto info = record.Init<ProcessCreateInfo>(ItemType::ProcessCreate, time);
+				info->ProcessId = pid;
+				info->ParentProcessId = 4;
+				info->ProcessKey = pid * 2;
+				info->ImageFileNameId = i;
+				info->CommandLineOffset = record.AddText(u"\"C:\\Windows\\System32\\notepad.exe\" C:\\temp\\readme.txt", info->CommandLineLength);
+				break;
+			}
+			case 2: case 3: case 4: case 5: case 6:
+			{
+				auto info = record.Init<ImageLoadInfo>(ItemType::ImageLoad, time);
+				info->ProcessId = pid;
+				info->ProcessKey = pid * 2;
+				info->LoadAddress = 0x7FF800000000ULL + i * 0x10000;
+				info->ImageSize = 0x10000;
+				info->ImageFileNameOffset = record.AddText(u"\\Device\\HarddiskVolume3\\Windows\\System32\\kernel32.dll", info->ImageFileNameLength);
+				break;
+			}
+			case 7:
+			{
+				auto info = record.Init<RegistrySetValueInfo>(ItemType::RegistrySetValue, time);
+				ULONG value = i;
+				info->ProcessId = pid;
+				info->ThreadId = pid + 4;
+				info->DataType = 4;		// REG_DWORD
+				info->DataSize = sizeof(value);
+				info->KeyNameOffset = record.AddText(u"\\REGISTRY\\MACHINE\\SOFTWARE\\Sample", info->KeyNameLength);
+				info->ValueNameOffset = record.AddText(u"Counter", info->ValueNameLength);
+				info->DataLength = sizeof(value);
+				info->DataOffset = record.AddData(&value, sizeof(value));
+				break;
+			}
+			case 8:
+			{
+				auto info = record.Init<RegistryKeyInfo>(ItemType::RegistryRenameKey, time);
+				info->ProcessId = pid;
+				info->ThreadId = pid + 4;
+				info->KeyNameOffset = record.AddText(u"\\REGISTRY\\MACHINE\\SOFTWARE\\Sample\\Old", info->KeyNameLength);
+				info->NameOffset = record.AddText(u"New", info->NameLength);
+				break;
+			}
+			case 9:
+			{
+				auto info = record.Init<ThreadSummaryInfo>(ItemType::ThreadSummary, time);
+				info->ProcessId = pid;
+				info->ProcessKey = pid * 2;
+				info->Created = 12;
+				info->Exited = 10;
+				info->IntervalMs = 1000;
+				break;
+			}
+			case 10:
+				record.Init<EventsLostInfo>(ItemType::EventsLost, time)->Count = 3;
+				break;
+
+			case 15:
+			{
+				auto info = record.Init<ProcessExitInfo>(ItemType::ProcessExit, time);
+				info->ProcessId = pid;
+				info->ProcessKey = pid * 2;
+				info->ImageFileNameId = i - 14;
+				break;
+			}
+			default:
+			{
+				auto info = record.Init<ThreadCreateExitInfo>(i % 2 ? ItemType::ThreadCreate : ItemType::ThreadExit, time);
+				info->ThreadId = pid + i % 16;
+				info->ProcessId = pid;
+				info->ProcessKey = pid * 2;
+				break;
+			}
+		}
+		record.AppendTo(buffer, alignment);
+	}
+}
+
+// reads everything a consumer of the record would, returning a checksum so the work is not optimized away
+inline ULONG64 TouchRecord(const RecordView& record) {
+	if (record.Type() == ItemType::None)
+		return record.Size();
+
+	ULONG64 sum = record.Header()->Time.QuadPart + GetRecordProcessId(record.Header()) + GetRecordStringId(record.Header());
+	auto text = [&](USHORT offset, USHORT length) {
+		auto str = record.Text(offset, length);
+		for (size_t i = 0; i < str.Length; i++)
+			sum += str.Data[i];
+	};
+
+	if (record.Header()->Version != ItemHeaderVersion)
+		return sum;
+
+	switch (record.Type()) {
+		case ItemType::StringDefinition:
+		{
+			auto info = record.As<StringDefinitionInfo>();
+			text(info->Offset, info->Length);
+			break;
+		}
+		case ItemType::ProcessCreate:
+		{
+			auto info = record.As<ProcessCreateInfo>();
+			sum += info->ParentProcessId;
+			text(info->CommandLineOffset, info->CommandLineLength);
+			break;
+		}
+		case ItemType::ImageLoad:
+		{
+			auto info = record.As<ImageLoadInfo>();
+			sum += info->LoadAddress;
+			text(info->ImageFileNameOffset, info->ImageFileNameLength);
+			break;
+		}
+		case ItemType::RegistrySetValue:
+		{
+			auto info = record.As<RegistrySetValueInfo>();
+			text(info->KeyNameOffset, info->KeyNameLength);
+			text(info->ValueNameOffset, info->ValueNameLength);
+			auto data = record.Data(info->DataOffset, info->DataLength);
+			for (USHORT i = 0; data && i < info->DataLength; i++)
+				sum += data[i];
+			break;
+		}
+		case ItemType::RegistryCreateKey:
+		case ItemType::RegistryDeleteKey:
+		case ItemType::RegistryDeleteValue:
+		case ItemType::RegistryRenameKey:
+		{
+			auto info = record.As<RegistryKeyInfo>();
+			text(info->KeyNameOffset, info->KeyNameLength);
+			text(info->NameOffset, info->NameLength);
+			break;
+		}
+		case ItemType::ThreadSummary:
+			sum += record.As<ThreadSummaryInfo>()->Created;
+			break;
+
+		case ItemType::EventsLost:
+			sum += record.As<EventsLostInfo>()->Count;
+			break;
+
+		case ItemType::ThreadCreate:
+		case ItemType::ThreadExit:
+			sum += record.As<ThreadCreateExitInfo>()->ThreadId;
+			break;
+
+		default:
+			break;
+	}
+	return sum;
+}